@@ -5,6 +5,24 @@ pub fn build(b: *std.Build) void {
 
     const optimize = b.standardOptimizeOption(.{});
 
+    const instrument = b.option(bool, "instrument", "Compile in instrumentation probes (counters, spans, histograms)") orelse false;
+
+    const Profile = enum { embedded, desktop, datacenter };
+    const profile = b.option(Profile, "profile", "Size profile for buffers, tables and queues: embedded, desktop or datacenter (default: desktop)") orelse .desktop;
+
+    const Allocator = enum { auto, gpa, smp, c };
+    const allocator = b.option(Allocator, "allocator", "Default allocator backend: auto, gpa, smp or c (default: auto)") orelse .auto;
+    const libc = b.option(bool, "libc", "Link libc so the c allocator can be selected at runtime") orelse false;
+
+    const ReaderBackend = enum { linear, mirrored };
+    const reader = b.option(ReaderBackend, "reader", "Server connection buffers: linear or mirrored (memfd ring mapped twice, Linux only) (default: linear)") orelse .linear;
+
+    const options = b.addOptions();
+    options.addOption(bool, "instrument", instrument);
+    options.addOption([]const u8, "allocator", @tagName(allocator));
+    options.addOption([]const u8, "profile", @tagName(profile));
+    options.addOption([]const u8, "reader", @tagName(reader));
+
     // Add vaxis dependency
     const vaxis = b.dependency("vaxis", .{
         .target = target,
@@ -15,10 +33,12 @@ pub fn build(b: *std.Build) void {
         .root_source_file = b.path("src/main.zig"),
         .target = target,
         .optimize = optimize,
+        .link_libc = if (allocator == .c or libc) true else null,
     });
 
     // Add vaxis import to the module
     exe_mod.addImport("vaxis", vaxis.module("vaxis"));
+    exe_mod.addOptions("build_options", options);
 
     const exe = b.addExecutable(.{
         .name = "zignal",
@@ -38,6 +58,27 @@ pub fn build(b: *std.Build) void {
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
 
+    const bench_cmd = b.addRunArtifact(exe);
+    bench_cmd.step.dependOn(b.getInstallStep());
+    bench_cmd.addArg("bench");
+    if (b.args) |args| {
+        bench_cmd.addArgs(args);
+    }
+
+    const bench_step = b.step("bench", "Run the load generator against each allocator backend");
+    bench_step.dependOn(&bench_cmd.step);
+
+    const compare_cmd = b.addRunArtifact(exe);
+    compare_cmd.step.dependOn(b.getInstallStep());
+    compare_cmd.addArgs(&.{ "bench-compare", "--baseline" });
+    compare_cmd.addFileArg(b.path("bench/baseline.json"));
+    if (b.args) |args| {
+        compare_cmd.addArgs(args);
+    }
+
+    const compare_step = b.step("bench-compare", "Run the benchmark suite and compare against bench/baseline.json");
+    compare_step.dependOn(&compare_cmd.step);
+
     const exe_unit_tests = b.addTest(.{
         .root_module = exe_mod,
     });
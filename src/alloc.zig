@@ -0,0 +1,202 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const build_options = @import("build_options");
+const Allocator = std.mem.Allocator;
+const Alignment = std.mem.Alignment;
+
+/// Process-wide allocator backends.
+///   gpa: GeneralPurposeAllocator with leak and double-free checks (debug)
+///   smp: std.heap.smp_allocator, lock-free per-thread caches (production)
+///   c:   malloc from libc (requires -Dallocator=c or -Dlibc=true)
+pub const Backend = enum {
+    gpa,
+    smp,
+    c,
+
+    pub fn parse(name: []const u8) !Backend {
+        const backend = std.meta.stringToEnum(Backend, name) orelse return error.UnknownAllocator;
+        if (backend == .c and !builtin.link_libc) return error.LibcNotLinked;
+        return backend;
+    }
+};
+
+/// Backend chosen at build time with -Dallocator; `auto` is gpa in debug
+/// builds and smp otherwise.
+pub const default_backend: Backend = if (std.mem.eql(u8, build_options.allocator, "auto"))
+    (if (builtin.mode == .Debug) .gpa else .smp)
+else
+    std.meta.stringToEnum(Backend, build_options.allocator).?;
+
+/// Returns the backend from ZIGNAL_ALLOCATOR, or the build default.
+pub fn selectBackend() !Backend {
+    const name = std.posix.getenv("ZIGNAL_ALLOCATOR") orelse return default_backend;
+    return Backend.parse(name) catch |err| {
+        std.debug.print("Error: Invalid ZIGNAL_ALLOCATOR '{s}' (use gpa, smp or c): {}\n", .{ name, err });
+        return err;
+    };
+}
+
+/// True when ZIGNAL_ALLOC_PROFILE is set to anything but "0".
+pub fn profilingRequested() bool {
+    const value = std.posix.getenv("ZIGNAL_ALLOC_PROFILE") orelse return false;
+    return !std.mem.eql(u8, value, "0");
+}
+
+pub const Backends = struct {
+    backend: Backend,
+    gpa: std.heap.GeneralPurposeAllocator(.{}),
+
+    pub fn init(backend: Backend) Backends {
+        return .{
+            .backend = backend,
+            .gpa = .{},
+        };
+    }
+
+    pub fn deinit(self: *Backends) void {
+        if (self.backend == .gpa) {
+            _ = self.gpa.deinit();
+        }
+    }
+
+    pub fn allocator(self: *Backends) Allocator {
+        return switch (self.backend) {
+            .gpa => self.gpa.allocator(),
+            .smp => std.heap.smp_allocator,
+            .c => if (comptime builtin.link_libc) std.heap.c_allocator else unreachable,
+        };
+    }
+};
+
+/// Wraps an allocator and counts allocations per call site (the return
+/// address the caller passed to the allocator interface).
+pub const CountingAllocator = struct {
+    pub const MAX_SITES = 512;
+
+    pub const Site = struct {
+        addr: usize = 0,
+        allocs: u64 = 0,
+        resizes: u64 = 0,
+        bytes: u64 = 0,
+    };
+
+    backing: Allocator,
+    mutex: std.Thread.Mutex,
+    sites: [MAX_SITES]Site,
+    untracked_sites: u64,
+    allocs: std.atomic.Value(u64),
+    frees: std.atomic.Value(u64),
+    bytes: std.atomic.Value(u64),
+
+    pub fn init(backing: Allocator) CountingAllocator {
+        return .{
+            .backing = backing,
+            .mutex = .{},
+            .sites = @splat(.{}),
+            .untracked_sites = 0,
+            .allocs = .init(0),
+            .frees = .init(0),
+            .bytes = .init(0),
+        };
+    }
+
+    pub fn allocator(self: *CountingAllocator) Allocator {
+        return .{
+            .ptr = self,
+            .vtable = &.{
+                .alloc = alloc,
+                .resize = resize,
+                .remap = remap,
+                .free = free,
+            },
+        };
+    }
+
+    pub fn totalAllocs(self: *const CountingAllocator) u64 {
+        return self.allocs.load(.monotonic);
+    }
+
+    /// Prints the busiest call sites to stderr. Resolve addresses with
+    /// `addr2line -e zig-out/bin/zignal <addr>`.
+    pub fn printReport(self: *CountingAllocator) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        var order: [MAX_SITES]*const Site = undefined;
+        var count: usize = 0;
+        for (&self.sites) |*site| {
+            if (site.addr == 0) continue;
+            order[count] = site;
+            count += 1;
+        }
+
+        std.mem.sort(*const Site, order[0..count], {}, struct {
+            fn lessThan(_: void, a: *const Site, b: *const Site) bool {
+                return a.allocs > b.allocs;
+            }
+        }.lessThan);
+
+        std.debug.print("Allocation profile: {d} allocs, {d} frees, {d} bytes, {d} call sites\n", .{
+            self.allocs.load(.monotonic),
+            self.frees.load(.monotonic),
+            self.bytes.load(.monotonic),
+            count,
+        });
+        for (order[0..@min(count, 20)]) |site| {
+            std.debug.print("  0x{x:0>16}  allocs {d:>10}  resizes {d:>8}  bytes {d:>12}\n", .{
+                site.addr, site.allocs, site.resizes, site.bytes,
+            });
+        }
+        if (self.untracked_sites > 0) {
+            std.debug.print("  ({d} allocations from sites beyond the table)\n", .{self.untracked_sites});
+        }
+    }
+
+    fn record(self: *CountingAllocator, ret_addr: usize, len: usize, is_resize: bool) void {
+        self.mutex.lock();
+        defer self.mutex.unlock();
+
+        var idx = std.hash.int(ret_addr) % MAX_SITES;
+        var probes: usize = 0;
+        while (probes < MAX_SITES) : (probes += 1) {
+            const site = &self.sites[idx];
+            if (site.addr == 0) site.addr = ret_addr;
+            if (site.addr == ret_addr) {
+                if (is_resize) site.resizes += 1 else site.allocs += 1;
+                site.bytes += len;
+                return;
+            }
+            idx = (idx + 1) % MAX_SITES;
+        }
+        self.untracked_sites += 1;
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, alignment: Alignment, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        const result = self.backing.rawAlloc(len, alignment, ret_addr) orelse return null;
+        _ = self.allocs.fetchAdd(1, .monotonic);
+        _ = self.bytes.fetchAdd(len, .monotonic);
+        self.record(ret_addr, len, false);
+        return result;
+    }
+
+    fn resize(ctx: *anyopaque, memory: []u8, alignment: Alignment, new_len: usize, ret_addr: usize) bool {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        if (!self.backing.rawResize(memory, alignment, new_len, ret_addr)) return false;
+        if (new_len > memory.len) self.record(ret_addr, new_len - memory.len, true);
+        return true;
+    }
+
+    fn remap(ctx: *anyopaque, memory: []u8, alignment: Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        const result = self.backing.rawRemap(memory, alignment, new_len, ret_addr) orelse return null;
+        if (new_len > memory.len) self.record(ret_addr, new_len - memory.len, true);
+        return result;
+    }
+
+    fn free(ctx: *anyopaque, memory: []u8, alignment: Alignment, ret_addr: usize) void {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        _ = self.frees.fetchAdd(1, .monotonic);
+        self.backing.rawFree(memory, alignment, ret_addr);
+    }
+};
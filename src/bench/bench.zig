@@ -0,0 +1,131 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const Allocator = std.mem.Allocator;
+
+const alloc = @import("../alloc.zig");
+const loadgen = @import("loadgen.zig");
+
+const Backend = alloc.Backend;
+
+const usage =
+    \\Usage: zignal bench [--clients N] [--messages N] [--size BYTES] [--rate MSG/S]
+    \\                    [--allocator all|gpa|smp|c]
+    \\
+;
+
+/// Runs the load generator against a headless server once per allocator
+/// backend and prints throughput, latency and allocations per message.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var options: loadgen.Options = .{};
+    var only: ?Backend = null;
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) : (arg_index += 2) {
+        const flag = args[arg_index];
+        if (arg_index + 1 >= args.len) {
+            std.debug.print("Error: {s} requires a value.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+        const value = args[arg_index + 1];
+
+        if (std.mem.eql(u8, flag, "--allocator")) {
+            if (std.mem.eql(u8, value, "all")) {
+                only = null;
+            } else {
+                only = Backend.parse(value) catch |err| {
+                    std.debug.print("Error: Invalid allocator '{s}': {}\n{s}", .{ value, err, usage });
+                    return error.InvalidArguments;
+                };
+            }
+            continue;
+        }
+
+        const number = std.fmt.parseInt(usize, value, 10) catch {
+            std.debug.print("Error: Invalid {s} value '{s}'.\n{s}", .{ flag, value, usage });
+            return error.InvalidArguments;
+        };
+        if (std.mem.eql(u8, flag, "--clients")) {
+            if (number < 2) {
+                std.debug.print("Error: --clients must be at least 2.\n", .{});
+                return error.InvalidArguments;
+            }
+            options.clients = number;
+        } else if (std.mem.eql(u8, flag, "--messages")) {
+            options.messages_per_client = number;
+        } else if (std.mem.eql(u8, flag, "--size")) {
+            options.message_size = number;
+        } else if (std.mem.eql(u8, flag, "--rate")) {
+            options.rate = number;
+        } else {
+            std.debug.print("Error: Unknown bench option '{s}'.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+    }
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("{d} clients x {d} messages of {d} bytes, rate {d}/s\n\n", .{
+        options.clients,
+        options.messages_per_client,
+        options.message_size,
+        options.rate,
+    });
+    try out.print("{s:<6} {s:>12} {s:>10} {s:>10} {s:>10} {s:>10} {s:>12}\n", .{
+        "alloc", "deliveries/s", "delivered", "p50 us", "p99 us", "max us", "allocs/msg",
+    });
+    try out.flush();
+
+    for (std.enums.values(Backend)) |backend| {
+        if (only) |b| {
+            if (b != backend) continue;
+        }
+        if (backend == .c and !builtin.link_libc) continue;
+
+        const measurement = try measure(allocator, backend, options);
+        const result = measurement.result;
+
+        try out.print("{s:<6} {d:>12.0} {d:>9.1}% {d:>10} {d:>10} {d:>10} {d:>12.2}\n", .{
+            @tagName(backend),
+            result.deliveriesPerSec(),
+            result.deliveryRatio() * 100,
+            result.latency.percentile(50),
+            result.latency.percentile(99),
+            result.latency.max.load(.monotonic),
+            measurement.allocs_per_msg,
+        });
+        try out.flush();
+    }
+}
+
+pub const Measurement = struct {
+    result: loadgen.Result,
+    /// Server allocations per message sent, including connection setup.
+    allocs_per_msg: f64,
+};
+
+/// One load generator run against a headless server whose allocations go
+/// through `backend`. The clients use `allocator`.
+pub fn measure(allocator: Allocator, backend: Backend, options: loadgen.Options) !Measurement {
+    var backends = alloc.Backends.init(backend);
+    defer backends.deinit();
+    var counting = alloc.CountingAllocator.init(backends.allocator());
+
+    const server = try loadgen.HeadlessServer.start(counting.allocator(), options.clients + 1);
+    const before = counting.totalAllocs();
+    const result = loadgen.run(allocator, server.address(), options) catch |err| {
+        server.stop();
+        return err;
+    };
+    const server_allocs = counting.totalAllocs() - before;
+    server.stop();
+
+    return .{
+        .result = result,
+        .allocs_per_msg = if (result.sent == 0)
+            0
+        else
+            @as(f64, @floatFromInt(server_allocs)) / @as(f64, @floatFromInt(result.sent)),
+    };
+}
@@ -0,0 +1,244 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+const alloc = @import("../alloc.zig");
+const bench = @import("bench.zig");
+const framing = @import("framing.zig");
+
+const usage =
+    \\Usage: zignal bench-compare [--baseline PATH] [--threshold PCT] [--runs N] [--write] [--ci]
+    \\
+;
+
+pub const DEFAULT_BASELINE = "bench/baseline.json";
+
+const Better = enum {
+    higher,
+    lower,
+};
+
+const Benchmark = struct {
+    name: []const u8,
+    unit: []const u8,
+    better: Better,
+    /// Allowed change in the bad direction, in percent, before a result
+    /// counts as a regression. Overridden by the baseline file or --threshold.
+    threshold_pct: f64,
+};
+
+const suite = [_]Benchmark{
+    .{ .name = "fanout.deliveries_per_s", .unit = "msg/s", .better = .higher, .threshold_pct = 10 },
+    // Histogram percentiles move in power-of-two steps, so allow one step.
+    .{ .name = "fanout.p99_latency_us", .unit = "us", .better = .lower, .threshold_pct = 100 },
+    .{ .name = "fanout.allocs_per_msg", .unit = "allocs", .better = .lower, .threshold_pct = 5 },
+    .{ .name = "framing.frames_per_s", .unit = "frames/s", .better = .higher, .threshold_pct = 10 },
+};
+
+/// Baseline file format. A null value means the benchmark has not been
+/// recorded on the reference machine yet; it is reported as new, and fails
+/// the comparison in CI mode so a gate cannot pass without a baseline.
+const Baseline = struct {
+    benchmarks: []const Entry,
+
+    const Entry = struct {
+        name: []const u8,
+        value: ?f64 = null,
+        threshold_pct: ?f64 = null,
+    };
+
+    fn find(self: Baseline, name: []const u8) ?Entry {
+        for (self.benchmarks) |entry| {
+            if (std.mem.eql(u8, entry.name, name)) return entry;
+        }
+        return null;
+    }
+};
+
+/// Runs the benchmark suite, compares each result with the baseline and
+/// fails with error.BenchmarkRegression if any got worse by more than its
+/// threshold. With --write, stores the results as the new baseline instead.
+/// With --ci, or when the CI environment variable is set, a benchmark with
+/// no recorded baseline fails with error.MissingBaseline.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var baseline_path: []const u8 = DEFAULT_BASELINE;
+    var threshold_override: ?f64 = null;
+    var runs: usize = 3;
+    var write = false;
+    var ci = std.process.hasEnvVarConstant("CI");
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) {
+        const flag = args[arg_index];
+        if (std.mem.eql(u8, flag, "--write")) {
+            write = true;
+            arg_index += 1;
+            continue;
+        }
+        if (std.mem.eql(u8, flag, "--ci")) {
+            ci = true;
+            arg_index += 1;
+            continue;
+        }
+        if (arg_index + 1 >= args.len) {
+            std.debug.print("Error: {s} requires a value.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+        const value = args[arg_index + 1];
+        if (std.mem.eql(u8, flag, "--baseline")) {
+            baseline_path = value;
+        } else if (std.mem.eql(u8, flag, "--threshold")) {
+            threshold_override = std.fmt.parseFloat(f64, value) catch {
+                std.debug.print("Error: Invalid threshold '{s}'.\n{s}", .{ value, usage });
+                return error.InvalidArguments;
+            };
+        } else if (std.mem.eql(u8, flag, "--runs")) {
+            runs = std.fmt.parseInt(usize, value, 10) catch 0;
+            if (runs == 0) {
+                std.debug.print("Error: Invalid runs value '{s}'.\n{s}", .{ value, usage });
+                return error.InvalidArguments;
+            }
+        } else {
+            std.debug.print("Error: Unknown bench-compare option '{s}'.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+        arg_index += 2;
+    }
+
+    const bytes = std.fs.cwd().readFileAlloc(allocator, baseline_path, 1024 * 1024) catch |err| {
+        std.debug.print("Error: Cannot read baseline '{s}': {}\n", .{ baseline_path, err });
+        return err;
+    };
+    defer allocator.free(bytes);
+
+    const parsed = std.json.parseFromSlice(Baseline, allocator, bytes, .{ .ignore_unknown_fields = true }) catch |err| {
+        std.debug.print("Error: Invalid baseline '{s}': {}\n", .{ baseline_path, err });
+        return err;
+    };
+    defer parsed.deinit();
+    const baseline = parsed.value;
+
+    const current = try measureSuite(allocator, runs);
+
+    var thresholds: [suite.len]f64 = undefined;
+    for (suite, &thresholds) |benchmark, *threshold| {
+        const entry = baseline.find(benchmark.name);
+        threshold.* = threshold_override orelse
+            (if (entry) |e| e.threshold_pct else null) orelse
+            benchmark.threshold_pct;
+    }
+
+    if (write) {
+        try writeBaseline(baseline_path, current, thresholds);
+        std.debug.print("Wrote {d} results to {s}\n", .{ suite.len, baseline_path });
+        return;
+    }
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("{s:<26} {s:>14} {s:>14} {s:>9} {s:>7}  {s}\n", .{
+        "benchmark", "baseline", "current", "change", "limit", "status",
+    });
+
+    var regressions: usize = 0;
+    var missing: usize = 0;
+    for (suite, current, thresholds) |benchmark, value, threshold| {
+        const base = if (baseline.find(benchmark.name)) |e| e.value else null;
+
+        try out.print("{s:<26} ", .{benchmark.name});
+        if (base) |b| {
+            try out.print("{d:>14.2} ", .{b});
+        } else {
+            try out.print("{s:>14} ", .{"-"});
+        }
+        try out.print("{d:>14.2} ", .{value});
+
+        const b = base orelse {
+            const label = if (ci) "MISSING" else "new";
+            try out.print("{s:>9} {d:>6.0}%  {s} ({s})\n", .{ "-", threshold, label, benchmark.unit });
+            missing += 1;
+            continue;
+        };
+
+        const change_pct = if (b == 0)
+            (if (value == 0) 0 else std.math.inf(f64))
+        else
+            (value - b) / b * 100;
+        const worse_pct = switch (benchmark.better) {
+            .higher => -change_pct,
+            .lower => change_pct,
+        };
+
+        const status: []const u8 = if (worse_pct > threshold)
+            "REGRESSED"
+        else if (-worse_pct > threshold)
+            "improved"
+        else
+            "ok";
+        if (worse_pct > threshold) regressions += 1;
+
+        try out.print("{d:>8.1}% {d:>6.0}%  {s}\n", .{ change_pct, threshold, status });
+    }
+    try out.flush();
+
+    if (regressions > 0) {
+        std.debug.print("{d} benchmark(s) regressed beyond their threshold.\n", .{regressions});
+        return error.BenchmarkRegression;
+    }
+    if (ci and missing > 0) {
+        std.debug.print("{d} benchmark(s) have no baseline in {s}; record one with --write on the reference machine.\n", .{ missing, baseline_path });
+        return error.MissingBaseline;
+    }
+}
+
+/// Median of `runs` runs of each benchmark, in suite order.
+fn measureSuite(allocator: Allocator, runs: usize) ![suite.len]f64 {
+    const samples = try allocator.alloc([suite.len]f64, runs);
+    defer allocator.free(samples);
+
+    for (samples, 0..) |*sample, i| {
+        std.debug.print("Run {d}/{d}...\n", .{ i + 1, runs });
+
+        const measurement = try bench.measure(allocator, alloc.default_backend, .{
+            .clients = 50,
+            .messages_per_client = 200,
+            .message_size = 64,
+        });
+        sample[0] = measurement.result.deliveriesPerSec();
+        sample[1] = @floatFromInt(measurement.result.latency.percentile(99));
+        sample[2] = measurement.allocs_per_msg;
+        sample[3] = try framing.run(allocator, 1_000_000, 64);
+    }
+
+    var medians: [suite.len]f64 = undefined;
+    const column = try allocator.alloc(f64, runs);
+    defer allocator.free(column);
+    for (&medians, 0..) |*median, b| {
+        for (samples, column) |sample, *v| v.* = sample[b];
+        std.mem.sort(f64, column, {}, std.sort.asc(f64));
+        median.* = column[runs / 2];
+    }
+    return medians;
+}
+
+fn writeBaseline(path: []const u8, values: [suite.len]f64, thresholds: [suite.len]f64) !void {
+    const file = try std.fs.cwd().createFile(path, .{});
+    defer file.close();
+
+    var buffer: [1024]u8 = undefined;
+    var file_writer = file.writer(&buffer);
+    const out = &file_writer.interface;
+
+    try out.writeAll("{\n  \"benchmarks\": [\n");
+    for (suite, values, thresholds, 0..) |benchmark, value, threshold, i| {
+        try out.print("    {{ \"name\": \"{s}\", \"value\": {d:.4}, \"threshold_pct\": {d} }}{s}\n", .{
+            benchmark.name,
+            value,
+            threshold,
+            if (i + 1 < suite.len) "," else "",
+        });
+    }
+    try out.writeAll("  ]\n}\n");
+    try out.flush();
+}
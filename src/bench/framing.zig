@@ -0,0 +1,69 @@
+const std = @import("std");
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const Reader = @import("../reader.zig").Reader;
+const loadgen = @import("loadgen.zig");
+
+const CHUNK_SIZE = 64 * 1024;
+/// Frames taken per call, as the server's event loop does.
+const READ_BATCH = 32;
+
+/// Parses `frames` length-prefixed frames of `frame_size` bytes with
+/// `Reader.readBatch`, the server's read path, over a local socket pair
+/// fed by a writer thread in 64 KiB chunks. Returns frames per second.
+pub fn run(allocator: Allocator, frames: usize, frame_size: usize) !f64 {
+    const size = std.math.clamp(frame_size, 1, config.BUFFER_SIZE - 4);
+    const per_chunk = @max(1, CHUNK_SIZE / (size + 4));
+    const chunks = std.math.divCeil(usize, frames, per_chunk) catch unreachable;
+    const total = chunks * per_chunk;
+
+    const chunk = try allocator.alloc(u8, per_chunk * (size + 4));
+    defer allocator.free(chunk);
+    var offset: usize = 0;
+    while (offset < chunk.len) : (offset += size + 4) {
+        std.mem.writeInt(u32, chunk[offset..][0..4], @intCast(size), .little);
+        @memset(chunk[offset + 4 ..][0..size], 'x');
+    }
+
+    var reader = try Reader.initBackend(allocator, config.BUFFER_SIZE, config.READER_BACKEND);
+    defer reader.deinit(allocator);
+
+    var timer = try std.time.Timer.start();
+
+    var fds: [2]posix.socket_t = undefined;
+    const linux = std.os.linux;
+    const rc = linux.socketpair(linux.AF.UNIX, linux.SOCK.STREAM | linux.SOCK.CLOEXEC, 0, &fds);
+    if (linux.E.init(rc) != .SUCCESS) return error.SocketPairFailed;
+    defer posix.close(fds[0]);
+
+    const feeder = std.Thread.spawn(.{}, feed, .{ fds[1], chunk, chunks }) catch |err| {
+        posix.close(fds[1]);
+        return err;
+    };
+    defer feeder.join();
+    // On error, unblock the feeder before joining it.
+    errdefer posix.shutdown(fds[0], .both) catch {};
+
+    var out: [READ_BATCH][]const u8 = undefined;
+    var parsed: usize = 0;
+    while (parsed < total) {
+        const batch = try reader.readBatch(fds[0], &out);
+        if (batch.frames.len == 0) return error.UnexpectedWouldBlock;
+        for (batch.frames) |msg| {
+            if (msg.len != size) return error.CorruptFrame;
+        }
+        parsed += batch.frames.len;
+    }
+
+    const elapsed_ns = timer.read();
+    return @as(f64, @floatFromInt(total)) * std.time.ns_per_s / @as(f64, @floatFromInt(@max(elapsed_ns, 1)));
+}
+
+fn feed(socket: posix.socket_t, chunk: []const u8, chunks: usize) void {
+    defer posix.close(socket);
+    for (0..chunks) |_| {
+        loadgen.writeAll(socket, chunk) catch return;
+    }
+}
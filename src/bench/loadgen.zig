@@ -0,0 +1,340 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const Reader = @import("../reader.zig").Reader;
+const Server = @import("../server/server.zig").Server;
+const MemoryLimits = @import("../server/memory.zig").Limits;
+const Histogram = @import("../server/metrics.zig").Histogram;
+
+const BUFFER_SIZE = config.BUFFER_SIZE;
+
+/// Chat frames sent by the load generator look like
+/// "loadgen: <send time ns><sender><seq><filler>", with the three fields as
+/// 16, 8 and 8 hex digits, so they are valid chat lines and carry what is
+/// needed to measure latency and check per-sender ordering.
+const PREFIX = "loadgen: ";
+const HEADER_LEN = PREFIX.len + 32;
+
+/// A server running headless on an ephemeral loopback port in its own thread.
+pub const HeadlessServer = struct {
+    server: Server,
+    thread: std.Thread,
+
+    pub fn start(allocator: Allocator, max_clients: usize) !*HeadlessServer {
+        return startWithLimits(allocator, max_clients, .{});
+    }
+
+    /// Like `start`, with memory limits applied before the server runs.
+    pub fn startWithLimits(allocator: Allocator, max_clients: usize, limits: MemoryLimits) !*HeadlessServer {
+        const self = try allocator.create(HeadlessServer);
+        errdefer allocator.destroy(self);
+
+        const address = try net.Address.parseIp4("127.0.0.1", 0);
+        self.server = try Server.init(allocator, address, max_clients);
+        errdefer self.server.deinit();
+        self.server.headless = true;
+        self.server.budget.limits = limits;
+
+        self.thread = try std.Thread.spawn(.{}, runServer, .{&self.server});
+
+        var waited_ms: usize = 0;
+        while (self.server.boundPort() == 0) : (waited_ms += 1) {
+            if (waited_ms >= 5000) {
+                self.server.stop();
+                self.thread.join();
+                return error.ServerStartTimeout;
+            }
+            std.Thread.sleep(std.time.ns_per_ms);
+        }
+
+        return self;
+    }
+
+    pub fn stop(self: *HeadlessServer) void {
+        self.server.stop();
+        self.thread.join();
+
+        const allocator = self.server.allocator;
+        self.server.deinit();
+        allocator.destroy(self);
+    }
+
+    pub fn address(self: *const HeadlessServer) net.Address {
+        return net.Address.initIp4(.{ 127, 0, 0, 1 }, self.server.boundPort());
+    }
+
+    fn runServer(server: *Server) void {
+        server.start() catch |err| {
+            std.debug.print("Headless server failed: {}\n", .{err});
+        };
+    }
+};
+
+pub const Options = struct {
+    clients: usize = 50,
+    messages_per_client: usize = 200,
+    /// Payload size in bytes, clamped to fit the timestamp header and one reader buffer.
+    message_size: usize = 64,
+    /// Messages per second across all clients; 0 sends as fast as possible.
+    rate: u64 = 0,
+    /// Stop waiting for deliveries after this long without progress.
+    idle_timeout_ms: u64 = 500,
+};
+
+pub const Result = struct {
+    clients: usize,
+    sent: u64,
+    expected: u64,
+    delivered: u64,
+    elapsed_ns: u64,
+    /// Deliveries that arrived before an earlier message from the same sender.
+    out_of_order: u64,
+    /// Deliveries whose length or payload differs from what was sent.
+    corrupt: u64,
+    /// Send-to-receive latency of every delivery, in microseconds.
+    latency: Histogram,
+
+    pub fn deliveriesPerSec(self: *const Result) f64 {
+        if (self.elapsed_ns == 0) return 0;
+        return @as(f64, @floatFromInt(self.delivered)) * std.time.ns_per_s / @as(f64, @floatFromInt(self.elapsed_ns));
+    }
+
+    pub fn deliveryRatio(self: *const Result) f64 {
+        if (self.expected == 0) return 1;
+        return @as(f64, @floatFromInt(self.delivered)) / @as(f64, @floatFromInt(self.expected));
+    }
+};
+
+const Conn = struct {
+    socket: posix.socket_t,
+    reader: Reader,
+    welcomed: bool = false,
+    /// Next expected sequence number from each sender.
+    next_seq: []u32,
+};
+
+/// Connects `options.clients` loopback clients to `address`, has each send
+/// `messages_per_client` frames round-robin from a sender thread, and counts
+/// every broadcast delivery on the calling thread.
+pub fn run(allocator: Allocator, address: net.Address, options: Options) !Result {
+    const conns = try allocator.alloc(Conn, options.clients);
+    defer allocator.free(conns);
+
+    var connected: usize = 0;
+    defer for (conns[0..connected]) |*conn| {
+        posix.close(conn.socket);
+        conn.reader.deinit(allocator);
+    };
+
+    const next_seq = try allocator.alloc(u32, conns.len * conns.len);
+    defer allocator.free(next_seq);
+    @memset(next_seq, 0);
+
+    for (conns, 0..) |*conn, idx| {
+        const socket = try connect(address);
+        errdefer posix.close(socket);
+        conn.* = .{
+            .socket = socket,
+            .reader = try Reader.init(allocator, BUFFER_SIZE),
+            .next_seq = next_seq[idx * conns.len ..][0..conns.len],
+        };
+        connected += 1;
+    }
+
+    const polls = try allocator.alloc(posix.pollfd, conns.len);
+    defer allocator.free(polls);
+    for (conns, polls) |conn, *pfd| {
+        pfd.* = .{ .fd = conn.socket, .events = posix.POLL.IN, .revents = 0 };
+    }
+
+    // Wait until the server has accepted everyone, or early messages
+    // would not reach late joiners.
+    const welcome_deadline = std.time.milliTimestamp() + 5000;
+    while (countWelcomed(conns) < conns.len) {
+        if (std.time.milliTimestamp() > welcome_deadline) return error.WelcomeTimeout;
+        try receive(conns, polls, null, 0, 0, 50);
+    }
+
+    var sender: Sender = .{
+        .conns = conns,
+        .options = options,
+        .start_ns = std.time.nanoTimestamp(),
+    };
+    const sender_thread = try std.Thread.spawn(.{}, Sender.run, .{&sender});
+
+    var result: Result = .{
+        .clients = conns.len,
+        .sent = 0,
+        .expected = 0,
+        .delivered = 0,
+        .elapsed_ns = 0,
+        .out_of_order = 0,
+        .corrupt = 0,
+        .latency = .{},
+    };
+
+    const size = frameSize(options);
+    var last_progress = std.time.nanoTimestamp();
+    while (true) {
+        const before = result.delivered;
+        try receive(conns, polls, &result, sender.start_ns, size, 50);
+        const now = std.time.nanoTimestamp();
+        if (result.delivered != before) last_progress = now;
+
+        if (!sender.done.load(.acquire)) continue;
+
+        result.sent = sender.sent;
+        result.expected = sender.sent * (conns.len - 1);
+        if (result.delivered >= result.expected) break;
+        if (now - last_progress >= @as(i128, options.idle_timeout_ms) * std.time.ns_per_ms) break;
+    }
+
+    sender_thread.join();
+    if (sender.err) |err| return err;
+
+    result.elapsed_ns = @intCast(last_progress - sender.start_ns);
+    return result;
+}
+
+/// Polls all clients once and reads every complete frame. Frames carrying a
+/// load generator timestamp are counted in `result` and checked against the
+/// `size` and payload they were sent with; others are discarded.
+fn receive(conns: []Conn, polls: []posix.pollfd, result: ?*Result, start_ns: i128, size: usize, timeout_ms: i32) !void {
+    const ready = try posix.poll(polls, timeout_ms);
+    if (ready == 0) return;
+
+    for (conns, polls) |*conn, *pfd| {
+        if (pfd.revents == 0) continue;
+        if (pfd.revents & posix.POLL.IN != posix.POLL.IN) return error.ConnectionClosed;
+
+        while (try conn.reader.readMessage(conn.socket)) |msg| {
+            const r = result orelse {
+                conn.welcomed = true;
+                continue;
+            };
+            if (msg.len < HEADER_LEN or !std.mem.startsWith(u8, msg, PREFIX)) continue;
+
+            const fields = msg[PREFIX.len..HEADER_LEN];
+            const sent_ns = std.fmt.parseInt(u64, fields[0..16], 16) catch continue;
+            const sender = std.fmt.parseInt(u32, fields[16..24], 16) catch continue;
+            const seq = std.fmt.parseInt(u32, fields[24..32], 16) catch continue;
+            if (sender >= conn.next_seq.len) continue;
+
+            const now_ns: u64 = @intCast(std.time.nanoTimestamp() - start_ns);
+            r.latency.observe((now_ns -| sent_ns) / std.time.ns_per_us);
+            r.delivered += 1;
+
+            if (msg.len != size or !payloadMatches(msg[HEADER_LEN..], sender, seq)) r.corrupt += 1;
+            if (seq < conn.next_seq[sender]) r.out_of_order += 1;
+            conn.next_seq[sender] = @max(conn.next_seq[sender], seq + 1);
+        }
+    }
+}
+
+fn countWelcomed(conns: []const Conn) usize {
+    var count: usize = 0;
+    for (conns) |conn| {
+        if (conn.welcomed) count += 1;
+    }
+    return count;
+}
+
+const Sender = struct {
+    conns: []Conn,
+    options: Options,
+    start_ns: i128,
+    sent: u64 = 0,
+    done: std.atomic.Value(bool) = .init(false),
+    err: ?anyerror = null,
+
+    fn run(self: *Sender) void {
+        defer self.done.store(true, .release);
+        self.send() catch |err| {
+            self.err = err;
+        };
+    }
+
+    fn send(self: *Sender) !void {
+        const size = frameSize(self.options);
+        var frame: [BUFFER_SIZE]u8 = undefined;
+        std.mem.writeInt(u32, frame[0..4], @intCast(size), .little);
+        @memcpy(frame[4..][0..PREFIX.len], PREFIX);
+
+        const total = self.options.messages_per_client * self.conns.len;
+        var n: u64 = 0;
+        while (n < total) : (n += 1) {
+            if (self.options.rate > 0) {
+                const due_ns = self.start_ns + @as(i128, n * std.time.ns_per_s / self.options.rate);
+                const now_ns = std.time.nanoTimestamp();
+                if (due_ns > now_ns) std.Thread.sleep(@intCast(due_ns - now_ns));
+            }
+
+            const sender = n % self.conns.len;
+            const seq = n / self.conns.len;
+            const sent_ns: u64 = @intCast(std.time.nanoTimestamp() - self.start_ns);
+            _ = std.fmt.bufPrint(frame[4 + PREFIX.len ..][0..32], "{x:0>16}{x:0>8}{x:0>8}", .{ sent_ns, sender, seq }) catch unreachable;
+            fillPayload(frame[4 + HEADER_LEN .. 4 + size], @intCast(sender), @intCast(seq));
+
+            try writeAll(self.conns[sender].socket, frame[0 .. 4 + size]);
+            self.sent = n + 1;
+        }
+    }
+};
+
+/// Payload length of every frame, clamped to fit the header and one
+/// reader buffer.
+fn frameSize(options: Options) usize {
+    return std.math.clamp(options.message_size, HEADER_LEN, BUFFER_SIZE - 4);
+}
+
+/// The bytes after the header depend on sender, sequence number and
+/// position, so a dropped, repeated or misplaced chunk shows up.
+fn payloadByte(sender: u32, seq: u32, i: usize) u8 {
+    return 'a' + @as(u8, @intCast((i +% sender *% 7 +% seq *% 13) % 26));
+}
+
+fn fillPayload(payload: []u8, sender: u32, seq: u32) void {
+    for (payload, 0..) |*byte, i| byte.* = payloadByte(sender, seq, i);
+}
+
+fn payloadMatches(payload: []const u8, sender: u32, seq: u32) bool {
+    for (payload, 0..) |byte, i| {
+        if (byte != payloadByte(sender, seq, i)) return false;
+    }
+    return true;
+}
+
+/// Opens a non-blocking loopback connection, waiting for it to complete.
+pub fn connect(address: net.Address) !posix.socket_t {
+    const socket = try posix.socket(address.any.family, posix.SOCK.STREAM | posix.SOCK.NONBLOCK, posix.IPPROTO.TCP);
+    errdefer posix.close(socket);
+
+    posix.connect(socket, &address.any, address.getOsSockLen()) catch |err| switch (err) {
+        error.WouldBlock => {
+            var pfd = [_]posix.pollfd{.{ .fd = socket, .events = posix.POLL.OUT, .revents = 0 }};
+            if (try posix.poll(&pfd, 5000) == 0) return error.ConnectionTimedOut;
+            try posix.getsockoptError(socket);
+        },
+        else => return err,
+    };
+
+    return socket;
+}
+
+/// Writes all of `bytes` to a non-blocking socket, waiting when it is full.
+pub fn writeAll(socket: posix.socket_t, bytes: []const u8) !void {
+    var written: usize = 0;
+    while (written < bytes.len) {
+        written += posix.write(socket, bytes[written..]) catch |err| switch (err) {
+            error.WouldBlock => {
+                var pfd = [_]posix.pollfd{.{ .fd = socket, .events = posix.POLL.OUT, .revents = 0 }};
+                _ = try posix.poll(&pfd, 100);
+                continue;
+            },
+            else => return err,
+        };
+    }
+}
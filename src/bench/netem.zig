@@ -0,0 +1,472 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const loadgen = @import("loadgen.zig");
+
+const usage =
+    \\Usage: zignal netem-proxy <LISTEN_PORT> <IP> <PORT> [OPTIONS]
+    \\
+    \\  --latency <ms>          One-way delay added in each direction (default: 0)
+    \\  --jitter <ms>           Random extra delay of up to +/- this much, order preserved (default: 0)
+    \\  --bandwidth <KiB/s>     Per-direction cap for each connection, 0 for none (default: 0)
+    \\  --stall-every <ms>      Mean time between stalls, 0 for none (default: 0)
+    \\  --stall <ms>            How long each stall holds back delivery (default: 500)
+    \\  --reset-after <ms>      Mean connection lifetime before an injected reset, 0 for none (default: 0)
+    \\  --seed <n>              Random seed for jitter, stalls and resets (default: random)
+    \\
+;
+
+/// Bytes held per direction before the proxy stops reading from the
+/// sender, so a slow or stalled path pushes back like a real one.
+const MAX_QUEUED = 4 * 1024 * 1024;
+const READ_CHUNK = 16 * 1024;
+/// Poll timeout when no timer is pending.
+const IDLE_POLL_MS = 100;
+/// Longest accepted time option, so nanosecond arithmetic cannot overflow.
+const MAX_OPTION_MS = std.time.ms_per_day;
+
+const Options = struct {
+    latency_ms: u64 = 0,
+    jitter_ms: u64 = 0,
+    /// Bytes per second; 0 is unlimited.
+    bandwidth: u64 = 0,
+    stall_every_ms: u64 = 0,
+    stall_ms: u64 = 500,
+    reset_after_ms: u64 = 0,
+    seed: ?u64 = null,
+};
+
+/// One direction of a proxied connection. Data read from `from` is queued
+/// in chunks, each released to `to` once its delay has passed and the
+/// bandwidth budget allows.
+const Pipe = struct {
+    from: posix.socket_t,
+    to: posix.socket_t,
+    /// Queued bytes; `bytes[sent..]` is not yet written.
+    bytes: std.ArrayListUnmanaged(u8) = .{},
+    sent: usize = 0,
+    chunks: std.ArrayListUnmanaged(Chunk) = .{},
+    chunk_head: usize = 0,
+    last_release_ns: u64 = 0,
+    tokens: f64 = 0,
+    refilled_ns: u64 = 0,
+    stall_end_ns: u64 = 0,
+    next_stall_ns: u64 = std.math.maxInt(u64),
+    /// The last write would have blocked; wait for POLLOUT on `to`.
+    blocked: bool = false,
+    eof: bool = false,
+    shut: bool = false,
+    total: usize = 0,
+
+    const Chunk = struct {
+        release_ns: u64,
+        len: usize,
+    };
+
+    fn deinit(self: *Pipe, allocator: Allocator) void {
+        self.bytes.deinit(allocator);
+        self.chunks.deinit(allocator);
+    }
+
+    fn queued(self: *const Pipe) usize {
+        return self.bytes.items.len - self.sent;
+    }
+
+    fn wantsRead(self: *const Pipe) bool {
+        return !self.eof and self.queued() < MAX_QUEUED;
+    }
+
+    /// Reads what `from` has available and schedules it for delivery.
+    fn fill(self: *Pipe, allocator: Allocator, proxy: *Proxy, now: u64) !void {
+        while (self.wantsRead()) {
+            try self.bytes.ensureUnusedCapacity(allocator, READ_CHUNK);
+            try self.chunks.ensureUnusedCapacity(allocator, 1);
+            const n = posix.read(self.from, self.bytes.unusedCapacitySlice()[0..READ_CHUNK]) catch |err| switch (err) {
+                error.WouldBlock => return,
+                else => return err,
+            };
+            if (n == 0) {
+                self.eof = true;
+                return;
+            }
+            self.bytes.items.len += n;
+
+            const release = @max(self.last_release_ns, now + proxy.delayNs());
+            self.last_release_ns = release;
+            self.chunks.appendAssumeCapacity(.{ .release_ns = release, .len = n });
+        }
+    }
+
+    /// Writes whatever is due, within the bandwidth budget and outside
+    /// stalls.
+    fn pump(self: *Pipe, proxy: *Proxy, now: u64) !void {
+        if (now >= self.next_stall_ns) {
+            self.stall_end_ns = now + proxy.options.stall_ms * std.time.ns_per_ms;
+            self.next_stall_ns = self.stall_end_ns + proxy.jittered(proxy.options.stall_every_ms);
+            proxy.stalls += 1;
+        }
+        if (now < self.stall_end_ns) return;
+
+        self.refill(proxy.options.bandwidth, now);
+        while (self.chunk_head < self.chunks.items.len and !self.blocked) {
+            const chunk = &self.chunks.items[self.chunk_head];
+            if (chunk.release_ns > now) break;
+
+            var len = chunk.len;
+            if (proxy.options.bandwidth != 0) {
+                len = @min(len, @as(usize, @intFromFloat(self.tokens)));
+                if (len == 0) break;
+            }
+
+            const written = posix.write(self.to, self.bytes.items[self.sent..][0..len]) catch |err| switch (err) {
+                error.WouldBlock => {
+                    self.blocked = true;
+                    break;
+                },
+                else => return err,
+            };
+            self.sent += written;
+            self.total += written;
+            chunk.len -= written;
+            if (proxy.options.bandwidth != 0) self.tokens -= @floatFromInt(written);
+            if (chunk.len == 0) self.chunk_head += 1;
+        }
+
+        self.compact();
+        if (self.eof and self.queued() == 0 and !self.shut) {
+            posix.shutdown(self.to, .send) catch {};
+            self.shut = true;
+        }
+    }
+
+    fn refill(self: *Pipe, bandwidth: u64, now: u64) void {
+        if (bandwidth == 0) return;
+        const rate: f64 = @floatFromInt(bandwidth);
+        const elapsed: f64 = @floatFromInt(now - self.refilled_ns);
+        // Bursts are capped at 1/20s worth of data, and at least one read.
+        const burst = @max(rate / 20, READ_CHUNK);
+        self.tokens = @min(burst, self.tokens + elapsed * rate / std.time.ns_per_s);
+        self.refilled_ns = now;
+    }
+
+    fn compact(self: *Pipe) void {
+        if (self.chunk_head == self.chunks.items.len) {
+            self.chunks.clearRetainingCapacity();
+            self.bytes.clearRetainingCapacity();
+            self.chunk_head = 0;
+            self.sent = 0;
+            return;
+        }
+        if (self.sent >= MAX_QUEUED / 2) {
+            const rest = self.bytes.items[self.sent..];
+            std.mem.copyForwards(u8, self.bytes.items[0..rest.len], rest);
+            self.bytes.items.len = rest.len;
+            self.sent = 0;
+
+            const pending = self.chunks.items[self.chunk_head..];
+            std.mem.copyForwards(Chunk, self.chunks.items[0..pending.len], pending);
+            self.chunks.items.len = pending.len;
+            self.chunk_head = 0;
+        }
+    }
+
+    /// When this pipe next has something to do without socket readiness.
+    fn nextWakeNs(self: *const Pipe, bandwidth: u64, now: u64) ?u64 {
+        if (self.chunk_head == self.chunks.items.len or self.blocked) return null;
+        if (now < self.stall_end_ns) return self.stall_end_ns;
+        const release = self.chunks.items[self.chunk_head].release_ns;
+        if (release > now) return release;
+        if (bandwidth != 0 and self.tokens < 1) {
+            const rate: f64 = @floatFromInt(bandwidth);
+            return now + @as(u64, @intFromFloat((1 - self.tokens) * std.time.ns_per_s / rate)) + 1;
+        }
+        return now;
+    }
+};
+
+const Connection = struct {
+    id: usize,
+    client: posix.socket_t,
+    server: posix.socket_t,
+    /// Client to server.
+    up: Pipe,
+    /// Server to client.
+    down: Pipe,
+    reset_ns: u64,
+
+    fn done(self: *const Connection) bool {
+        return self.up.shut and self.down.shut;
+    }
+};
+
+const Proxy = struct {
+    allocator: Allocator,
+    options: Options,
+    target: net.Address,
+    prng: std.Random.DefaultPrng,
+    timer: std.time.Timer,
+    conns: std.ArrayListUnmanaged(*Connection) = .{},
+    polls: std.ArrayListUnmanaged(posix.pollfd) = .{},
+    next_id: usize = 0,
+    stalls: usize = 0,
+    resets: usize = 0,
+
+    /// Latency plus a uniform jitter in [-jitter, +jitter], never negative.
+    fn delayNs(self: *Proxy) u64 {
+        const latency = self.options.latency_ms * std.time.ns_per_ms;
+        const jitter = self.options.jitter_ms * std.time.ns_per_ms;
+        if (jitter == 0) return latency;
+        const offset = self.prng.random().uintAtMost(u64, 2 * jitter);
+        return (latency + offset) -| jitter;
+    }
+
+    /// Uniform in [0.5, 1.5] times `mean_ms`, in nanoseconds.
+    fn jittered(self: *Proxy, mean_ms: u64) u64 {
+        const mean = mean_ms * std.time.ns_per_ms;
+        return mean / 2 + self.prng.random().uintAtMost(u64, mean);
+    }
+
+    fn accept(self: *Proxy, listener: posix.socket_t) !void {
+        while (true) {
+            const client = posix.accept(listener, null, null, posix.SOCK.NONBLOCK) catch |err| switch (err) {
+                error.WouldBlock => return,
+                else => return err,
+            };
+            errdefer posix.close(client);
+
+            const server = loadgen.connect(self.target) catch |err| {
+                std.debug.print("[netem] Cannot reach target: {}\n", .{err});
+                posix.close(client);
+                continue;
+            };
+            errdefer posix.close(server);
+
+            const conn = try self.allocator.create(Connection);
+            errdefer self.allocator.destroy(conn);
+            try self.conns.ensureUnusedCapacity(self.allocator, 1);
+
+            const now = self.timer.read();
+            conn.* = .{
+                .id = self.next_id,
+                .client = client,
+                .server = server,
+                .up = .{ .from = client, .to = server, .refilled_ns = now },
+                .down = .{ .from = server, .to = client, .refilled_ns = now },
+                .reset_ns = if (self.options.reset_after_ms != 0)
+                    now + self.jittered(self.options.reset_after_ms)
+                else
+                    std.math.maxInt(u64),
+            };
+            if (self.options.stall_every_ms != 0) {
+                conn.up.next_stall_ns = now + self.jittered(self.options.stall_every_ms);
+                conn.down.next_stall_ns = now + self.jittered(self.options.stall_every_ms);
+            }
+            self.next_id += 1;
+            self.conns.appendAssumeCapacity(conn);
+            std.debug.print("[netem] #{d} opened ({d} active)\n", .{ conn.id, self.conns.items.len });
+        }
+    }
+
+    fn close(self: *Proxy, idx: usize, reason: []const u8, abort: bool) void {
+        const conn = self.conns.swapRemove(idx);
+        if (abort) {
+            // A zero linger time makes close() send RST instead of FIN.
+            const linger = extern struct { onoff: c_int, seconds: c_int }{ .onoff = 1, .seconds = 0 };
+            posix.setsockopt(conn.client, posix.SOL.SOCKET, posix.SO.LINGER, std.mem.asBytes(&linger)) catch {};
+            posix.setsockopt(conn.server, posix.SOL.SOCKET, posix.SO.LINGER, std.mem.asBytes(&linger)) catch {};
+        }
+        posix.close(conn.client);
+        posix.close(conn.server);
+        std.debug.print("[netem] #{d} {s}: {d} bytes up, {d} bytes down ({d} active)\n", .{
+            conn.id, reason, conn.up.total, conn.down.total, self.conns.items.len,
+        });
+        conn.up.deinit(self.allocator);
+        conn.down.deinit(self.allocator);
+        self.allocator.destroy(conn);
+    }
+
+    fn step(self: *Proxy, listener: posix.socket_t) !void {
+        self.polls.clearRetainingCapacity();
+        try self.polls.ensureTotalCapacity(self.allocator, 1 + 2 * self.conns.items.len);
+        self.polls.appendAssumeCapacity(.{ .fd = listener, .events = posix.POLL.IN, .revents = 0 });
+
+        var now = self.timer.read();
+        var wake: u64 = now + IDLE_POLL_MS * std.time.ns_per_ms;
+        for (self.conns.items) |conn| {
+            self.polls.appendAssumeCapacity(pollEntry(conn.client, events(&conn.up, &conn.down)));
+            self.polls.appendAssumeCapacity(pollEntry(conn.server, events(&conn.down, &conn.up)));
+            wake = @min(wake, conn.reset_ns);
+            if (conn.up.nextWakeNs(self.options.bandwidth, now)) |t| wake = @min(wake, t);
+            if (conn.down.nextWakeNs(self.options.bandwidth, now)) |t| wake = @min(wake, t);
+        }
+
+        const timeout_ms: i32 = @intCast(std.math.divCeil(u64, wake -| now, std.time.ns_per_ms) catch unreachable);
+        _ = try posix.poll(self.polls.items, timeout_ms);
+        now = self.timer.read();
+
+        // Connections accepted below have no poll entries yet.
+        const polled = self.conns.items.len;
+        if (self.polls.items[0].revents != 0) {
+            self.accept(listener) catch |err| std.debug.print("[netem] Accept failed: {}\n", .{err});
+        }
+
+        var i: usize = polled;
+        while (i > 0) {
+            i -= 1;
+            const conn = self.conns.items[i];
+            if (now >= conn.reset_ns) {
+                self.resets += 1;
+                self.close(i, "reset (injected)", true);
+                continue;
+            }
+
+            const client_revents = self.polls.items[1 + 2 * i].revents;
+            const server_revents = self.polls.items[2 + 2 * i].revents;
+            if (client_revents & posix.POLL.OUT != 0) conn.down.blocked = false;
+            if (server_revents & posix.POLL.OUT != 0) conn.up.blocked = false;
+
+            self.service(conn, client_revents, server_revents, now) catch |err| {
+                const reason: []const u8 = switch (err) {
+                    error.ConnectionResetByPeer => "reset by peer",
+                    error.BrokenPipe => "closed by peer",
+                    else => @errorName(err),
+                };
+                self.close(i, reason, true);
+                continue;
+            };
+            if (conn.done()) self.close(i, "closed", false);
+        }
+    }
+
+    fn service(self: *Proxy, conn: *Connection, client_revents: i16, server_revents: i16, now: u64) !void {
+        const readable = posix.POLL.IN | posix.POLL.HUP | posix.POLL.ERR;
+        if (client_revents & readable != 0) try conn.up.fill(self.allocator, self, now);
+        if (server_revents & readable != 0) try conn.down.fill(self.allocator, self, now);
+        try conn.up.pump(self, now);
+        try conn.down.pump(self, now);
+    }
+
+    /// A socket with nothing to wait for is left out of the poll. poll()
+    /// reports POLLHUP whatever the events asked for, so a hung-up socket
+    /// whose queue is full would otherwise wake the loop at once, over and
+    /// over, until the queue drained.
+    fn pollEntry(socket: posix.socket_t, ev: i16) posix.pollfd {
+        return .{ .fd = if (ev == 0) -1 else socket, .events = ev, .revents = 0 };
+    }
+
+    /// Poll events for a socket that `reading` reads from and `writing`
+    /// writes to.
+    fn events(reading: *const Pipe, writing: *const Pipe) i16 {
+        var ev: i16 = 0;
+        if (reading.wantsRead()) ev |= posix.POLL.IN;
+        if (writing.blocked) ev |= posix.POLL.OUT;
+        return ev;
+    }
+};
+
+/// Forwards TCP connections from a loopback port to a server while
+/// injecting latency, jitter, bandwidth caps, stalls and resets, so
+/// reconnect and slow consumer handling can be exercised without root or
+/// tc. Runs until interrupted.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var options: Options = .{};
+    var positional: [3][]const u8 = undefined;
+    var positional_len: usize = 0;
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) {
+        const arg = args[arg_index];
+        if (!std.mem.startsWith(u8, arg, "--")) {
+            if (positional_len == positional.len) {
+                std.debug.print("Error: Too many arguments.\n{s}", .{usage});
+                return error.InvalidArguments;
+            }
+            positional[positional_len] = arg;
+            positional_len += 1;
+            arg_index += 1;
+            continue;
+        }
+
+        if (arg_index + 1 >= args.len) {
+            std.debug.print("Error: {s} requires a value.\n{s}", .{ arg, usage });
+            return error.InvalidArguments;
+        }
+        const value = std.fmt.parseInt(u64, args[arg_index + 1], 10) catch {
+            std.debug.print("Error: Invalid {s} value '{s}'.\n{s}", .{ arg, args[arg_index + 1], usage });
+            return error.InvalidArguments;
+        };
+        const is_time = !std.mem.eql(u8, arg, "--bandwidth") and !std.mem.eql(u8, arg, "--seed");
+        if (is_time and value > MAX_OPTION_MS) {
+            std.debug.print("Error: {s} value '{s}' is out of range (at most {d}ms).\n{s}", .{ arg, args[arg_index + 1], MAX_OPTION_MS, usage });
+            return error.InvalidArguments;
+        }
+        if (std.mem.eql(u8, arg, "--latency")) {
+            options.latency_ms = value;
+        } else if (std.mem.eql(u8, arg, "--jitter")) {
+            options.jitter_ms = value;
+        } else if (std.mem.eql(u8, arg, "--bandwidth")) {
+            options.bandwidth = std.math.mul(u64, value, 1024) catch {
+                std.debug.print("Error: --bandwidth value '{s}' is out of range.\n{s}", .{ args[arg_index + 1], usage });
+                return error.InvalidArguments;
+            };
+        } else if (std.mem.eql(u8, arg, "--stall-every")) {
+            options.stall_every_ms = value;
+        } else if (std.mem.eql(u8, arg, "--stall")) {
+            options.stall_ms = value;
+        } else if (std.mem.eql(u8, arg, "--reset-after")) {
+            options.reset_after_ms = value;
+        } else if (std.mem.eql(u8, arg, "--seed")) {
+            options.seed = value;
+        } else {
+            std.debug.print("Error: Unknown netem-proxy option '{s}'.\n{s}", .{ arg, usage });
+            return error.InvalidArguments;
+        }
+        arg_index += 2;
+    }
+
+    if (positional_len != positional.len) {
+        std.debug.print("Error: netem-proxy requires a listen port, IP and PORT.\n{s}", .{usage});
+        return error.InvalidArguments;
+    }
+    const listen_port = std.fmt.parseInt(u16, positional[0], 10) catch {
+        std.debug.print("Error: Invalid port number '{s}'.\n", .{positional[0]});
+        return error.InvalidArguments;
+    };
+    const target_port = std.fmt.parseInt(u16, positional[2], 10) catch {
+        std.debug.print("Error: Invalid port number '{s}'.\n", .{positional[2]});
+        return error.InvalidArguments;
+    };
+    const target = try net.Address.parseIp4(positional[1], target_port);
+
+    const listen_address = try net.Address.parseIp4("127.0.0.1", listen_port);
+    const listener = try posix.socket(posix.AF.INET, posix.SOCK.STREAM | posix.SOCK.NONBLOCK, posix.IPPROTO.TCP);
+    defer posix.close(listener);
+    try posix.setsockopt(listener, posix.SOL.SOCKET, posix.SO.REUSEADDR, &std.mem.toBytes(@as(c_int, 1)));
+    try posix.bind(listener, &listen_address.any, listen_address.getOsSockLen());
+    try posix.listen(listener, 128);
+
+    const seed = options.seed orelse std.crypto.random.int(u64);
+    var proxy: Proxy = .{
+        .allocator = allocator,
+        .options = options,
+        .target = target,
+        .prng = .init(seed),
+        .timer = try std.time.Timer.start(),
+    };
+    defer {
+        while (proxy.conns.items.len > 0) proxy.close(proxy.conns.items.len - 1, "closed", false);
+        proxy.conns.deinit(allocator);
+        proxy.polls.deinit(allocator);
+    }
+
+    std.debug.print("[netem] 127.0.0.1:{d} -> {s}:{d}, latency {d}ms +/- {d}ms, bandwidth {d} KiB/s, stall {d}ms every ~{d}ms, reset after ~{d}ms, seed {d}\n", .{
+        listen_port,            positional[1],          target_port,          options.latency_ms, options.jitter_ms,
+        options.bandwidth / 1024, options.stall_ms,     options.stall_every_ms, options.reset_after_ms, seed,
+    });
+
+    while (true) {
+        try proxy.step(listener);
+    }
+}
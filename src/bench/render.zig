@@ -0,0 +1,249 @@
+const std = @import("std");
+const vaxis = @import("vaxis");
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const TuiClient = @import("../client/tui.zig").TuiClient;
+const server_tui = @import("../server/tui.zig");
+const ServerTui = server_tui.ServerTui;
+const LogEntry = server_tui.LogEntry;
+const metrics = @import("../server/metrics.zig");
+const Histogram = metrics.Histogram;
+const MemoryBudget = @import("../server/memory.zig").MemoryBudget;
+
+const usage =
+    \\Usage: zignal bench-render [--counts N,N,...] [--frames N] [--cols N] [--rows N]
+    \\
+;
+
+/// Word pool for synthetic lines: ASCII, accented, double-width CJK and
+/// emoji graphemes, so wrapping and width calculation are exercised.
+const words = [_][]const u8{
+    "hello",  "zig",   "allocation", "fan-out", "ok",   "the",   "a",     "latency",
+    "café",   "naïve", "über",       "—",       "👍",   "🚀",    "😀😀",  "漢字",
+    "テスト", "채팅",  "grapheme",   "width",   "wrap", "lorem", "ipsum", "https://example.com/some/long/path",
+};
+const names = [_][]const u8{ "alice", "bob", "carol", "dmitri", "李雷", "zoë" };
+
+const Timing = struct {
+    /// Frame times in nanoseconds.
+    hist: Histogram = .{},
+    total_ns: u64 = 0,
+
+    fn record(self: *Timing, ns: u64) void {
+        self.hist.observe(ns);
+        self.total_ns += ns;
+    }
+
+    fn meanUs(self: *const Timing) f64 {
+        const n = self.hist.count.load(.monotonic);
+        if (n == 0) return 0;
+        return @as(f64, @floatFromInt(self.total_ns)) / @as(f64, @floatFromInt(n)) / std.time.ns_per_us;
+    }
+};
+
+const Options = struct {
+    counts: []const usize = &.{ 10_000, 100_000, 1_000_000 },
+    frames: usize = 200,
+    winsize: vaxis.Winsize = .{ .rows = 50, .cols = 160, .x_pixel = 0, .y_pixel = 0 },
+};
+
+/// Renders the client and server TUIs offscreen, with no tty, against
+/// growing histories of synthetic lines and reports per-frame times for
+/// the list renderers, the layout pass and the full render including
+/// escape sequence generation. A new line arrives before every frame, as
+/// in a busy channel.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var options: Options = .{};
+    var counts_buf: [16]usize = undefined;
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) : (arg_index += 2) {
+        const flag = args[arg_index];
+        if (arg_index + 1 >= args.len) {
+            std.debug.print("Error: {s} requires a value.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+        const value = args[arg_index + 1];
+
+        if (std.mem.eql(u8, flag, "--counts")) {
+            var len: usize = 0;
+            var it = std.mem.tokenizeScalar(u8, value, ',');
+            while (it.next()) |token| {
+                if (len == counts_buf.len) return error.InvalidArguments;
+                counts_buf[len] = std.fmt.parseInt(usize, token, 10) catch {
+                    std.debug.print("Error: Invalid count '{s}'.\n{s}", .{ token, usage });
+                    return error.InvalidArguments;
+                };
+                len += 1;
+            }
+            options.counts = counts_buf[0..len];
+            continue;
+        }
+
+        const number = std.fmt.parseInt(u16, value, 10) catch {
+            std.debug.print("Error: Invalid {s} value '{s}'.\n{s}", .{ flag, value, usage });
+            return error.InvalidArguments;
+        };
+        if (std.mem.eql(u8, flag, "--frames")) {
+            options.frames = @max(1, number);
+        } else if (std.mem.eql(u8, flag, "--cols")) {
+            options.winsize.cols = number;
+        } else if (std.mem.eql(u8, flag, "--rows")) {
+            options.winsize.rows = number;
+        } else {
+            std.debug.print("Error: Unknown bench-render option '{s}'.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+    }
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("{d}x{d} screen, {d} frames per run\n\n", .{ options.winsize.cols, options.winsize.rows, options.frames });
+    try out.print("{s:<7} {s:>9} {s:<15} {s:>10} {s:>10} {s:>10}\n", .{ "tui", "lines", "pass", "mean us", "p99 us", "max us" });
+    try out.flush();
+
+    for (options.counts) |count| {
+        try benchClient(allocator, options, count, out);
+        try benchServer(allocator, options, count, out);
+    }
+}
+
+fn benchClient(allocator: Allocator, options: Options, count: usize, out: *std.Io.Writer) !void {
+    const tui = try TuiClient.initOffscreen(allocator, "bench", options.winsize);
+    defer tui.deinit();
+
+    var prng = std.Random.DefaultPrng.init(0x5eed);
+    const random = prng.random();
+    var line: [512]u8 = undefined;
+
+    for (0..count) |_| {
+        try tui.addMessage(synthLine(random, &line));
+    }
+
+    var list: Timing = .{};
+    var layout: Timing = .{};
+    var full: Timing = .{};
+    var timer = try std.time.Timer.start();
+
+    for (0..options.frames) |_| {
+        try tui.addMessage(synthLine(random, &line));
+        const win = tui.vx.window();
+
+        win.clear();
+        _ = timer.lap();
+        tui.renderMessages(win, win.height);
+        list.record(timer.lap());
+
+        tui.draw(win);
+        layout.record(timer.lap());
+
+        try tui.render();
+        full.record(timer.lap());
+    }
+
+    try report(out, "client", count, "renderMessages", &list);
+    try report(out, "client", count, "draw", &layout);
+    try report(out, "client", count, "render", &full);
+}
+
+fn benchServer(allocator: Allocator, options: Options, count: usize, out: *std.Io.Writer) !void {
+    var port: u16 = 8080;
+    var connected: usize = 0;
+    var running = true;
+    var server_metrics: metrics.Metrics = .{};
+    var budget = MemoryBudget.init(allocator, .{});
+
+    const tui = try ServerTui.initOffscreen(allocator, "127.0.0.1", &port, &connected, config.MAX_CONNECTIONS, &running, &server_metrics, &budget, options.winsize);
+    defer tui.deinit();
+
+    var prng = std.Random.DefaultPrng.init(0x5eed);
+    const random = prng.random();
+    var line: [512]u8 = undefined;
+
+    // Appended directly: the live server trims its history to
+    // config.LOG_HISTORY, which would hide how rendering scales.
+    for (0..count) |i| {
+        try tui.logs.append(try LogEntry.create(allocator, synthLine(random, &line), synthLevel(i)));
+    }
+
+    var list: Timing = .{};
+    var layout: Timing = .{};
+    var full: Timing = .{};
+    var timer = try std.time.Timer.start();
+
+    for (0..options.frames) |i| {
+        try tui.logs.append(try LogEntry.create(allocator, synthLine(random, &line), synthLevel(i)));
+        const win = tui.vx.window();
+
+        win.clear();
+        _ = timer.lap();
+        tui.renderLogs(win, win.height);
+        list.record(timer.lap());
+
+        tui.draw(win);
+        layout.record(timer.lap());
+
+        try tui.render();
+        full.record(timer.lap());
+    }
+
+    try report(out, "server", count, "renderLogs", &list);
+    try report(out, "server", count, "draw", &layout);
+    try report(out, "server", count, "render", &full);
+}
+
+fn report(out: *std.Io.Writer, target: []const u8, count: usize, pass: []const u8, timing: *const Timing) !void {
+    try out.print("{s:<7} {d:>9} {s:<15} {d:>10.1} {d:>10.1} {d:>10.1}\n", .{
+        target,
+        count,
+        pass,
+        timing.meanUs(),
+        @as(f64, @floatFromInt(timing.hist.percentile(99))) / std.time.ns_per_us,
+        @as(f64, @floatFromInt(timing.hist.max.load(.monotonic))) / std.time.ns_per_us,
+    });
+    try out.flush();
+}
+
+fn synthLevel(i: usize) LogEntry.Level {
+    return switch (i % 16) {
+        0 => .err,
+        1, 2 => .warn,
+        3 => .debug,
+        else => .info,
+    };
+}
+
+/// A chat line of mixed length: mostly short, sometimes several screen
+/// widths long, occasionally a system or server notice.
+fn synthLine(random: std.Random, buf: []u8) []const u8 {
+    var len: usize = 0;
+    const prefix: []const u8 = switch (random.uintLessThan(u8, 20)) {
+        0 => "[Server] ",
+        1 => "[System] ",
+        else => blk: {
+            const name = names[random.uintLessThan(usize, names.len)];
+            @memcpy(buf[0..name.len], name);
+            len = name.len;
+            break :blk ": ";
+        },
+    };
+    @memcpy(buf[len..][0..prefix.len], prefix);
+    len += prefix.len;
+
+    const target: usize = if (random.uintLessThan(u8, 10) == 0)
+        random.intRangeAtMost(usize, 200, 400)
+    else
+        random.intRangeAtMost(usize, 8, 60);
+
+    while (len < target) {
+        const word = words[random.uintLessThan(usize, words.len)];
+        if (len + word.len + 1 > buf.len) break;
+        @memcpy(buf[len..][0..word.len], word);
+        buf[len + word.len] = ' ';
+        len += word.len + 1;
+    }
+    return buf[0..len];
+}
@@ -0,0 +1,210 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const capture = @import("../server/capture.zig");
+const loadgen = @import("loadgen.zig");
+
+const usage =
+    \\Usage: zignal replay <FILE> <IP> <PORT> [--speed N|max]
+    \\
+;
+
+/// At max speed, incoming broadcasts are drained after this many frames so
+/// the server's writes to the replay connections do not start failing.
+const DRAIN_EVERY = 64;
+
+const Stats = struct {
+    connections: usize = 0,
+    frames: usize = 0,
+    bytes_sent: usize = 0,
+    bytes_received: usize = 0,
+    /// Frames for connection ids that were never opened.
+    skipped: usize = 0,
+    /// Largest delay behind the capture's schedule, in nanoseconds.
+    max_lag_ns: u64 = 0,
+};
+
+/// Re-drives a server with the traffic from a `server --capture` file: one
+/// connection per captured connection id, opened and closed at the same
+/// points, each frame sent with its original timing divided by the speed
+/// factor, or back to back with `--speed max`.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var positional: [3][]const u8 = undefined;
+    var positional_len: usize = 0;
+    // null replays as fast as possible.
+    var speed: ?f64 = 1;
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) {
+        const arg = args[arg_index];
+        if (std.mem.eql(u8, arg, "--speed")) {
+            if (arg_index + 1 >= args.len) {
+                std.debug.print("Error: --speed requires a value.\n{s}", .{usage});
+                return error.InvalidArguments;
+            }
+            const value = args[arg_index + 1];
+            if (std.mem.eql(u8, value, "max")) {
+                speed = null;
+            } else {
+                const factor = std.fmt.parseFloat(f64, value) catch 0;
+                if (!(factor > 0)) {
+                    std.debug.print("Error: Invalid speed '{s}'.\n{s}", .{ value, usage });
+                    return error.InvalidArguments;
+                }
+                speed = factor;
+            }
+            arg_index += 2;
+        } else if (positional_len < positional.len) {
+            positional[positional_len] = arg;
+            positional_len += 1;
+            arg_index += 1;
+        } else {
+            std.debug.print("Error: Too many arguments.\n{s}", .{usage});
+            return error.InvalidArguments;
+        }
+    }
+
+    if (positional_len != positional.len) {
+        std.debug.print("Error: replay requires a capture file, IP and PORT.\n{s}", .{usage});
+        return error.InvalidArguments;
+    }
+
+    const port = std.fmt.parseInt(u16, positional[2], 10) catch {
+        std.debug.print("Error: Invalid port number '{s}'.\n", .{positional[2]});
+        return error.InvalidArguments;
+    };
+    const address = try net.Address.parseIp4(positional[1], port);
+
+    const data = std.fs.cwd().readFileAlloc(allocator, positional[0], std.math.maxInt(u32)) catch |err| {
+        std.debug.print("Error: Cannot read '{s}': {}\n", .{ positional[0], err });
+        return err;
+    };
+    defer allocator.free(data);
+
+    var decoder = capture.Decoder.init(data) catch |err| {
+        std.debug.print("Error: '{s}' is not a zignal capture: {}\n", .{ positional[0], err });
+        return err;
+    };
+
+    var stats: Stats = .{};
+    var timer = try std.time.Timer.start();
+    replay(allocator, &decoder, address, speed, &stats) catch |err| {
+        std.debug.print("Error: Replay stopped at byte {d} of '{s}': {}\n", .{ decoder.pos, positional[0], err });
+        return err;
+    };
+    const elapsed_ns = timer.read();
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    const elapsed_s = @as(f64, @floatFromInt(@max(elapsed_ns, 1))) / std.time.ns_per_s;
+    try out.print("Replayed {d} frames ({d} bytes) over {d} connections\n", .{ stats.frames, stats.bytes_sent, stats.connections });
+    try out.print("Captured span: {d:.3}s, replay took {d:.3}s ({d:.0} frames/s)\n", .{
+        @as(f64, @floatFromInt(decoder.now_ns)) / std.time.ns_per_s,
+        elapsed_s,
+        @as(f64, @floatFromInt(stats.frames)) / elapsed_s,
+    });
+    if (speed != null) {
+        try out.print("Max lag behind schedule: {d:.2}ms\n", .{@as(f64, @floatFromInt(stats.max_lag_ns)) / std.time.ns_per_ms});
+    }
+    try out.print("Received {d} bytes of broadcasts\n", .{stats.bytes_received});
+    if (stats.skipped > 0) {
+        try out.print("Skipped {d} frames for connections that were never opened\n", .{stats.skipped});
+    }
+    try out.flush();
+}
+
+fn replay(allocator: Allocator, decoder: *capture.Decoder, address: net.Address, speed: ?f64, stats: *Stats) !void {
+    var conns: std.AutoHashMapUnmanaged(u32, posix.socket_t) = .{};
+    defer conns.deinit(allocator);
+    var sockets: std.ArrayListUnmanaged(posix.socket_t) = .{};
+    defer sockets.deinit(allocator);
+    defer for (sockets.items) |socket| posix.close(socket);
+
+    var frame: std.ArrayListUnmanaged(u8) = .{};
+    defer frame.deinit(allocator);
+
+    var timer = try std.time.Timer.start();
+    var since_drain: usize = 0;
+
+    while (try decoder.next()) |record| {
+        if (speed) |factor| {
+            const due_ns: u64 = @intFromFloat(@as(f64, @floatFromInt(record.timestamp_ns)) / factor);
+            while (true) {
+                const now = timer.read();
+                if (now >= due_ns) {
+                    stats.max_lag_ns = @max(stats.max_lag_ns, now - due_ns);
+                    break;
+                }
+                stats.bytes_received += try drain(sockets.items);
+                std.Thread.sleep(@min(due_ns - now, std.time.ns_per_ms));
+            }
+        }
+
+        switch (record.tag) {
+            .connect => {
+                const gop = try conns.getOrPut(allocator, record.conn_id);
+                if (gop.found_existing) return error.DuplicateConnectionId;
+                errdefer _ = conns.remove(record.conn_id);
+
+                try sockets.ensureUnusedCapacity(allocator, 1);
+                const socket = try loadgen.connect(address);
+                gop.value_ptr.* = socket;
+                sockets.appendAssumeCapacity(socket);
+                stats.connections += 1;
+            },
+            .frame => {
+                const socket = conns.get(record.conn_id) orelse {
+                    stats.skipped += 1;
+                    continue;
+                };
+                frame.clearRetainingCapacity();
+                try frame.ensureTotalCapacity(allocator, record.payload.len + 4);
+                var len_buf: [4]u8 = undefined;
+                std.mem.writeInt(u32, &len_buf, @intCast(record.payload.len), .little);
+                frame.appendSliceAssumeCapacity(&len_buf);
+                frame.appendSliceAssumeCapacity(record.payload);
+
+                try loadgen.writeAll(socket, frame.items);
+                stats.frames += 1;
+                stats.bytes_sent += frame.items.len;
+
+                since_drain += 1;
+                if (since_drain >= DRAIN_EVERY) {
+                    since_drain = 0;
+                    stats.bytes_received += try drain(sockets.items);
+                }
+            },
+            .disconnect => {
+                const entry = conns.fetchRemove(record.conn_id) orelse continue;
+                const idx = std.mem.indexOfScalar(posix.socket_t, sockets.items, entry.value).?;
+                _ = sockets.swapRemove(idx);
+                posix.close(entry.value);
+            },
+        }
+    }
+
+    stats.bytes_received += try drain(sockets.items);
+}
+
+/// Reads and discards whatever the server has sent to the replay
+/// connections. Returns the number of bytes read.
+fn drain(sockets: []const posix.socket_t) !usize {
+    var buf: [16 * 1024]u8 = undefined;
+    var total: usize = 0;
+    for (sockets) |socket| {
+        while (true) {
+            const n = posix.read(socket, &buf) catch |err| switch (err) {
+                error.WouldBlock => break,
+                error.ConnectionResetByPeer => break,
+                else => return err,
+            };
+            if (n == 0) break;
+            total += n;
+        }
+    }
+    return total;
+}
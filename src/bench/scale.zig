@@ -0,0 +1,254 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const loadgen = @import("loadgen.zig");
+const Writer = @import("../writer.zig").Writer;
+
+const usage =
+    \\Usage: zignal bench-scale [--counts N,N,...]
+    \\
+    \\Each step needs about two file descriptors per connection, since both
+    \\ends live in this process. Raise the limit first, e.g.:
+    \\  ulimit -n 250000        (may need /etc/security/limits.conf or root)
+    \\
+;
+
+/// Linux IP_BIND_ADDRESS_NO_PORT: defer the source port choice to
+/// connect(), so ports are only unique per source address.
+const IP_BIND_ADDRESS_NO_PORT = 24;
+
+/// Loopback source addresses are rotated every this many connections to
+/// stay clear of the ~28k ephemeral ports available per address.
+const CONNECTIONS_PER_SOURCE = 20_000;
+
+/// Connections in flight ahead of the server's accept count.
+const CONNECT_WINDOW = 64;
+
+const Step = struct {
+    connections: usize,
+    rss_bytes: usize,
+    rss_per_conn: f64,
+    heap_per_conn: f64,
+    accepts_per_sec: f64,
+    broadcast_ns: u64,
+    delivered: usize,
+};
+
+/// Opens increasing numbers of idle loopback connections to a fresh
+/// headless server and reports memory per connection, accept rate and the
+/// time for one message to reach every connection.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var counts_buf: [16]usize = undefined;
+    var counts: []const usize = &.{ 1_000, 10_000, 100_000 };
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) : (arg_index += 2) {
+        if (!std.mem.eql(u8, args[arg_index], "--counts") or arg_index + 1 >= args.len) {
+            std.debug.print("Error: Unknown bench-scale option '{s}'.\n{s}", .{ args[arg_index], usage });
+            return error.InvalidArguments;
+        }
+        var len: usize = 0;
+        var it = std.mem.tokenizeScalar(u8, args[arg_index + 1], ',');
+        while (it.next()) |token| {
+            if (len == counts_buf.len) return error.InvalidArguments;
+            counts_buf[len] = std.fmt.parseInt(usize, token, 10) catch {
+                std.debug.print("Error: Invalid count '{s}'.\n{s}", .{ token, usage });
+                return error.InvalidArguments;
+            };
+            if (counts_buf[len] < 2) return error.InvalidArguments;
+            len += 1;
+        }
+        counts = counts_buf[0..len];
+    }
+
+    const fd_limit = raiseFdLimit();
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("{s:>11} {s:>10} {s:>10} {s:>10} {s:>12} {s:>12} {s:>9}\n", .{
+        "connections", "rss MiB", "rss/conn", "heap/conn", "accepts/s", "broadcast", "reached",
+    });
+    try out.flush();
+
+    for (counts) |count| {
+        const needed = 2 * count + 64;
+        if (needed > fd_limit) {
+            try out.print("{d:>11} skipped: needs about {d} file descriptors, limit is {d} (see ulimit -n)\n", .{ count, needed, fd_limit });
+            try out.flush();
+            continue;
+        }
+
+        const step = try measure(allocator, count);
+        try out.print("{d:>11} {d:>10.1} {d:>9.0}B {d:>9.0}B {d:>12.0} {d:>10.2}ms {d:>9}\n", .{
+            step.connections,
+            @as(f64, @floatFromInt(step.rss_bytes)) / (1024 * 1024),
+            step.rss_per_conn,
+            step.heap_per_conn,
+            step.accepts_per_sec,
+            @as(f64, @floatFromInt(step.broadcast_ns)) / std.time.ns_per_ms,
+            step.delivered,
+        });
+        try out.flush();
+    }
+}
+
+fn measure(allocator: Allocator, count: usize) !Step {
+    const server = try loadgen.HeadlessServer.start(allocator, count);
+    defer server.stop();
+    const address = server.address();
+
+    const sockets = try allocator.alloc(posix.socket_t, count);
+    defer allocator.free(sockets);
+    var opened: usize = 0;
+    defer for (sockets[0..opened]) |socket| posix.close(socket);
+
+    const rss_before = try residentBytes();
+    const heap_before = server.server.budget.total.load(.monotonic);
+
+    var timer = try std.time.Timer.start();
+    while (opened < count) {
+        if (opened - accepted(server) >= CONNECT_WINDOW) {
+            std.Thread.yield() catch {};
+            continue;
+        }
+        sockets[opened] = try connectFrom(address, opened / CONNECTIONS_PER_SOURCE);
+        opened += 1;
+    }
+    while (accepted(server) < count) {
+        if (timer.read() > 60 * std.time.ns_per_s) return error.AcceptTimeout;
+        std.Thread.sleep(std.time.ns_per_ms);
+    }
+    const accept_ns = timer.read();
+
+    const rss_after = try residentBytes();
+    const heap_after = server.server.budget.total.load(.monotonic);
+
+    const polls = try allocator.alloc(posix.pollfd, count);
+    defer allocator.free(polls);
+    for (sockets, polls) |socket, *pfd| {
+        pfd.* = .{ .fd = socket, .events = posix.POLL.IN, .revents = 0 };
+    }
+    try drainWelcomes(polls);
+
+    // One message from the first connection, timed until every other
+    // connection still open has read the whole frame.
+    const ping = "scale: ping";
+    const frame_len = ping.len + 4;
+    const got = try allocator.alloc(usize, count);
+    defer allocator.free(got);
+    @memset(got, 0);
+
+    polls[0].fd = -1;
+    var live: usize = 0;
+    for (polls) |pfd| {
+        if (pfd.fd >= 0) live += 1;
+    }
+    timer.reset();
+    try Writer.writeToSocket(sockets[0], ping);
+
+    var delivered: usize = 0;
+    var buf: [64]u8 = undefined;
+    while (delivered < live and timer.read() < 10 * std.time.ns_per_s) {
+        _ = try posix.poll(polls, 100);
+        for (polls, got) |*pfd, *bytes| {
+            if (pfd.fd < 0 or pfd.revents == 0) continue;
+            const n = posix.read(pfd.fd, &buf) catch |err| switch (err) {
+                error.WouldBlock => continue,
+                else => 0,
+            };
+            if (n == 0) {
+                // Hung up before the frame arrived: no longer waited for.
+                pfd.fd = -1;
+                live -= 1;
+                continue;
+            }
+            bytes.* += n;
+            if (bytes.* >= frame_len) {
+                pfd.fd = -1;
+                delivered += 1;
+            }
+        }
+    }
+    const broadcast_ns = timer.read();
+
+    const n: f64 = @floatFromInt(count);
+    return .{
+        .connections = count,
+        .rss_bytes = rss_after,
+        .rss_per_conn = @as(f64, @floatFromInt(rss_after -| rss_before)) / n,
+        .heap_per_conn = @as(f64, @floatFromInt(heap_after -| heap_before)) / n,
+        .accepts_per_sec = n * std.time.ns_per_s / @as(f64, @floatFromInt(@max(accept_ns, 1))),
+        .broadcast_ns = broadcast_ns,
+        .delivered = delivered,
+    };
+}
+
+fn accepted(server: *loadgen.HeadlessServer) usize {
+    return @intCast(server.server.metrics.accepts.load(.monotonic));
+}
+
+/// Starts a non-blocking connect from 127.1.x.y without waiting for it.
+fn connectFrom(address: net.Address, source: usize) !posix.socket_t {
+    const socket = try posix.socket(posix.AF.INET, posix.SOCK.STREAM | posix.SOCK.NONBLOCK, posix.IPPROTO.TCP);
+    errdefer posix.close(socket);
+
+    try posix.setsockopt(socket, posix.IPPROTO.IP, IP_BIND_ADDRESS_NO_PORT, &std.mem.toBytes(@as(c_int, 1)));
+    const from = net.Address.initIp4(.{ 127, 1, @intCast(source / 255), @intCast(source % 255 + 1) }, 0);
+    try posix.bind(socket, &from.any, from.getOsSockLen());
+
+    posix.connect(socket, &address.any, address.getOsSockLen()) catch |err| switch (err) {
+        error.WouldBlock => {},
+        else => return err,
+    };
+    return socket;
+}
+
+/// Reads and discards the welcome frames until no socket has had input
+/// for 200ms.
+fn drainWelcomes(polls: []posix.pollfd) !void {
+    var buf: [256]u8 = undefined;
+    while (try posix.poll(polls, 200) > 0) {
+        for (polls) |*pfd| {
+            if (pfd.revents == 0) continue;
+            while (true) {
+                const n = posix.read(pfd.fd, &buf) catch |err| switch (err) {
+                    error.WouldBlock => break,
+                    else => return err,
+                };
+                if (n == 0) {
+                    // Closed by the server; leave it out of the broadcast.
+                    pfd.fd = -1;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/// Raises the soft open-file limit to the hard limit and returns it.
+pub fn raiseFdLimit() usize {
+    var limit = posix.getrlimit(.NOFILE) catch return 1024;
+    if (limit.cur < limit.max) {
+        limit.cur = limit.max;
+        posix.setrlimit(.NOFILE, limit) catch {};
+        limit = posix.getrlimit(.NOFILE) catch return 1024;
+    }
+    return @intCast(@min(limit.cur, std.math.maxInt(u32)));
+}
+
+/// Resident set size of this process, from /proc/self/statm.
+fn residentBytes() !usize {
+    var buf: [128]u8 = undefined;
+    const file = try std.fs.openFileAbsolute("/proc/self/statm", .{});
+    defer file.close();
+    const len = try file.read(&buf);
+
+    var it = std.mem.tokenizeScalar(u8, buf[0..len], ' ');
+    _ = it.next() orelse return error.InvalidStatm;
+    const pages = try std.fmt.parseInt(usize, it.next() orelse return error.InvalidStatm, 10);
+    return pages * std.heap.pageSize();
+}
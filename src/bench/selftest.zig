@@ -0,0 +1,146 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+const loadgen = @import("loadgen.zig");
+const scale = @import("scale.zig");
+const MemoryLimits = @import("../server/memory.zig").Limits;
+
+pub const Options = struct {
+    /// Largest room to try, normally the server's --size.
+    max_clients: usize,
+    /// Memory limits of the server under test.
+    limits: MemoryLimits = .{},
+    /// A step fails when the p99 send-to-receive latency exceeds this.
+    slo_p99_us: u64 = 50 * std.time.us_per_ms,
+    /// A step fails when fewer than this fraction of deliveries arrive.
+    slo_delivery: f64 = 0.999,
+};
+
+/// Smallest room tried; each level doubles it up to `max_clients`.
+const FIRST_LEVEL = 8;
+/// Rough length of one step at its target rate.
+const STEP_S = 2;
+/// Longest a step may take when every client sends just one message.
+const MAX_STEP_S = 5;
+/// Starting point for the rate ramp, in deliveries per second.
+const START_DELIVERIES = 10_000;
+const MAX_DOUBLINGS = 20;
+
+const Step = struct {
+    clients: usize,
+    rate: u64,
+    result: loadgen.Result,
+
+    fn deliveriesPerSec(self: *const Step) f64 {
+        return self.result.deliveriesPerSec();
+    }
+};
+
+/// Ramps room size and message rate against a headless server on loopback
+/// until the latency or delivery SLO breaks, then reports the highest
+/// fan-out the host sustained. Returns error.SloNotMet if no step passed.
+pub fn run(allocator: Allocator, options: Options) !void {
+    // Both ends of every connection live in this process.
+    const fd_limit = scale.raiseFdLimit();
+    const max_clients = @min(options.max_clients, (fd_limit -| 64) / 2);
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("Self-test: rooms of up to {d} clients, SLO p99 <= {d:.1}ms and delivery >= {d:.1}%\n", .{
+        max_clients,
+        @as(f64, @floatFromInt(options.slo_p99_us)) / std.time.us_per_ms,
+        options.slo_delivery * 100,
+    });
+    if (max_clients < options.max_clients) {
+        try out.print("Room size limited to {d} by the open file limit ({d}, see ulimit -n)\n", .{ max_clients, fd_limit });
+    }
+    try out.print("\n{s:>8} {s:>9} {s:>13} {s:>10} {s:>10} {s:>10}  {s}\n", .{
+        "clients", "msg/s", "deliveries/s", "p50 us", "p99 us", "delivered", "status",
+    });
+    try out.flush();
+
+    var best: ?Step = null;
+    var largest_room: usize = 0;
+
+    var clients: usize = @min(FIRST_LEVEL, max_clients);
+    while (clients >= 2) {
+        const fanout: u64 = clients - 1;
+        var rate: u64 = @max(
+            std.math.divCeil(u64, START_DELIVERIES, fanout) catch unreachable,
+            std.math.divCeil(u64, clients, MAX_STEP_S) catch unreachable,
+        );
+
+        var passed_level = false;
+        for (0..MAX_DOUBLINGS) |_| {
+            const step = measure(allocator, options, clients, rate) catch |err| {
+                try out.print("{d:>8} {d:>9} {s:>13} {s:>10} {s:>10} {s:>10}  failed: {s}\n", .{
+                    clients, rate, "-", "-", "-", "-", @errorName(err),
+                });
+                try out.flush();
+                break;
+            };
+            const result = &step.result;
+            const ok = meetsSlo(options, result);
+
+            try out.print("{d:>8} {d:>9} {d:>13.0} {d:>10} {d:>10} {d:>9.2}%  {s}\n", .{
+                clients,
+                rate,
+                step.deliveriesPerSec(),
+                result.latency.percentile(50),
+                result.latency.percentile(99),
+                result.deliveryRatio() * 100,
+                if (ok) "ok" else "SLO broken",
+            });
+            try out.flush();
+            if (!ok) break;
+
+            passed_level = true;
+            if (best == null or step.deliveriesPerSec() > best.?.deliveriesPerSec()) best = step;
+            rate *= 2;
+        }
+
+        if (!passed_level) break;
+        largest_room = clients;
+        if (clients == max_clients) break;
+        clients = @min(clients * 2, max_clients);
+    }
+
+    try out.writeAll("\n");
+    const top = best orelse {
+        try out.writeAll("No step met the SLO on this host and configuration.\n");
+        try out.flush();
+        return error.SloNotMet;
+    };
+    try out.print("Max sustainable fan-out: {d:.0} deliveries/s ({d} clients at {d} msg/s, p99 {d}us)\n", .{
+        top.deliveriesPerSec(),
+        top.clients,
+        top.rate,
+        top.result.latency.percentile(99),
+    });
+    try out.print("Largest room within SLO: {d} clients\n", .{largest_room});
+    try out.flush();
+}
+
+fn measure(allocator: Allocator, options: Options, clients: usize, rate: u64) !Step {
+    const server = try loadgen.HeadlessServer.startWithLimits(allocator, clients, options.limits);
+    defer server.stop();
+
+    const total = @max(rate * STEP_S, clients);
+    const result = try loadgen.run(allocator, server.address(), .{
+        .clients = clients,
+        .messages_per_client = std.math.divCeil(usize, total, clients) catch unreachable,
+        .rate = rate,
+    });
+    return .{ .clients = clients, .rate = rate, .result = result };
+}
+
+/// Percentiles come from power-of-two histogram buckets, so the p99 check
+/// is against the bucket's upper bound and errs on the strict side.
+fn meetsSlo(options: Options, result: *const loadgen.Result) bool {
+    return result.out_of_order == 0 and
+        result.corrupt == 0 and
+        result.deliveryRatio() >= options.slo_delivery and
+        result.latency.percentile(99) <= options.slo_p99_us;
+}
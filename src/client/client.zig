@@ -16,7 +16,25 @@ pub const Command = enum {
     }
 
     pub fn helpText() []const u8 {
-        return "[Help] Commands: /exit, /clear, /help";
+        return "[Help] Commands: /exit, /clear, /help, /ttl <seconds> <message>";
+    }
+};
+
+/// `/ttl <seconds> <message>` sends a message that disappears from the
+/// server's history and every client's scrollback after that long.
+pub const EphemeralCommand = struct {
+    ttl_s: u32,
+    text: []const u8,
+
+    pub fn parse(message: []const u8) ?EphemeralCommand {
+        const prefix = "/ttl ";
+        if (!std.mem.startsWith(u8, message, prefix)) return null;
+        const rest = std.mem.trimLeft(u8, message[prefix.len..], " ");
+        const space = std.mem.indexOfScalar(u8, rest, ' ') orelse return null;
+        const ttl_s = std.fmt.parseInt(u32, rest[0..space], 10) catch return null;
+        const text = std.mem.trim(u8, rest[space + 1 ..], " ");
+        if (ttl_s == 0 or text.len == 0) return null;
+        return .{ .ttl_s = ttl_s, .text = text };
     }
 };
 
@@ -24,6 +42,20 @@ pub const ChatMessage = struct {
     content: []const u8,
     timestamp: i64,
     allocator: std.mem.Allocator,
+    /// Position in the scrollback, increasing and never reused, so an
+    /// entry can be found by binary search after others are removed.
+    seq: u64 = 0,
+    /// An expired ephemeral message, no longer drawn; its content has
+    /// been freed. Hidden entries are removed in bulk.
+    hidden: bool = false,
+    /// An ephemeral message, hidden once it expires.
+    ephemeral: bool = false,
+    /// Our own lines are echoed as soon as they are typed; this ties the
+    /// echo to its outbox entry until the server acknowledges it.
+    local_id: u64 = 0,
+    delivery: Delivery = .none,
+
+    pub const Delivery = enum { none, pending, delivered, refused };
 
     pub fn create(allocator: std.mem.Allocator, content: []const u8) !ChatMessage {
         const owned = try allocator.dupe(u8, content);
@@ -49,15 +81,13 @@ pub const Client = struct {
     id: u32,
     username: [24]u8,
     username_len: usize,
+    /// Virtual host to join; empty for the server's default host.
+    host: []const u8 = "",
 
-    pub fn startClient(self: *Client) !void {
-        var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-        defer _ = gpa.deinit();
-        const allocator = gpa.allocator();
-
+    pub fn startClient(self: *Client, allocator: std.mem.Allocator) !void {
         const username = self.username[0..self.username_len];
 
-        var tui = try TuiClient.init(allocator, self.socket, self.address, username);
+        var tui = try TuiClient.init(allocator, self.socket, self.address, username, self.host);
         defer tui.deinit();
 
         try tui.run();
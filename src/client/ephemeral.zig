@@ -0,0 +1,122 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// The live ephemeral messages in the scrollback: each one's sequence
+/// number by id, and their deadlines in a min-heap, like the server's
+/// ExpiryIndex. An expiry notice or a due deadline then costs a lookup,
+/// never a scan of the scrollback.
+pub const EphemeralIndex = struct {
+    const Deadline = struct {
+        deadline_ms: i64,
+        id: u64,
+    };
+
+    const Live = struct {
+        seq: u64,
+        deadline_ms: i64,
+    };
+
+    allocator: Allocator,
+    /// Deadlines of messages may outlive them when a notice removes them
+    /// first; those are skipped when they come due, around the time the
+    /// notice arrived anyway, even if the id has been indexed again.
+    queue: std.PriorityQueue(Deadline, void, earlier),
+    live: std.AutoHashMapUnmanaged(u64, Live),
+
+    pub fn init(allocator: Allocator) EphemeralIndex {
+        return .{
+            .allocator = allocator,
+            .queue = .init(allocator, {}),
+            .live = .empty,
+        };
+    }
+
+    pub fn deinit(self: *EphemeralIndex) void {
+        self.queue.deinit();
+        self.live.deinit(self.allocator);
+    }
+
+    /// Indexes message `id` at `seq`. An id is indexed once; a replay of a
+    /// message still shown is checked with `contains` and not added, as it
+    /// would leave the first copy with no way to be hidden.
+    pub fn add(self: *EphemeralIndex, id: u64, seq: u64, deadline_ms: i64) !void {
+        std.debug.assert(!self.live.contains(id));
+        try self.live.ensureUnusedCapacity(self.allocator, 1);
+        try self.queue.add(.{ .deadline_ms = deadline_ms, .id = id });
+        self.live.putAssumeCapacity(id, .{ .seq = seq, .deadline_ms = deadline_ms });
+    }
+
+    pub fn contains(self: *const EphemeralIndex, id: u64) bool {
+        return self.live.contains(id);
+    }
+
+    /// Forgets message `id` and returns its sequence number, if it was live.
+    pub fn remove(self: *EphemeralIndex, id: u64) ?u64 {
+        const kv = self.live.fetchRemove(id) orelse return null;
+        return kv.value.seq;
+    }
+
+    /// Removes the next live message due at `now_ms` and returns its
+    /// sequence number.
+    pub fn popDue(self: *EphemeralIndex, now_ms: i64) ?u64 {
+        while (self.queue.peek()) |next| {
+            if (next.deadline_ms > now_ms) return null;
+            _ = self.queue.remove();
+            const live = self.live.get(next.id) orelse continue;
+            if (live.deadline_ms != next.deadline_ms) continue;
+            _ = self.live.remove(next.id);
+            return live.seq;
+        }
+        return null;
+    }
+
+    pub fn clear(self: *EphemeralIndex) void {
+        while (self.queue.removeOrNull()) |_| {}
+        self.live.clearRetainingCapacity();
+    }
+
+    pub fn count(self: *const EphemeralIndex) usize {
+        return self.live.count();
+    }
+
+    fn earlier(_: void, a: Deadline, b: Deadline) std.math.Order {
+        return std.math.order(a.deadline_ms, b.deadline_ms);
+    }
+};
+
+test "due messages and notices each find their message once" {
+    const testing = std.testing;
+
+    var index = EphemeralIndex.init(testing.allocator);
+    defer index.deinit();
+
+    try index.add(7, 100, 300);
+    try index.add(8, 101, 100);
+    try index.add(9, 102, 200);
+
+    // The notice for 9 beats its deadline.
+    try testing.expectEqual(@as(?u64, 102), index.remove(9));
+    try testing.expectEqual(@as(?u64, null), index.remove(9));
+
+    try testing.expectEqual(@as(?u64, 101), index.popDue(250));
+    try testing.expectEqual(@as(?u64, null), index.popDue(250));
+    try testing.expectEqual(@as(?u64, 100), index.popDue(300));
+    try testing.expectEqual(@as(usize, 0), index.count());
+}
+
+test "a message can be indexed again once it is gone" {
+    const testing = std.testing;
+
+    var index = EphemeralIndex.init(testing.allocator);
+    defer index.deinit();
+
+    try index.add(7, 100, 300);
+    try testing.expect(index.contains(7));
+    try testing.expectEqual(@as(?u64, 100), index.remove(7));
+    try testing.expect(!index.contains(7));
+
+    // Its old deadline is skipped; the new one holds.
+    try index.add(7, 105, 500);
+    try testing.expectEqual(@as(?u64, null), index.popDue(300));
+    try testing.expectEqual(@as(?u64, 105), index.popDue(500));
+}
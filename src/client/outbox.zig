@@ -0,0 +1,195 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// Chat lines written but not yet acknowledged, oldest first. The server's
+/// ack is the number of chat frames it has read on the connection, so an
+/// entry only needs to remember its position in that count.
+pub const Outbox = struct {
+    pub const Entry = struct {
+        /// Ties the entry to its local echo.
+        local_id: u64,
+        /// Position among the frames written on this connection; 0 while
+        /// the line still waits to be written.
+        seq: u32,
+        text: []u8,
+        sent_ns: i128,
+    };
+
+    pub const Delivered = struct {
+        local_id: u64,
+        latency_ns: u64,
+    };
+
+    allocator: Allocator,
+    entries: std.ArrayList(Entry),
+    /// Chat frames written on the current connection.
+    sent: u32,
+    next_local_id: u64,
+
+    pub fn init(allocator: Allocator) Outbox {
+        return .{
+            .allocator = allocator,
+            .entries = .empty,
+            .sent = 0,
+            .next_local_id = 1,
+        };
+    }
+
+    pub fn deinit(self: *Outbox) void {
+        for (self.entries.items) |entry| self.allocator.free(entry.text);
+        self.entries.deinit(self.allocator);
+    }
+
+    /// Queues a copy of `text`, unsent, and returns it.
+    pub fn push(self: *Outbox, text: []const u8) !*Entry {
+        const owned = try self.allocator.dupe(u8, text);
+        errdefer self.allocator.free(owned);
+        try self.entries.append(self.allocator, .{
+            .local_id = self.next_local_id,
+            .seq = 0,
+            .text = owned,
+            .sent_ns = 0,
+        });
+        self.next_local_id += 1;
+        return &self.entries.items[self.entries.items.len - 1];
+    }
+
+    /// Records that `entry` was written to the connection at `now_ns`.
+    pub fn markSent(self: *Outbox, entry: *Entry, now_ns: i128) void {
+        self.sent +%= 1;
+        entry.seq = self.sent;
+        entry.sent_ns = now_ns;
+    }
+
+    /// True if some line is still waiting for a connection. New lines
+    /// queue behind it so the server sees them in order.
+    pub fn stalled(self: *const Outbox) bool {
+        const items = self.entries.items;
+        return items.len > 0 and items[items.len - 1].seq == 0;
+    }
+
+    /// A new connection counts from zero again: everything still in the
+    /// outbox has to be written once more.
+    pub fn restart(self: *Outbox) void {
+        self.sent = 0;
+        for (self.entries.items) |*entry| entry.seq = 0;
+    }
+
+    /// Drops up to `out.len` entries covered by an ack of `received`
+    /// frames and reports them, oldest first. Call again while it fills
+    /// `out`.
+    pub fn ack(self: *Outbox, received: u32, now_ns: i128, out: []Delivered) []Delivered {
+        var n: usize = 0;
+        for (self.entries.items) |entry| {
+            if (n == out.len or entry.seq == 0 or entry.seq > received) break;
+            out[n] = .{
+                .local_id = entry.local_id,
+                .latency_ns = @intCast(@max(0, now_ns - entry.sent_ns)),
+            };
+            self.allocator.free(entry.text);
+            n += 1;
+        }
+        self.entries.replaceRangeAssumeCapacity(0, n, &.{});
+        return out[0..n];
+    }
+
+    /// Drops up to `out.len` of the written entries numbered `first`
+    /// through `first + n - 1`, which the server refused, and reports their
+    /// local ids. Call again while it fills `out`.
+    pub fn refuse(self: *Outbox, first: u32, n: u16, out: []u64) []u64 {
+        const items = self.entries.items;
+        var start: usize = 0;
+        while (start < items.len and items[start].seq != 0 and items[start].seq < first) start += 1;
+
+        var end = start;
+        while (end < items.len and end - start < out.len) : (end += 1) {
+            const entry = items[end];
+            if (entry.seq == 0 or entry.seq -% first >= n) break;
+            out[end - start] = entry.local_id;
+            self.allocator.free(entry.text);
+        }
+        self.entries.replaceRangeAssumeCapacity(start, end - start, &.{});
+        return out[0 .. end - start];
+    }
+
+    pub fn count(self: *const Outbox) usize {
+        return self.entries.items.len;
+    }
+};
+
+/// Send-to-ack times of delivered lines.
+pub const AckLatency = struct {
+    count: u64 = 0,
+    total_ns: u64 = 0,
+    max_ns: u64 = 0,
+    last_ns: u64 = 0,
+
+    pub fn record(self: *AckLatency, ns: u64) void {
+        self.count += 1;
+        self.total_ns +|= ns;
+        self.max_ns = @max(self.max_ns, ns);
+        self.last_ns = ns;
+    }
+
+    pub fn meanNs(self: *const AckLatency) u64 {
+        if (self.count == 0) return 0;
+        return self.total_ns / self.count;
+    }
+};
+
+test "acks release written lines in order and survive a reconnect" {
+    const testing = std.testing;
+
+    var outbox = Outbox.init(testing.allocator);
+    defer outbox.deinit();
+
+    const a = (try outbox.push("a")).local_id;
+    outbox.markSent(&outbox.entries.items[0], 100);
+    _ = try outbox.push("b");
+    outbox.markSent(&outbox.entries.items[1], 200);
+    // Written while the connection was down: still unsent.
+    _ = try outbox.push("c");
+    try testing.expect(outbox.stalled());
+
+    var out: [4]Outbox.Delivered = undefined;
+    const first = outbox.ack(1, 150, &out);
+    try testing.expectEqual(@as(usize, 1), first.len);
+    try testing.expectEqual(a, first[0].local_id);
+    try testing.expectEqual(@as(u64, 50), first[0].latency_ns);
+
+    // An ack past what was written never releases unsent lines.
+    try testing.expectEqual(@as(usize, 1), outbox.ack(9, 300, &out).len);
+    try testing.expectEqual(@as(usize, 1), outbox.count());
+
+    // After a reconnect the remaining line is renumbered from 1.
+    outbox.restart();
+    outbox.markSent(&outbox.entries.items[0], 400);
+    try testing.expect(!outbox.stalled());
+    const last = outbox.ack(1, 425, &out);
+    try testing.expectEqual(@as(usize, 1), last.len);
+    try testing.expectEqual(@as(u64, 25), last[0].latency_ns);
+    try testing.expectEqual(@as(usize, 0), outbox.count());
+}
+
+test "lines the server refused are reported, not delivered" {
+    const testing = std.testing;
+
+    var outbox = Outbox.init(testing.allocator);
+    defer outbox.deinit();
+
+    for ([_][]const u8{ "one", "two", "three" }, 0..) |text, i| {
+        _ = try outbox.push(text);
+        outbox.markSent(&outbox.entries.items[i], 0);
+    }
+
+    // Slow mode let the first line through; the notice comes before the ack.
+    var ids: [4]u64 = undefined;
+    const refused = outbox.refuse(2, 2, &ids);
+    try testing.expectEqualSlices(u64, &.{ 2, 3 }, refused);
+
+    var out: [4]Outbox.Delivered = undefined;
+    const delivered = outbox.ack(3, 10, &out);
+    try testing.expectEqual(@as(usize, 1), delivered.len);
+    try testing.expectEqual(@as(u64, 1), delivered[0].local_id);
+    try testing.expectEqual(@as(usize, 0), outbox.count());
+}
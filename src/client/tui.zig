@@ -6,10 +6,17 @@ const config = @import("../config.zig");
 const utils = @import("../utils.zig");
 const Writer = @import("../writer.zig").Writer;
 const Reader = @import("../reader.zig").Reader;
+const trace = @import("../trace.zig");
+const protocol = @import("../protocol.zig");
 const client = @import("client.zig");
+const EphemeralIndex = @import("ephemeral.zig").EphemeralIndex;
+const outbox_mod = @import("outbox.zig");
+const Outbox = outbox_mod.Outbox;
+const AckLatency = outbox_mod.AckLatency;
 const components = @import("../tui/components.zig");
 const ChatMessage = client.ChatMessage;
 const Command = client.Command;
+const EphemeralCommand = client.EphemeralCommand;
 
 const BUFFER_SIZE = config.BUFFER_SIZE;
 
@@ -21,6 +28,34 @@ const ScrollableList = components.ScrollableList;
 
 const colors = utils.colors;
 
+/// Lines before a reconnect matched against the replayed room history to
+/// find where it catches up, so a repeated short line cannot cut it early.
+const REPLAY_MATCH = 3;
+
+/// Handed from the receiver thread to the UI thread, in arrival order.
+/// Texts are owned by the queue.
+const Pending = union(enum) {
+    text: []const u8,
+    ephemeral: struct { text: []const u8, id: u64, ttl_ms: u32 },
+    expired: u64,
+    delivered: Outbox.Delivered,
+    /// Local id of a line the server refused.
+    refused: u64,
+    /// A new connection: what follows is the room history, some of it
+    /// already shown.
+    reconnected,
+    /// The room history replayed on joining is over.
+    history_end,
+
+    fn free(self: Pending, allocator: std.mem.Allocator) void {
+        switch (self) {
+            .text => |text| allocator.free(text),
+            .ephemeral => |e| allocator.free(e.text),
+            .expired, .delivered, .refused, .reconnected, .history_end => {},
+        }
+    }
+};
+
 const Event = union(enum) {
     key_press: Key,
     winsize: vaxis.Winsize,
@@ -33,11 +68,23 @@ pub const TuiClient = struct {
     socket: posix.socket_t,
     address: std.net.Address,
     username: []const u8,
+    /// Virtual host named in the hello sent on every connection.
+    host: []const u8,
 
     vx: vaxis.Vaxis,
-    tty: vaxis.Tty,
+    /// Null when rendering offscreen; output then goes to `discard`.
+    tty: ?vaxis.Tty,
+    discard: std.Io.Writer.Discarding,
 
     messages: ScrollableList(ChatMessage),
+    /// Sequence number of the next message added.
+    next_seq: u64,
+    /// Expired messages still in `messages`, not drawn.
+    hidden: usize,
+    /// Sequence number of the first message added since reconnecting,
+    /// until the replayed history has been checked against the scrollback.
+    replay_from: ?u64,
+    ephemerals: EphemeralIndex,
     text_input: InputField,
 
     running: bool,
@@ -47,28 +94,60 @@ pub const TuiClient = struct {
 
     receiver_thread: ?std.Thread,
 
-    pending_messages: std.ArrayList([]const u8),
+    pending_messages: std.ArrayList(Pending),
     message_mutex: std.Thread.Mutex,
 
-    pub fn init(allocator: std.mem.Allocator, socket: posix.socket_t, address: std.net.Address, username: []const u8) !*TuiClient {
-        const self = try allocator.create(TuiClient);
-        errdefer allocator.destroy(self);
-
+    /// Our lines not yet acknowledged by the server.
+    outbox: Outbox,
+    /// Guards `outbox` and socket writes, so a resend after reconnecting
+    /// cannot interleave with a new line.
+    send_mutex: std.Thread.Mutex,
+    /// Echoed lines still shown as pending. UI thread only.
+    awaiting_ack: usize,
+    ack_latency: AckLatency,
+    status_buf: [48]u8,
+
+    pub fn init(allocator: std.mem.Allocator, socket: posix.socket_t, address: std.net.Address, username: []const u8, host: []const u8) !*TuiClient {
         var tty_buf: [1024]u8 = undefined;
         var tty = try vaxis.Tty.init(&tty_buf);
         errdefer tty.deinit();
 
-        var vx = try vaxis.Vaxis.init(allocator, .{});
-        errdefer vx.deinit(allocator, tty.writer());
+        const self = try create(allocator, tty, socket, address, username);
+        self.host = host;
+        return self;
+    }
+
+    /// A client with no terminal and no connection, drawing into a screen
+    /// of the given size. Used by the render benchmark.
+    pub fn initOffscreen(allocator: std.mem.Allocator, username: []const u8, winsize: vaxis.Winsize) !*TuiClient {
+        const self = try create(allocator, null, -1, std.net.Address.initIp4(.{ 0, 0, 0, 0 }, 0), username);
+        errdefer self.deinit();
+
+        self.socket_valid = false;
+        try self.vx.resize(allocator, self.output(), winsize);
+        return self;
+    }
+
+    fn create(allocator: std.mem.Allocator, tty: ?vaxis.Tty, socket: posix.socket_t, address: std.net.Address, username: []const u8) !*TuiClient {
+        const self = try allocator.create(TuiClient);
+        errdefer allocator.destroy(self);
+
+        const vx = try vaxis.Vaxis.init(allocator, .{});
 
         self.* = .{
             .allocator = allocator,
             .socket = socket,
             .address = address,
             .username = username,
+            .host = "",
             .vx = vx,
             .tty = tty,
+            .discard = .init(&.{}),
             .messages = ScrollableList(ChatMessage).init(allocator),
+            .next_seq = 0,
+            .hidden = 0,
+            .replay_from = null,
+            .ephemerals = .init(allocator),
             .text_input = InputField.init(allocator),
             .running = true,
             .connected = true,
@@ -77,6 +156,11 @@ pub const TuiClient = struct {
             .receiver_thread = null,
             .pending_messages = .{},
             .message_mutex = .{},
+            .outbox = .init(allocator),
+            .send_mutex = .{},
+            .awaiting_ack = 0,
+            .ack_latency = .{},
+            .status_buf = undefined,
         };
 
         return self;
@@ -97,24 +181,27 @@ pub const TuiClient = struct {
             msg.destroy();
         }
         self.messages.deinit();
+        self.ephemerals.deinit();
 
         self.message_mutex.lock();
-        for (self.pending_messages.items) |msg| {
-            self.allocator.free(msg);
+        for (self.pending_messages.items) |pending| {
+            pending.free(self.allocator);
         }
         self.pending_messages.deinit(self.allocator);
         self.message_mutex.unlock();
 
+        self.outbox.deinit();
+
         self.text_input.deinit();
-        self.vx.deinit(self.allocator, self.tty.writer());
-        self.tty.deinit();
+        self.vx.deinit(self.allocator, self.output());
+        if (self.tty) |*tty| tty.deinit();
 
         self.allocator.destroy(self);
     }
 
     pub fn run(self: *TuiClient) !void {
         var loop: vaxis.Loop(Event) = .{
-            .tty = &self.tty,
+            .tty = &self.tty.?,
             .vaxis = &self.vx,
         };
         try loop.init();
@@ -122,16 +209,20 @@ pub const TuiClient = struct {
         try loop.start();
         defer loop.stop();
 
-        try self.vx.enterAltScreen(self.tty.writer());
+        try self.vx.enterAltScreen(self.output());
 
-        try self.vx.queryTerminal(self.tty.writer(), 1 * std.time.ns_per_s);
+        try self.vx.queryTerminal(self.output(), 1 * std.time.ns_per_s);
 
+        try sendHello(self.socket, self.host);
+
+        trace.registerThread("client-tui");
         self.receiver_thread = try std.Thread.spawn(.{}, receiveMessages, .{self});
 
         try self.addMessage("[System] Welcome to Zignal Chat! Type your message and press Enter to send. Press Ctrl+C to exit.");
 
         while (self.running) {
             self.processPendingMessages();
+            self.expireLocally(std.time.milliTimestamp());
 
             while (loop.tryEvent()) |event| {
                 try self.handleEvent(event);
@@ -191,14 +282,27 @@ pub const TuiClient = struct {
                 try self.text_input.handleKeyPress(key);
             },
             .winsize => |ws| {
-                try self.vx.resize(self.allocator, self.tty.writer(), ws);
+                try self.vx.resize(self.allocator, self.output(), ws);
             },
             else => {},
         }
     }
 
-    fn render(self: *TuiClient) !void {
-        const win = self.vx.window();
+    fn output(self: *TuiClient) *std.Io.Writer {
+        if (self.tty) |*tty| return tty.writer();
+        return &self.discard.writer;
+    }
+
+    pub fn render(self: *TuiClient) !void {
+        const span = trace.span("render");
+        defer span.end();
+
+        self.draw(self.vx.window());
+        try self.vx.render(self.output());
+    }
+
+    /// Lays out the whole screen into `win` without writing to the terminal.
+    pub fn draw(self: *TuiClient, win: Window) void {
         win.clear();
 
         const width = win.width;
@@ -228,7 +332,7 @@ pub const TuiClient = struct {
         const title_segment = [_]Cell.Segment{.{ .text = title_text, .style = title_style }};
         _ = win.print(&title_segment, .{ .col_offset = title_start });
 
-        const status_indicator = if (self.connected) " ● Connected " else " ○ Disconnected ";
+        const status_indicator = self.statusText();
         const status_indicator_style: Cell.Style = .{
             .fg = if (self.connected) colors.connected else colors.disconnected,
             .bg = colors.zig,
@@ -267,11 +371,9 @@ pub const TuiClient = struct {
         });
 
         self.text_input.draw(input_box);
-
-        try self.vx.render(self.tty.writer());
     }
 
-    fn renderMessages(self: *TuiClient, area: Window, max_lines: u16) void {
+    pub fn renderMessages(self: *TuiClient, area: Window, max_lines: u16) void {
         if (self.messages.count() == 0) return;
 
         const renderMessage = struct {
@@ -310,9 +412,13 @@ pub const TuiClient = struct {
                     const separator = ": ";
                     const message_part = msg.content[colon_pos + 2 ..];
 
+                    // Our own lines stay dim until the server acks them,
+                    // and are struck through if it refused them.
+                    const pending = msg.delivery == .pending;
+                    const refused = msg.delivery == .refused;
                     const user_color = colors.forUsername(username_part);
-                    const username_style: Cell.Style = .{ .fg = user_color, .bold = true };
-                    const text_style: Cell.Style = .{ .fg = colors.text };
+                    const username_style: Cell.Style = .{ .fg = user_color, .bold = true, .dim = pending or refused };
+                    const text_style: Cell.Style = .{ .fg = colors.text, .dim = pending or refused, .strikethrough = refused };
 
                     const segments = [_]Cell.Segment{
                         .{ .text = timestamp, .style = timestamp_style },
@@ -334,7 +440,13 @@ pub const TuiClient = struct {
             }
         }.render;
 
-        self.messages.draw(area, @intCast(max_lines), renderMessage);
+        const isVisible = struct {
+            fn check(msg: *const ChatMessage) bool {
+                return !msg.hidden;
+            }
+        }.check;
+
+        self.messages.drawVisible(area, @intCast(max_lines), isVisible, renderMessage);
     }
 
     fn sendMessage(self: *TuiClient) !void {
@@ -356,6 +468,8 @@ pub const TuiClient = struct {
                         msg.destroy();
                     }
                     self.messages.clear();
+                    self.ephemerals.clear();
+                    self.hidden = 0;
                 },
                 .help => {
                     try self.addMessage(Command.helpText());
@@ -367,6 +481,23 @@ pub const TuiClient = struct {
         var formatted_message: [BUFFER_SIZE]u8 = undefined;
         const display_username = if (self.username.len > 0) self.username else "Anonymous";
 
+        if (EphemeralCommand.parse(message)) |cmd| {
+            const text = std.fmt.bufPrint(&formatted_message, "{s}: {s}", .{ display_username, cmd.text }) catch return;
+            var post_buf: [BUFFER_SIZE]u8 = undefined;
+            const post = protocol.Ephemeral.encodePost(&post_buf, cmd.ttl_s *| std.time.ms_per_s, text) catch return;
+
+            // No local echo: the server sends it back with the id that its
+            // expiry notice will carry.
+            Writer.init(self.socket).writeMessage(post) catch |err| {
+                var err_buf: [64]u8 = undefined;
+                const err_msg = std.fmt.bufPrint(&err_buf, "[System] Failed to send message: {}", .{err}) catch "[System] Failed to send message";
+                try self.addMessage(err_msg);
+                return;
+            };
+            self.text_input.clear();
+            return;
+        }
+
         const formatted = std.fmt.bufPrint(&formatted_message, "{s}: {s}", .{
             display_username,
             message,
@@ -374,37 +505,222 @@ pub const TuiClient = struct {
             return;
         };
 
+        var write_err: ?anyerror = null;
+        self.send_mutex.lock();
+        // Without a connection, or behind a line that is still unsent, the
+        // line waits for the resend after reconnecting.
+        const held = !self.socket_valid or self.outbox.stalled();
+        const entry = self.outbox.push(formatted) catch |err| {
+            self.send_mutex.unlock();
+            return err;
+        };
+        const local_id = entry.local_id;
+        if (held) {
+            write_err = error.NotConnected;
+        } else if (Writer.init(self.socket).writeMessage(formatted)) |_| {
+            self.outbox.markSent(entry, std.time.nanoTimestamp());
+        } else |err| {
+            write_err = err;
+        }
+        self.send_mutex.unlock();
+
         try self.addMessage(formatted);
+        const msg = self.messages.getMut(self.messages.count() - 1).?;
+        msg.local_id = local_id;
+        msg.delivery = .pending;
+        self.awaiting_ack += 1;
+        self.text_input.clear();
 
-        const writer = Writer.init(self.socket);
-        writer.writeMessage(formatted) catch |err| {
-            var err_buf: [64]u8 = undefined;
-            const err_msg = std.fmt.bufPrint(&err_buf, "[System] Failed to send message: {}", .{err}) catch "[System] Failed to send message";
+        if (write_err) |err| {
+            var err_buf: [96]u8 = undefined;
+            const err_msg = std.fmt.bufPrint(&err_buf, "[System] Message queued, will resend on reconnect: {}", .{err}) catch "[System] Message queued, will resend on reconnect";
             try self.addMessage(err_msg);
-            return;
-        };
+        }
+    }
 
-        self.text_input.clear();
+    /// The title bar's right side: connection state, then how many of our
+    /// lines await an ack or how long the last one took.
+    fn statusText(self: *TuiClient) []const u8 {
+        const state = if (self.connected) " ● Connected" else " ○ Disconnected";
+        if (self.awaiting_ack > 0) {
+            return std.fmt.bufPrint(&self.status_buf, "{s} · {d} pending ", .{ state, self.awaiting_ack }) catch state;
+        }
+        if (self.ack_latency.count > 0) {
+            return std.fmt.bufPrint(&self.status_buf, "{s} · ack {d}ms ", .{ state, self.ack_latency.last_ns / std.time.ns_per_ms }) catch state;
+        }
+        return std.fmt.bufPrint(&self.status_buf, "{s} ", .{state}) catch state;
+    }
+
+    fn markDelivered(self: *TuiClient, delivered: Outbox.Delivered) void {
+        self.ack_latency.record(delivered.latency_ns);
+        self.setDelivery(delivered.local_id, .delivered);
+    }
+
+    fn markRefused(self: *TuiClient, local_id: u64) void {
+        self.setDelivery(local_id, .refused);
     }
 
-    fn addMessage(self: *TuiClient, content: []const u8) !void {
-        const msg = try ChatMessage.create(self.allocator, content);
+    fn setDelivery(self: *TuiClient, local_id: u64, delivery: ChatMessage.Delivery) void {
+        self.awaiting_ack -|= 1;
+        var i = self.messages.count();
+        while (i > 0) {
+            i -= 1;
+            const msg = self.messages.getMut(i).?;
+            if (msg.local_id != local_id) continue;
+            msg.delivery = delivery;
+            return;
+        }
+    }
+
+    pub fn addMessage(self: *TuiClient, content: []const u8) !void {
+        var msg = try ChatMessage.create(self.allocator, content);
+        errdefer msg.destroy();
+        msg.seq = self.next_seq;
         try self.messages.append(msg);
+        self.next_seq += 1;
 
         self.messages.scroll_offset = 0;
     }
 
     fn processPendingMessages(self: *TuiClient) void {
+        const span = trace.span("processPendingMessages");
+        defer span.end();
+
         self.message_mutex.lock();
         defer self.message_mutex.unlock();
 
-        for (self.pending_messages.items) |msg| {
-            self.addMessage(msg) catch {};
-            self.allocator.free(msg);
+        const now_ms = std.time.milliTimestamp();
+        for (self.pending_messages.items) |pending| {
+            switch (pending) {
+                .text => |text| self.addMessage(text) catch {},
+                .ephemeral => |e| blk: {
+                    // Replayed from the room history while still shown;
+                    // the copy we have expires on its own.
+                    if (self.ephemerals.contains(e.id)) break :blk;
+                    self.addMessage(e.text) catch break :blk;
+                    const seq = self.next_seq - 1;
+                    self.messages.getMut(self.messages.count() - 1).?.ephemeral = true;
+                    // Untracked, it would never expire, so it is not shown.
+                    self.ephemerals.add(e.id, seq, now_ms + e.ttl_ms) catch self.hideSeq(seq);
+                },
+                .expired => |id| self.removeEphemeral(id),
+                .delivered => |delivered| self.markDelivered(delivered),
+                .refused => |local_id| self.markRefused(local_id),
+                .reconnected => self.replay_from = self.next_seq,
+                .history_end => self.dropReplayed(),
+            }
+            pending.free(self.allocator);
         }
         self.pending_messages.clearRetainingCapacity();
     }
 
+    fn removeEphemeral(self: *TuiClient, id: u64) void {
+        const seq = self.ephemerals.remove(id) orelse return;
+        self.hideSeq(seq);
+    }
+
+    /// Drops ephemeral messages past their TTL whose expiry notice never
+    /// came, e.g. because it was sent while we were reconnecting, or
+    /// because the room keeps no history to expire them from.
+    fn expireLocally(self: *TuiClient, now_ms: i64) void {
+        while (self.ephemerals.popDue(now_ms)) |seq| self.hideSeq(seq);
+    }
+
+    /// Hides the replayed history lines the scrollback already had before
+    /// reconnecting: everything up to the last room line shown then, found
+    /// with the few lines before it. If the replay does not reach back
+    /// that far, nothing is hidden.
+    fn dropReplayed(self: *TuiClient) void {
+        const from = self.replay_from orelse return;
+        self.replay_from = null;
+
+        const items = self.messages.items.items;
+        const split = std.sort.lowerBound(ChatMessage, items, from, orderBySeq);
+        var tail: [REPLAY_MATCH][]const u8 = undefined;
+        var tail_len: usize = 0;
+        var i = split;
+        while (i > 0 and tail_len < tail.len) {
+            i -= 1;
+            if (!isRoomLine(items[i])) continue;
+            tail[tail.len - 1 - tail_len] = items[i].content;
+            tail_len += 1;
+        }
+        if (tail_len == 0) return;
+
+        const cut = lastMatch(items[split..], tail[tail.len - tail_len ..]) orelse return;
+        for (items[split..][0 .. cut + 1]) |*msg| {
+            if (!msg.hidden and msg.delivery == .none and !isLocalLine(msg.*)) self.hideMessage(msg);
+        }
+        self.compactHidden();
+    }
+
+    /// Index in `replay` of the last room line that ends a run equal to
+    /// `tail`, or to as much of it as the replay holds before that line.
+    fn lastMatch(replay: []const ChatMessage, tail: []const []const u8) ?usize {
+        var j = replay.len;
+        next: while (j > 0) {
+            j -= 1;
+            if (!isRoomLine(replay[j])) continue;
+            var k = j + 1;
+            var want = tail.len;
+            while (want > 0) {
+                while (k > 0 and !isRoomLine(replay[k - 1])) k -= 1;
+                if (k == 0) break;
+                k -= 1;
+                want -= 1;
+                if (!std.mem.eql(u8, replay[k].content, tail[want])) continue :next;
+            }
+            if (want < tail.len) return j;
+        }
+        return null;
+    }
+
+    /// Chat from the room, as opposed to our lines still awaiting the
+    /// server, notices and expiring lines.
+    fn isRoomLine(msg: ChatMessage) bool {
+        return !msg.hidden and !msg.ephemeral and !isLocalLine(msg) and
+            (msg.delivery == .none or msg.delivery == .delivered);
+    }
+
+    fn isLocalLine(msg: ChatMessage) bool {
+        return std.mem.startsWith(u8, msg.content, "[System]") or std.mem.startsWith(u8, msg.content, "[Server]");
+    }
+
+    /// Hides message `seq`, found by binary search. Hidden entries are
+    /// removed together once they are half the scrollback, so each costs
+    /// O(1) amortized instead of an ordered remove.
+    fn hideSeq(self: *TuiClient, seq: u64) void {
+        const items = self.messages.items.items;
+        const idx = std.sort.binarySearch(ChatMessage, items, seq, orderBySeq) orelse return;
+        self.hideMessage(&items[idx]);
+        self.compactHidden();
+    }
+
+    fn hideMessage(self: *TuiClient, msg: *ChatMessage) void {
+        if (msg.hidden) return;
+        msg.destroy();
+        msg.content = "";
+        msg.hidden = true;
+        self.hidden += 1;
+    }
+
+    fn compactHidden(self: *TuiClient) void {
+        const items = self.messages.items.items;
+        if (self.hidden * 2 < items.len) return;
+        var kept: usize = 0;
+        for (items) |item| {
+            if (item.hidden) continue;
+            items[kept] = item;
+            kept += 1;
+        }
+        self.messages.items.shrinkRetainingCapacity(kept);
+        self.hidden = 0;
+    }
+
+    fn orderBySeq(seq: u64, msg: ChatMessage) std.math.Order {
+        return std.math.order(seq, msg.seq);
+    }
+
     fn receiveMessages(self: *TuiClient) void {
         var message_buffer: [BUFFER_SIZE]u8 = undefined;
 
@@ -421,15 +737,14 @@ pub const TuiClient = struct {
                     const owned = self.allocator.dupe(u8, err_msg) catch continue;
 
                     self.message_mutex.lock();
-                    self.pending_messages.append(self.allocator, owned) catch {
+                    self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
                         self.allocator.free(owned);
                     };
                     self.message_mutex.unlock();
 
                     self.connected = false;
                     self.reconnecting = true;
-                    posix.close(self.socket);
-                    self.socket_valid = false;
+                    self.dropSocket();
                 }
                 continue;
             };
@@ -438,28 +753,126 @@ pub const TuiClient = struct {
                 const owned = self.allocator.dupe(u8, "[System] Disconnected from server. Attempting to reconnect...") catch continue;
 
                 self.message_mutex.lock();
-                self.pending_messages.append(self.allocator, owned) catch {
+                self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
                     self.allocator.free(owned);
                 };
                 self.message_mutex.unlock();
 
                 self.connected = false;
                 self.reconnecting = true;
-                posix.close(self.socket);
-                self.socket_valid = false;
+                self.dropSocket();
+                continue;
+            }
+
+            // Control frames drive the protocol and are not shown as such.
+            if (protocol.isControl(message.?)) {
+                self.handleControl(message.?);
                 continue;
             }
 
             const owned = self.allocator.dupe(u8, message.?) catch continue;
 
             self.message_mutex.lock();
-            self.pending_messages.append(self.allocator, owned) catch {
+            self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
                 self.allocator.free(owned);
             };
             self.message_mutex.unlock();
         }
     }
 
+    /// Closes the lost connection; `sendMessage` holds new lines from now on.
+    fn dropSocket(self: *TuiClient) void {
+        self.send_mutex.lock();
+        defer self.send_mutex.unlock();
+        posix.close(self.socket);
+        self.socket_valid = false;
+    }
+
+    fn handleControl(self: *TuiClient, frame: []const u8) void {
+        switch (protocol.kind(frame) orelse return) {
+            .ephemeral => {
+                const message = protocol.Ephemeral.decode(protocol.body(frame)) orelse return;
+                const owned = self.allocator.dupe(u8, message.text) catch return;
+                self.queuePending(.{ .ephemeral = .{ .text = owned, .id = message.id, .ttl_ms = message.ttl_ms } });
+            },
+            .expired => {
+                var ids = protocol.ExpiredIds.init(protocol.body(frame));
+                while (ids.next()) |id| self.queuePending(.{ .expired = id });
+            },
+            .ack => {
+                const received = protocol.decodeAck(protocol.body(frame)) orelse return;
+                const now_ns = std.time.nanoTimestamp();
+                var out: [32]Outbox.Delivered = undefined;
+                while (true) {
+                    self.send_mutex.lock();
+                    const delivered = self.outbox.ack(received, now_ns, &out);
+                    self.send_mutex.unlock();
+                    for (delivered) |d| self.queuePending(.{ .delivered = d });
+                    if (delivered.len < out.len) break;
+                }
+            },
+            .history_end => self.queuePending(.history_end),
+            .rejected => {
+                const notice = protocol.Rejected.decode(protocol.body(frame)) orelse return;
+                var ids: [32]u64 = undefined;
+                while (true) {
+                    self.send_mutex.lock();
+                    const refused = self.outbox.refuse(notice.first_seq, notice.seq_count, &ids);
+                    self.send_mutex.unlock();
+                    for (refused) |local_id| self.queuePending(.{ .refused = local_id });
+                    if (refused.len < ids.len) break;
+                }
+
+                const why = switch (notice.reason) {
+                    .slow_mode => "Slow mode is on",
+                    .room_budget => "The room is busy",
+                    .ephemeral_limit => "Too many disappearing messages waiting to expire",
+                    _ => "Refused by the server",
+                };
+                var buf: [128]u8 = undefined;
+                const text = std.fmt.bufPrint(&buf, "[System] {s}: {d} message(s) not delivered, try again in {d:.1}s", .{
+                    why,
+                    notice.count,
+                    @as(f64, @floatFromInt(notice.retry_after_ms)) / std.time.ms_per_s,
+                }) catch return;
+                self.queueSystemMessage(text);
+            },
+            else => {},
+        }
+    }
+
+    /// Hands a line from the receiver thread to the UI thread.
+    fn queueSystemMessage(self: *TuiClient, text: []const u8) void {
+        const owned = self.allocator.dupe(u8, text) catch return;
+        self.queuePending(.{ .text = owned });
+    }
+
+    fn queuePending(self: *TuiClient, pending: Pending) void {
+        self.message_mutex.lock();
+        defer self.message_mutex.unlock();
+        self.pending_messages.append(self.allocator, pending) catch pending.free(self.allocator);
+    }
+
+    /// Names our virtual host and asks for acks. Sent first on every
+    /// connection, so the server puts us in a room before anything else
+    /// arrives, even when that is the default one.
+    fn sendHello(socket: posix.socket_t, host: []const u8) !void {
+        var buf: [4 + protocol.MAX_HOST_NAME]u8 = undefined;
+        const hello: protocol.Hello = .{ .host = host, .flags = .{ .acks = true } };
+        try Writer.init(socket).writeMessage(try hello.encode(&buf));
+    }
+
+    /// Writes every unacked line to a fresh connection, oldest first. The
+    /// server counts from zero again, so they are renumbered as they go.
+    fn resendUnacked(self: *TuiClient, socket: posix.socket_t) !void {
+        self.outbox.restart();
+        const writer = Writer.init(socket);
+        for (self.outbox.entries.items) |*entry| {
+            try writer.writeMessage(entry.text);
+            self.outbox.markSent(entry, std.time.nanoTimestamp());
+        }
+    }
+
     fn attemptReconnect(self: *TuiClient) void {
         std.Thread.sleep(3 * std.time.ns_per_s);
 
@@ -471,7 +884,7 @@ pub const TuiClient = struct {
             const owned = self.allocator.dupe(u8, err_msg) catch return;
 
             self.message_mutex.lock();
-            self.pending_messages.append(self.allocator, owned) catch {
+            self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
                 self.allocator.free(owned);
             };
             self.message_mutex.unlock();
@@ -485,22 +898,49 @@ pub const TuiClient = struct {
             const owned = self.allocator.dupe(u8, err_msg) catch return;
 
             self.message_mutex.lock();
-            self.pending_messages.append(self.allocator, owned) catch {
+            self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
                 self.allocator.free(owned);
             };
             self.message_mutex.unlock();
             return;
         };
 
+        sendHello(new_socket, self.host) catch |err| {
+            posix.close(new_socket);
+            var err_buf: [128]u8 = undefined;
+            const err_msg = std.fmt.bufPrint(&err_buf, "[System] Reconnect failed (hello): {}. Retrying in 3 seconds...", .{err}) catch "[System] Reconnect failed. Retrying in 3 seconds...";
+            const owned = self.allocator.dupe(u8, err_msg) catch return;
+
+            self.message_mutex.lock();
+            self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
+                self.allocator.free(owned);
+            };
+            self.message_mutex.unlock();
+            return;
+        };
+
+        self.send_mutex.lock();
+        self.resendUnacked(new_socket) catch |err| {
+            self.send_mutex.unlock();
+            posix.close(new_socket);
+            var err_buf: [128]u8 = undefined;
+            const err_msg = std.fmt.bufPrint(&err_buf, "[System] Reconnect failed (resend): {}. Retrying in 3 seconds...", .{err}) catch "[System] Reconnect failed. Retrying in 3 seconds...";
+            self.queueSystemMessage(err_msg);
+            return;
+        };
         self.socket = new_socket;
         self.connected = true;
         self.reconnecting = false;
         self.socket_valid = true;
+        self.send_mutex.unlock();
 
+        // Before anything the new connection brings, so the replayed
+        // history can be told apart.
+        self.queuePending(.reconnected);
         const owned = self.allocator.dupe(u8, "[System] Reconnected to server!") catch return;
 
         self.message_mutex.lock();
-        self.pending_messages.append(self.allocator, owned) catch {
+        self.pending_messages.append(self.allocator, .{ .text = owned }) catch {
             self.allocator.free(owned);
         };
         self.message_mutex.unlock();
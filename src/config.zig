@@ -1,2 +1,74 @@
-pub const BUFFER_SIZE = 1024;
-pub const MAX_CLIENTS = 4096;
+const build_options = @import("build_options");
+
+/// Deployment profiles selected at build time with -Dprofile.
+///   embedded:   small buffers and tables for constrained hosts
+///   desktop:    the defaults
+///   datacenter: large frames, tables and queues for busy hosts
+pub const Profile = enum {
+    embedded,
+    desktop,
+    datacenter,
+};
+
+pub const profile: Profile = @field(Profile, build_options.profile);
+
+const Sizes = struct {
+    buffer_size: usize,
+    max_clients: usize,
+    listen_backlog: u31,
+    log_slots: usize,
+    log_buffer_size: usize,
+    log_history: usize,
+};
+
+const sizes: Sizes = switch (profile) {
+    .embedded => .{
+        .buffer_size = 512,
+        .max_clients = 64,
+        .listen_backlog = 16,
+        .log_slots = 512,
+        .log_buffer_size = 16 * 1024,
+        .log_history = 200,
+    },
+    .desktop => .{
+        .buffer_size = 1024,
+        .max_clients = 4096,
+        .listen_backlog = 128,
+        .log_slots = 8192,
+        .log_buffer_size = 256 * 1024,
+        .log_history = 1000,
+    },
+    .datacenter => .{
+        .buffer_size = 4096,
+        .max_clients = 65536,
+        .listen_backlog = 1024,
+        .log_slots = 65536,
+        .log_buffer_size = 1024 * 1024,
+        .log_history = 5000,
+    },
+};
+
+/// Largest frame a connection can send, and the size of each reader buffer.
+pub const BUFFER_SIZE = sizes.buffer_size;
+/// Poll table size; one slot is taken by the listener.
+pub const MAX_CLIENTS = sizes.max_clients;
+/// Most clients a server can be configured for with --size.
+pub const MAX_CONNECTIONS = MAX_CLIENTS - 1;
+pub const LISTEN_BACKLOG = sizes.listen_backlog;
+/// Slots in the log file sink ring (a power of two) and its write buffer.
+pub const LOG_SLOTS = sizes.log_slots;
+pub const LOG_BUFFER_SIZE = sizes.log_buffer_size;
+/// Log lines kept by the server TUI.
+pub const LOG_HISTORY = sizes.log_history;
+
+/// Buffer layout for server connection readers, selected with -Dreader.
+///   linear:   a heap buffer; leftover bytes are copied to the front when
+///             a frame does not fit behind them
+///   mirrored: a ring whose pages are mapped twice back to back, so every
+///             frame is contiguous and nothing is ever copied (Linux only)
+pub const ReaderBackend = enum {
+    linear,
+    mirrored,
+};
+
+pub const READER_BACKEND: ReaderBackend = @field(ReaderBackend, build_options.reader);
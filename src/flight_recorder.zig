@@ -0,0 +1,147 @@
+const std = @import("std");
+const posix = std.posix;
+
+/// Crash flight recorder.
+/// Every registered thread owns a fixed ring of the last `RING_SIZE` events.
+/// Recording is a plain store plus one release store of the ring head, and
+/// the dump path only uses stack buffers and raw `open`/`write`, so it is
+/// safe to call from a signal handler or a panic.
+pub const RING_SIZE = 1024;
+pub const MAX_THREADS = 8;
+
+pub const Kind = enum(u8) {
+    /// a = socket, b = connected count
+    accept,
+    /// a = socket, b = connected count
+    disconnect,
+    /// a = error code
+    err,
+    /// a = duration in ns, b = bytes flushed
+    slow_flush,
+    /// a = duration in ns, b = connected count
+    loop_iteration,
+};
+
+pub const Event = struct {
+    timestamp_ns: i64,
+    kind: Kind,
+    a: u64,
+    b: u64,
+};
+
+const Ring = struct {
+    name: [16]u8,
+    name_len: usize,
+    head: std.atomic.Value(u64),
+    events: [RING_SIZE]Event,
+};
+
+var rings: [MAX_THREADS]Ring = undefined;
+var ring_count: std.atomic.Value(usize) = .init(0);
+threadlocal var local_ring: ?*Ring = null;
+
+var dump_path_buf: [std.fs.max_path_bytes]u8 = undefined;
+var dump_path_len: usize = 0;
+var dumping: std.atomic.Value(bool) = .init(false);
+
+/// Sets the dump file and installs the SIGUSR1 handler.
+pub fn install(path: []const u8) void {
+    const len = @min(path.len, dump_path_buf.len);
+    @memcpy(dump_path_buf[0..len], path[0..len]);
+    dump_path_len = len;
+
+    var act: posix.Sigaction = .{
+        .handler = .{ .handler = handleSignal },
+        .mask = posix.sigemptyset(),
+        .flags = posix.SA.RESTART,
+    };
+    posix.sigaction(posix.SIG.USR1, &act, null);
+}
+
+/// Gives the calling thread its own ring. Threads beyond `MAX_THREADS`
+/// record nothing.
+pub fn registerThread(name: []const u8) void {
+    if (local_ring != null) return;
+
+    const idx = ring_count.fetchAdd(1, .acq_rel);
+    if (idx >= MAX_THREADS) return;
+
+    const ring = &rings[idx];
+    const len = @min(name.len, ring.name.len);
+    @memcpy(ring.name[0..len], name[0..len]);
+    ring.name_len = len;
+    ring.head = .init(0);
+    local_ring = ring;
+}
+
+pub inline fn record(kind: Kind, a: u64, b: u64) void {
+    const ring = local_ring orelse return;
+    const head = ring.head.raw;
+    ring.events[head % RING_SIZE] = .{
+        .timestamp_ns = @intCast(std.time.nanoTimestamp()),
+        .kind = kind,
+        .a = a,
+        .b = b,
+    };
+    ring.head.store(head + 1, .release);
+}
+
+pub fn recordError(err: anyerror) void {
+    record(.err, @intFromError(err), 0);
+}
+
+fn handleSignal(_: i32) callconv(.c) void {
+    dump("SIGUSR1");
+}
+
+/// Writes every ring to the dump file, oldest event first.
+/// Concurrent dumps are dropped rather than interleaved.
+pub fn dump(reason: []const u8) void {
+    if (dump_path_len == 0) return;
+    if (dumping.swap(true, .acquire)) return;
+    defer dumping.store(false, .release);
+
+    const fd = posix.open(dump_path_buf[0..dump_path_len], .{
+        .ACCMODE = .WRONLY,
+        .CREAT = true,
+        .TRUNC = true,
+    }, 0o644) catch return;
+    defer posix.close(fd);
+
+    var line_buf: [256]u8 = undefined;
+    writeLine(fd, &line_buf, "zignal flight recorder dump: {s}\n", .{reason});
+
+    const count = @min(ring_count.load(.acquire), MAX_THREADS);
+    for (rings[0..count]) |*ring| {
+        const head = ring.head.load(.acquire);
+        const first = if (head > RING_SIZE) head - RING_SIZE else 0;
+
+        writeLine(fd, &line_buf, "\n== thread {s} ({d} events, {d} kept) ==\n", .{
+            ring.name[0..ring.name_len], head, head - first,
+        });
+
+        var i = first;
+        while (i < head) : (i += 1) {
+            const event = ring.events[i % RING_SIZE];
+            switch (event.kind) {
+                .err => writeLine(fd, &line_buf, "{d} err {s}\n", .{
+                    event.timestamp_ns,
+                    @errorName(@errorFromInt(@as(std.meta.Int(.unsigned, @bitSizeOf(anyerror)), @truncate(event.a)))),
+                }),
+                else => writeLine(fd, &line_buf, "{d} {s} a={d} b={d}\n", .{
+                    event.timestamp_ns, @tagName(event.kind), event.a, event.b,
+                }),
+            }
+        }
+    }
+}
+
+fn writeLine(fd: posix.fd_t, buf: []u8, comptime fmt: []const u8, args: anytype) void {
+    const line = std.fmt.bufPrint(buf, fmt, args) catch return;
+    var written: usize = 0;
+    while (written < line.len) {
+        const n = posix.write(fd, line[written..]) catch return;
+        if (n == 0) return;
+        written += n;
+    }
+}
@@ -0,0 +1,105 @@
+const std = @import("std");
+const build_options = @import("build_options");
+
+const trace = @import("trace.zig");
+const Histogram = @import("server/metrics.zig").Histogram;
+
+/// Compile-time gated probe points (`zig build -Dinstrument=true`).
+/// With the option off every probe is an empty inline function and the
+/// calls, their arguments and the probe storage compile out. With it on,
+/// counters and histograms are registered on first use and printed by
+/// `report`, and spans also feed the `--trace` output. Probes are hit from
+/// every thread, so they update with read-modify-write atomics.
+pub const enabled = build_options.instrument;
+
+pub const Kind = enum {
+    counter,
+    histogram,
+};
+
+pub const Probe = struct {
+    name: []const u8,
+    kind: Kind,
+    counter: std.atomic.Value(u64) = .init(0),
+    histogram: Histogram = .{},
+    registered: std.atomic.Value(bool) = .init(false),
+    next: ?*Probe = null,
+};
+
+var probes: std.atomic.Value(?*Probe) = .init(null);
+
+fn probe(comptime name: []const u8, comptime kind: Kind) *Probe {
+    const static = struct {
+        var p: Probe = .{ .name = name, .kind = kind };
+    };
+    if (!static.p.registered.load(.acquire)) {
+        register(&static.p);
+    }
+    return &static.p;
+}
+
+fn register(p: *Probe) void {
+    if (p.registered.swap(true, .acq_rel)) return;
+
+    var head = probes.load(.acquire);
+    while (true) {
+        p.next = head;
+        head = probes.cmpxchgWeak(head, p, .acq_rel, .acquire) orelse return;
+    }
+}
+
+/// Adds `n` to the counter `name`.
+pub inline fn count(comptime name: []const u8, n: u64) void {
+    if (!enabled) return;
+    _ = probe(name, .counter).counter.fetchAdd(n, .monotonic);
+}
+
+/// Records `value` in the histogram `name`.
+pub inline fn observe(comptime name: []const u8, value: u64) void {
+    if (!enabled) return;
+    probe(name, .histogram).histogram.observeShared(value);
+}
+
+pub const Span = if (enabled) struct {
+    probe: *Probe,
+    start_ns: i128,
+    trace_span: trace.Span,
+
+    /// Records the span duration in nanoseconds and closes the trace span.
+    pub inline fn end(self: Span) void {
+        self.trace_span.end();
+        self.probe.histogram.observeShared(@intCast(std.time.nanoTimestamp() - self.start_ns));
+    }
+} else struct {
+    pub inline fn end(_: Span) void {}
+};
+
+/// Times a region into the histogram `name` and, when tracing, a trace span.
+pub inline fn span(comptime name: [:0]const u8) Span {
+    if (!enabled) return .{};
+    return .{
+        .probe = probe(name, .histogram),
+        .start_ns = std.time.nanoTimestamp(),
+        .trace_span = trace.span(name),
+    };
+}
+
+/// Prints every registered probe to stderr.
+pub fn report() void {
+    if (!enabled) return;
+
+    std.debug.print("Instrumentation probes:\n", .{});
+    var it = probes.load(.acquire);
+    while (it) |p| : (it = p.next) {
+        switch (p.kind) {
+            .counter => std.debug.print("  {s}: {d}\n", .{ p.name, p.counter.load(.monotonic) }),
+            .histogram => std.debug.print("  {s}: n={d} p50<={d} p99<={d} max={d}\n", .{
+                p.name,
+                p.histogram.count.load(.monotonic),
+                p.histogram.percentile(50),
+                p.histogram.percentile(99),
+                p.histogram.max.load(.monotonic),
+            }),
+        }
+    }
+}
@@ -0,0 +1,81 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+
+/// The socket and clock operations the server's event loop performs.
+/// `system` forwards to the OS; `sim.Network` substitutes an in-memory
+/// network with a virtual clock so the loop can be driven deterministically.
+pub const Io = struct {
+    ptr: ?*anyopaque,
+    vtable: *const VTable,
+
+    pub const VTable = struct {
+        poll: *const fn (ptr: ?*anyopaque, fds: []posix.pollfd, timeout_ms: i32) posix.PollError!usize,
+        accept: *const fn (ptr: ?*anyopaque, listener: posix.socket_t, address: *net.Address) posix.AcceptError!posix.socket_t,
+        read: *const fn (ptr: ?*anyopaque, socket: posix.socket_t, buf: []u8) posix.ReadError!usize,
+        writev: *const fn (ptr: ?*anyopaque, socket: posix.socket_t, iov: []const posix.iovec_const) posix.WriteError!usize,
+        close: *const fn (ptr: ?*anyopaque, socket: posix.socket_t) void,
+        milliTimestamp: *const fn (ptr: ?*anyopaque) i64,
+    };
+
+    pub const system: Io = .{ .ptr = null, .vtable = &system_vtable };
+
+    pub inline fn poll(self: Io, fds: []posix.pollfd, timeout_ms: i32) posix.PollError!usize {
+        return self.vtable.poll(self.ptr, fds, timeout_ms);
+    }
+
+    /// Accepts a pending connection as a non-blocking socket.
+    pub inline fn accept(self: Io, listener: posix.socket_t, address: *net.Address) posix.AcceptError!posix.socket_t {
+        return self.vtable.accept(self.ptr, listener, address);
+    }
+
+    pub inline fn read(self: Io, socket: posix.socket_t, buf: []u8) posix.ReadError!usize {
+        return self.vtable.read(self.ptr, socket, buf);
+    }
+
+    pub inline fn writev(self: Io, socket: posix.socket_t, iov: []const posix.iovec_const) posix.WriteError!usize {
+        return self.vtable.writev(self.ptr, socket, iov);
+    }
+
+    pub inline fn close(self: Io, socket: posix.socket_t) void {
+        self.vtable.close(self.ptr, socket);
+    }
+
+    pub inline fn milliTimestamp(self: Io) i64 {
+        return self.vtable.milliTimestamp(self.ptr);
+    }
+};
+
+const system_vtable: Io.VTable = .{
+    .poll = systemPoll,
+    .accept = systemAccept,
+    .read = systemRead,
+    .writev = systemWritev,
+    .close = systemClose,
+    .milliTimestamp = systemMilliTimestamp,
+};
+
+fn systemPoll(_: ?*anyopaque, fds: []posix.pollfd, timeout_ms: i32) posix.PollError!usize {
+    return posix.poll(fds, timeout_ms);
+}
+
+fn systemAccept(_: ?*anyopaque, listener: posix.socket_t, address: *net.Address) posix.AcceptError!posix.socket_t {
+    var len: posix.socklen_t = @sizeOf(net.Address);
+    return posix.accept(listener, &address.any, &len, posix.SOCK.NONBLOCK);
+}
+
+fn systemRead(_: ?*anyopaque, socket: posix.socket_t, buf: []u8) posix.ReadError!usize {
+    return posix.read(socket, buf);
+}
+
+fn systemWritev(_: ?*anyopaque, socket: posix.socket_t, iov: []const posix.iovec_const) posix.WriteError!usize {
+    return posix.writev(socket, iov);
+}
+
+fn systemClose(_: ?*anyopaque, socket: posix.socket_t) void {
+    posix.close(socket);
+}
+
+fn systemMilliTimestamp(_: ?*anyopaque) i64 {
+    return std.time.milliTimestamp();
+}
@@ -4,13 +4,42 @@ const posix = std.posix;
 
 const Server = @import("server/server.zig").Server;
 const Client = @import("client/client.zig").Client;
+const FileSink = @import("server/log_sink.zig").FileSink;
+const Capture = @import("server/capture.zig").Capture;
+const MemoryLimits = @import("server/memory.zig").Limits;
+const vhost = @import("server/vhost.zig");
+const logcat = @import("server/logcat.zig");
+const bench = @import("bench/bench.zig");
+const bench_compare = @import("bench/compare.zig");
+const bench_scale = @import("bench/scale.zig");
+const bench_render = @import("bench/render.zig");
+const replay = @import("bench/replay.zig");
+const netem = @import("bench/netem.zig");
+const selftest = @import("bench/selftest.zig");
+const simulator = @import("sim/simulator.zig");
+const alloc = @import("alloc.zig");
 const config = @import("config.zig");
+const flight_recorder = @import("flight_recorder.zig");
+const instrument = @import("instrument.zig");
+const trace = @import("trace.zig");
+const protocol = @import("protocol.zig");
 const printHelp = @import("utils.zig").printHelp;
 
+pub const panic = std.debug.FullPanic(panicHandler);
+
+fn panicHandler(msg: []const u8, first_trace_addr: ?usize) noreturn {
+    flight_recorder.dump("panic");
+    std.debug.defaultPanic(msg, first_trace_addr);
+}
+
 pub fn main() !void {
-    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-    defer _ = gpa.deinit();
-    const allocator = gpa.allocator();
+    var backends = alloc.Backends.init(try alloc.selectBackend());
+    defer backends.deinit();
+
+    var counting = alloc.CountingAllocator.init(backends.allocator());
+    const profile = alloc.profilingRequested();
+    defer if (profile) counting.printReport();
+    const allocator = if (profile) counting.allocator() else backends.allocator();
 
     const args = try std.process.argsAlloc(allocator);
     defer std.process.argsFree(allocator, args);
@@ -27,7 +56,18 @@ pub fn main() !void {
 
     if (std.mem.eql(u8, args[1], "server")) {
         var port: u16 = 8080;
-        var max_clients: usize = config.MAX_CLIENTS - 1;
+        var max_clients: usize = config.MAX_CONNECTIONS;
+        var log_file: ?[]const u8 = null;
+        var flight_dump: []const u8 = "zignal-flight.log";
+        var trace_path: ?[]const u8 = null;
+        var capture_path: ?[]const u8 = null;
+        var limits: MemoryLimits = .{};
+        var self_test = false;
+        var slo_p99_ms: u64 = 50;
+        var hosts: std.ArrayList(vhost.Spec) = .empty;
+        defer hosts.deinit(allocator);
+        var history: usize = 0;
+        var policy: vhost.Policy = .{};
 
         var arg_index: usize = 2;
         while (arg_index < args.len) {
@@ -54,13 +94,150 @@ pub fn main() !void {
                     printHelp(args[0]);
                     return error.InvalidArguments;
                 };
-                if (size == 0 or size > 4095) {
-                    std.debug.print("Error: Size must be between 1 and 4095.\n", .{});
+                if (size == 0 or size > config.MAX_CONNECTIONS) {
+                    std.debug.print("Error: Size must be between 1 and {d}.\n", .{config.MAX_CONNECTIONS});
                     printHelp(args[0]);
                     return error.InvalidArguments;
                 }
                 max_clients = size;
                 arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--log-file")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Log file flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                log_file = args[arg_index + 1];
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--flight-dump")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Flight dump flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                flight_dump = args[arg_index + 1];
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--trace")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Trace flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                trace_path = args[arg_index + 1];
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--capture")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Capture flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                capture_path = args[arg_index + 1];
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--vhost")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Vhost flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                const spec = vhost.Spec.parse(args[arg_index + 1]) catch {
+                    std.debug.print("Error: Invalid virtual host '{s}', expected <name>[:<size>][,slow=<ms>][,rate=<n>][,burst=<n>].\n", .{args[arg_index + 1]});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                };
+                try hosts.append(allocator, spec);
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--history")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: History flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                history = std.fmt.parseInt(usize, args[arg_index + 1], 10) catch {
+                    std.debug.print("Error: Invalid --history value '{s}'.\n", .{args[arg_index + 1]});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                };
+                if (history > vhost.History.MAX_FRAMES) {
+                    std.debug.print("Error: History must be between 0 and {d}.\n", .{vhost.History.MAX_FRAMES});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--slow-mode") or
+                std.mem.eql(u8, args[arg_index], "--room-rate") or
+                std.mem.eql(u8, args[arg_index], "--room-burst"))
+            {
+                const flag = args[arg_index];
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: {s} requires a value.\n", .{flag});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                const value = std.fmt.parseInt(u32, args[arg_index + 1], 10) catch {
+                    std.debug.print("Error: Invalid {s} value '{s}'.\n", .{ flag, args[arg_index + 1] });
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                };
+                if (std.mem.eql(u8, flag, "--slow-mode")) {
+                    policy.slow_ms = value;
+                } else if (std.mem.eql(u8, flag, "--room-rate")) {
+                    policy.rate = value;
+                } else {
+                    policy.burst = value;
+                }
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--self-test")) {
+                self_test = true;
+                arg_index += 1;
+            } else if (std.mem.eql(u8, args[arg_index], "--slo-p99")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: SLO flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                slo_p99_ms = std.fmt.parseInt(u64, args[arg_index + 1], 10) catch {
+                    std.debug.print("Error: Invalid --slo-p99 value '{s}'.\n", .{args[arg_index + 1]});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                };
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--mem-soft") or
+                std.mem.eql(u8, args[arg_index], "--mem-hard") or
+                std.mem.eql(u8, args[arg_index], "--conn-quota"))
+            {
+                const flag = args[arg_index];
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: {s} requires a value.\n", .{flag});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                const value = std.fmt.parseInt(usize, args[arg_index + 1], 10) catch {
+                    std.debug.print("Error: Invalid {s} value '{s}'.\n", .{ flag, args[arg_index + 1] });
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                };
+                if (std.mem.eql(u8, flag, "--conn-quota")) {
+                    // A backlog is at most one reader buffer, so a larger
+                    // quota could never be reached.
+                    if (value >= config.BUFFER_SIZE) {
+                        std.debug.print("Error: --conn-quota must be below the {d}-byte reader buffer.\n", .{config.BUFFER_SIZE});
+                        printHelp(args[0]);
+                        return error.InvalidArguments;
+                    }
+                    limits.connection_bytes = value;
+                } else {
+                    const bytes = std.math.mul(usize, value, 1024 * 1024) catch {
+                        std.debug.print("Error: {s} value '{s}' is out of range.\n", .{ flag, args[arg_index + 1] });
+                        printHelp(args[0]);
+                        return error.InvalidArguments;
+                    };
+                    if (std.mem.eql(u8, flag, "--mem-soft")) {
+                        limits.soft_bytes = bytes;
+                    } else {
+                        limits.hard_bytes = bytes;
+                    }
+                }
+                arg_index += 2;
             } else {
                 std.debug.print("Error: Unknown server option '{s}'.\n", .{args[arg_index]});
                 printHelp(args[0]);
@@ -68,14 +245,65 @@ pub fn main() !void {
             }
         }
 
+        if (self_test) {
+            try selftest.run(allocator, .{
+                .max_clients = max_clients,
+                .limits = limits,
+                .slo_p99_us = slo_p99_ms * std.time.us_per_ms,
+            });
+            return;
+        }
+
+        flight_recorder.install(flight_dump);
+        errdefer flight_recorder.dump("fatal error");
+
+        if (trace_path) |path| try trace.init(allocator, path);
+        defer trace.deinit();
+
         const address = try net.Address.parseIp4("0.0.0.0", port);
         var server = try Server.init(allocator, address, max_clients);
         defer server.deinit();
+        server.budget.limits = limits;
+        server.configureHosts(hosts.items, history, policy) catch |err| switch (err) {
+            error.DuplicateHost => {
+                std.debug.print("Error: Virtual host names must be unique.\n", .{});
+                return error.InvalidArguments;
+            },
+            else => return err,
+        };
+
+        const sink: ?*FileSink = if (log_file) |path| try FileSink.init(allocator, .{ .path = path }) else null;
+        defer if (sink) |s| s.deinit();
+        server.sink = sink;
+
+        const capture: ?*Capture = if (capture_path) |path| try Capture.init(allocator, path) else null;
+        defer if (capture) |c| c.deinit();
+        server.capture = capture;
+
         try server.start();
+        instrument.report();
+    } else if (std.mem.eql(u8, args[1], "logcat")) {
+        try logcat.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "bench")) {
+        try bench.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "bench-compare")) {
+        try bench_compare.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "bench-scale")) {
+        try bench_scale.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "bench-render")) {
+        try bench_render.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "replay")) {
+        try replay.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "simulate")) {
+        try simulator.run(allocator, args[2..]);
+    } else if (std.mem.eql(u8, args[1], "netem-proxy")) {
+        try netem.run(allocator, args[2..]);
     } else if (std.mem.eql(u8, args[1], "client")) {
         var username: ?[]const u8 = null;
         var ip: ?[]const u8 = null;
         var port: ?u16 = null;
+        var trace_path: ?[]const u8 = null;
+        var host: []const u8 = "";
 
         var arg_index: usize = 2;
 
@@ -88,6 +316,26 @@ pub fn main() !void {
                 }
                 username = args[arg_index + 1];
                 arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--host")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Host flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                host = args[arg_index + 1];
+                if (!protocol.validHostName(host)) {
+                    std.debug.print("Error: Invalid host name '{s}' (1-{d} letters, digits, '-', '_' or '.').\n", .{ host, protocol.MAX_HOST_NAME });
+                    return error.InvalidArguments;
+                }
+                arg_index += 2;
+            } else if (std.mem.eql(u8, args[arg_index], "--trace")) {
+                if (arg_index + 1 >= args.len) {
+                    std.debug.print("Error: Trace flag requires a value.\n", .{});
+                    printHelp(args[0]);
+                    return error.InvalidArguments;
+                }
+                trace_path = args[arg_index + 1];
+                arg_index += 2;
             } else if (ip == null) {
                 ip = args[arg_index];
                 arg_index += 1;
@@ -121,6 +369,7 @@ pub fn main() !void {
             .id = std.crypto.random.int(u32),
             .username = undefined,
             .username_len = 0,
+            .host = host,
         };
 
         if (username) |user| {
@@ -133,10 +382,27 @@ pub fn main() !void {
             client.username_len = user.len;
         }
 
-        try client.startClient();
+        if (trace_path) |path| try trace.init(allocator, path);
+        defer trace.deinit();
+
+        try client.startClient(allocator);
+        instrument.report();
     } else {
-        std.debug.print("Invalid option. Use 'server' or 'client'.\n", .{});
+        std.debug.print("Invalid option '{s}'. Use 'server', 'client', 'logcat', 'bench', 'bench-compare', 'bench-scale', 'bench-render', 'replay', 'netem-proxy' or 'simulate'.\n", .{args[1]});
         printHelp(args[0]);
         return error.InvalidArguments;
     }
 }
+
+test {
+    _ = @import("reader.zig");
+    _ = @import("server/server.zig");
+    _ = @import("server/accounting.zig");
+    _ = @import("server/vhost.zig");
+    _ = @import("server/expiry.zig");
+    _ = @import("server/capture.zig");
+    _ = @import("client/ephemeral.zig");
+    _ = @import("client/outbox.zig");
+    _ = @import("tests/integration.zig");
+    _ = @import("sim/simulator.zig");
+}
@@ -0,0 +1,231 @@
+const std = @import("std");
+
+/// Frames whose first byte is `CONTROL` carry protocol messages instead of
+/// chat text; a chat line never starts with a NUL byte. The second byte
+/// says which message it is and the rest is its body.
+pub const CONTROL: u8 = 0;
+
+pub const Kind = enum(u8) {
+    /// Client to server: join the virtual host named by the body. An empty
+    /// name selects the default host. Body: `Hello`.
+    hello = 'H',
+    /// Server to client: chat frames from the last read were not relayed
+    /// because of the room's ingress limits. Body: `Rejected`.
+    rejected = 'R',
+    /// Client to server: a chat line that disappears after a while.
+    /// Body: TTL in milliseconds (u32), then the text.
+    post_ephemeral = 'E',
+    /// Server to client: an ephemeral chat line. Body: `Ephemeral`.
+    ephemeral = 'T',
+    /// Server to client: ephemeral messages that have expired. Body: their
+    /// ids, a u64 each, as many as fit in a frame.
+    expired = 'X',
+    /// Server to client, for clients that asked for acks: the number of
+    /// chat frames received on this connection so far (u32). One ack
+    /// covers everything up to it, so the server keeps no per-message
+    /// state and sends at most one ack per read. Frames it refused are
+    /// counted too; the `rejected` notice sent before the ack names them.
+    ack = 'A',
+    /// Server to client: the room history replayed on joining is over and
+    /// what follows is live, so a reconnecting client knows which lines
+    /// to check against what it already shows. No body.
+    history_end = 'Z',
+    _,
+};
+
+/// The host name, then optionally a NUL and a flags byte; host names never
+/// contain a NUL.
+pub const Hello = struct {
+    host: []const u8,
+    flags: Flags = .{},
+
+    pub const Flags = packed struct(u8) {
+        /// Send `ack` frames for this connection's chat frames.
+        acks: bool = false,
+        reserved: u7 = 0,
+    };
+
+    pub fn encode(self: Hello, buf: []u8) error{NoSpaceLeft}![]const u8 {
+        if (buf.len < self.host.len + 4) return error.NoSpaceLeft;
+        buf[0] = CONTROL;
+        buf[1] = @intFromEnum(Kind.hello);
+        @memcpy(buf[2..][0..self.host.len], self.host);
+        buf[2 + self.host.len] = 0;
+        buf[3 + self.host.len] = @bitCast(self.flags);
+        return buf[0 .. self.host.len + 4];
+    }
+
+    pub fn decode(payload: []const u8) Hello {
+        const nul = std.mem.indexOfScalar(u8, payload, 0) orelse return .{ .host = payload };
+        const flags: Flags = if (nul + 1 < payload.len) @bitCast(payload[nul + 1]) else .{};
+        return .{ .host = payload[0..nul], .flags = flags };
+    }
+};
+
+pub fn encodeAck(buf: *[6]u8, received: u32) []const u8 {
+    buf[0] = CONTROL;
+    buf[1] = @intFromEnum(Kind.ack);
+    std.mem.writeInt(u32, buf[2..6], received, .little);
+    return buf;
+}
+
+pub fn decodeAck(payload: []const u8) ?u32 {
+    if (payload.len < 4) return null;
+    return std.mem.readInt(u32, payload[0..4], .little);
+}
+
+pub const Reason = enum(u8) {
+    /// The sender posted again within the room's slow-mode interval.
+    slow_mode = 'S',
+    /// The room as a whole is over its message budget.
+    room_budget = 'B',
+    /// The sender, or the room, already has as many ephemeral messages
+    /// waiting to expire as it may.
+    ephemeral_limit = 'L',
+    _,
+};
+
+/// One notice covers every frame refused from a single read, so a flood
+/// is answered with a trickle.
+pub const Rejected = struct {
+    reason: Reason,
+    count: u16,
+    /// How long the sender should wait before the next message can pass.
+    retry_after_ms: u32,
+    /// The refused chat frames, numbered as in `ack`: `seq_count` of them
+    /// from `first_seq` on. Refused ephemeral posts count only in `count`.
+    first_seq: u32 = 0,
+    seq_count: u16 = 0,
+
+    pub const SIZE = 13;
+
+    pub fn encode(self: Rejected, buf: []u8) error{NoSpaceLeft}![]const u8 {
+        var payload: [SIZE]u8 = undefined;
+        payload[0] = @intFromEnum(self.reason);
+        std.mem.writeInt(u16, payload[1..3], self.count, .little);
+        std.mem.writeInt(u32, payload[3..7], self.retry_after_ms, .little);
+        std.mem.writeInt(u32, payload[7..11], self.first_seq, .little);
+        std.mem.writeInt(u16, payload[11..13], self.seq_count, .little);
+        return encodeControl(buf, .rejected, &payload);
+    }
+
+    pub fn decode(payload: []const u8) ?Rejected {
+        if (payload.len < SIZE) return null;
+        return .{
+            .reason = @enumFromInt(payload[0]),
+            .count = std.mem.readInt(u16, payload[1..3], .little),
+            .retry_after_ms = std.mem.readInt(u32, payload[3..7], .little),
+            .first_seq = std.mem.readInt(u32, payload[7..11], .little),
+            .seq_count = std.mem.readInt(u16, payload[11..13], .little),
+        };
+    }
+};
+
+/// Longest an ephemeral message may live.
+pub const MAX_TTL_MS: u32 = 24 * std.time.ms_per_hour;
+
+/// An ephemeral chat line. The server gives each one an id, unique for
+/// the life of the server, that its expiry notice refers to.
+pub const Ephemeral = struct {
+    /// 0 in a post, before the server has assigned one.
+    id: u64,
+    ttl_ms: u32,
+    text: []const u8,
+
+    pub const HEADER = 12;
+    pub const POST_HEADER = 4;
+    /// Offset of the TTL in an encoded frame.
+    pub const TTL_OFFSET = 2 + 8;
+
+    pub fn encodePost(buf: []u8, ttl_ms: u32, text: []const u8) error{NoSpaceLeft}![]const u8 {
+        if (buf.len < POST_HEADER + text.len + 2) return error.NoSpaceLeft;
+        buf[0] = CONTROL;
+        buf[1] = @intFromEnum(Kind.post_ephemeral);
+        std.mem.writeInt(u32, buf[2..6], ttl_ms, .little);
+        @memcpy(buf[2 + POST_HEADER ..][0..text.len], text);
+        return buf[0 .. 2 + POST_HEADER + text.len];
+    }
+
+    pub fn decodePost(payload: []const u8) ?Ephemeral {
+        if (payload.len < POST_HEADER) return null;
+        return .{
+            .id = 0,
+            .ttl_ms = std.mem.readInt(u32, payload[0..4], .little),
+            .text = payload[POST_HEADER..],
+        };
+    }
+
+    pub fn encode(self: Ephemeral, buf: []u8) error{NoSpaceLeft}![]const u8 {
+        if (buf.len < HEADER + self.text.len + 2) return error.NoSpaceLeft;
+        buf[0] = CONTROL;
+        buf[1] = @intFromEnum(Kind.ephemeral);
+        std.mem.writeInt(u64, buf[2..10], self.id, .little);
+        std.mem.writeInt(u32, buf[10..14], self.ttl_ms, .little);
+        @memcpy(buf[2 + HEADER ..][0..self.text.len], self.text);
+        return buf[0 .. 2 + HEADER + self.text.len];
+    }
+
+    pub fn decode(payload: []const u8) ?Ephemeral {
+        if (payload.len < HEADER) return null;
+        return .{
+            .id = std.mem.readInt(u64, payload[0..8], .little),
+            .ttl_ms = std.mem.readInt(u32, payload[8..12], .little),
+            .text = payload[HEADER..],
+        };
+    }
+};
+
+/// Walks the ids in the body of an `expired` notice.
+pub const ExpiredIds = struct {
+    rest: []const u8,
+
+    pub fn init(payload: []const u8) ExpiredIds {
+        return .{ .rest = payload };
+    }
+
+    pub fn next(self: *ExpiredIds) ?u64 {
+        if (self.rest.len < 8) return null;
+        const id = std.mem.readInt(u64, self.rest[0..8], .little);
+        self.rest = self.rest[8..];
+        return id;
+    }
+};
+
+/// Longest virtual host name.
+pub const MAX_HOST_NAME = 32;
+
+pub fn isControl(frame: []const u8) bool {
+    return frame.len > 0 and frame[0] == CONTROL;
+}
+
+/// The kind of a control frame, or null for chat text and truncated frames.
+pub fn kind(frame: []const u8) ?Kind {
+    if (!isControl(frame) or frame.len < 2) return null;
+    return @enumFromInt(frame[1]);
+}
+
+pub fn body(frame: []const u8) []const u8 {
+    return frame[2..];
+}
+
+pub fn encodeControl(buf: []u8, k: Kind, payload: []const u8) error{NoSpaceLeft}![]const u8 {
+    if (buf.len < payload.len + 2) return error.NoSpaceLeft;
+    buf[0] = CONTROL;
+    buf[1] = @intFromEnum(k);
+    @memcpy(buf[2..][0..payload.len], payload);
+    return buf[0 .. payload.len + 2];
+}
+
+pub fn hello(buf: []u8, host: []const u8) error{NoSpaceLeft}![]const u8 {
+    return (Hello{ .host = host }).encode(buf);
+}
+
+/// Host names are short and printable so they can appear in logs and
+/// welcome lines as they are.
+pub fn validHostName(name: []const u8) bool {
+    if (name.len == 0 or name.len > MAX_HOST_NAME) return false;
+    for (name) |c| {
+        if (!std.ascii.isAlphanumeric(c) and c != '-' and c != '_' and c != '.') return false;
+    }
+    return true;
+}
@@ -1,8 +1,11 @@
 const std = @import("std");
+const builtin = @import("builtin");
 const posix = std.posix;
 const Allocator = std.mem.Allocator;
 
 const config = @import("config.zig");
+const instrument = @import("instrument.zig");
+const Io = @import("io.zig").Io;
 const BUFFER_SIZE = config.BUFFER_SIZE;
 
 /// Reader handles buffered reading from sockets with support for non-blocking I/O.
@@ -11,6 +14,14 @@ pub const Reader = struct {
     buf: []u8,
     pos: usize = 0,
     start: usize = 0,
+    /// Largest frame, length prefix included, the reader accepts.
+    limit: usize,
+    /// Ring size when `buf` is a mirrored mapping, whose second half
+    /// aliases the first; 0 for a linear buffer.
+    ring: usize = 0,
+    /// read(2) calls and bytes received, for per-connection accounting.
+    reads: u64 = 0,
+    bytes: u64 = 0,
 
     pub fn init(allocator: Allocator, size: usize) !Reader {
         const buf = try allocator.alloc(u8, size);
@@ -18,14 +29,69 @@ pub const Reader = struct {
             .pos = 0,
             .start = 0,
             .buf = buf,
+            .limit = size,
+        };
+    }
+
+    pub fn initBackend(allocator: Allocator, size: usize, backend: config.ReaderBackend) !Reader {
+        return switch (backend) {
+            .linear => init(allocator, size),
+            .mirrored => initMirrored(size),
+        };
+    }
+
+    /// A ring of `size` bytes rounded up to whole pages, backed by a memfd
+    /// mapped twice in a row. A frame that runs past the end of the ring
+    /// continues in the second mapping, so it is always contiguous and the
+    /// reader never compacts. The pages come from the kernel, not an
+    /// allocator, so a caller keeping a memory budget charges `capacity()`
+    /// itself.
+    pub fn initMirrored(size: usize) !Reader {
+        if (builtin.os.tag != .linux) return error.MirroredReaderUnsupported;
+
+        const ring = std.mem.alignForward(usize, size, std.heap.pageSize());
+        const fd = try posix.memfd_create("zignal-reader", std.os.linux.MFD.CLOEXEC);
+        // The mappings keep the memory alive.
+        defer posix.close(fd);
+        try posix.ftruncate(fd, ring);
+
+        // Reserve both halves first so the two mappings are adjacent.
+        const region = try posix.mmap(null, 2 * ring, posix.PROT.NONE, .{ .TYPE = .PRIVATE, .ANONYMOUS = true }, -1, 0);
+        errdefer posix.munmap(region);
+
+        const prot = posix.PROT.READ | posix.PROT.WRITE;
+        for (0..2) |half| {
+            const at: [*]align(std.heap.page_size_min) u8 = @alignCast(region.ptr + half * ring);
+            _ = try posix.mmap(at, ring, prot, .{ .TYPE = .SHARED, .FIXED = true }, fd, 0);
+        }
+
+        return .{
+            .buf = region,
+            .limit = size,
+            .ring = ring,
         };
     }
 
     pub fn deinit(self: *const Reader, allocator: Allocator) void {
+        if (self.ring != 0) {
+            const region: []align(std.heap.page_size_min) u8 = @alignCast(self.buf);
+            posix.munmap(region);
+            return;
+        }
         allocator.free(self.buf);
     }
 
+    /// Bytes of buffer memory held, counting a mirrored ring once.
+    pub fn capacity(self: *const Reader) usize {
+        return if (self.ring != 0) self.ring else self.buf.len;
+    }
+
     pub fn readMessage(self: *Reader, socket: posix.socket_t) !?[]const u8 {
+        return self.readMessageIo(Io.system, socket);
+    }
+
+    /// Like `readMessage`, reading through `io`.
+    pub fn readMessageIo(self: *Reader, io: Io, socket: posix.socket_t) !?[]const u8 {
         var buf = self.buf;
 
         while (true) {
@@ -34,13 +100,19 @@ pub const Reader = struct {
             }
 
             const pos = self.pos;
-            const n = posix.read(socket, buf[pos..]) catch |err| switch (err) {
+            const end = if (self.ring != 0) self.start + self.ring else buf.len;
+            const n = io.read(socket, buf[pos..end]) catch |err| switch (err) {
                 error.WouldBlock => {
                     return null;
                 },
                 else => return err,
             };
 
+            instrument.count("reader.reads", 1);
+            instrument.count("reader.bytes", n);
+            self.reads += 1;
+            self.bytes += n;
+
             if (n == 0) {
                 return error.Closed;
             }
@@ -49,6 +121,86 @@ pub const Reader = struct {
         }
     }
 
+    /// Frames parsed from one read. The slices point into the reader's
+    /// buffer and stay valid until the next read call.
+    pub const Batch = struct {
+        frames: []const []const u8,
+        /// The same frames as received, length prefixes included, back to
+        /// back in one slice, ready to be forwarded with a single write.
+        wire: []const u8,
+    };
+
+    /// Returns every complete frame already buffered, up to `out.len`; if
+    /// there are none, reads once and returns what that completed. An
+    /// empty batch means the read would block.
+    pub fn readBatch(self: *Reader, socket: posix.socket_t, out: [][]const u8) !Batch {
+        return self.readBatchIo(Io.system, socket, out);
+    }
+
+    /// Like `readBatch`, reading through `io`.
+    pub fn readBatchIo(self: *Reader, io: Io, socket: posix.socket_t, out: [][]const u8) !Batch {
+        const buffered = self.bufferedBatch(out);
+        if (buffered.frames.len > 0) return buffered;
+
+        // Compact, if at all, only here: no slice from an earlier batch
+        // may still be in use once the caller asks for more.
+        try self.ensureFrameSpace();
+
+        const pos = self.pos;
+        const end = if (self.ring != 0) self.start + self.ring else self.buf.len;
+        const n = io.read(socket, self.buf[pos..end]) catch |err| switch (err) {
+            error.WouldBlock => return buffered,
+            else => return err,
+        };
+
+        instrument.count("reader.reads", 1);
+        instrument.count("reader.bytes", n);
+        self.reads += 1;
+        self.bytes += n;
+
+        if (n == 0) {
+            return error.Closed;
+        }
+
+        self.pos = pos + n;
+        return self.bufferedBatch(out);
+    }
+
+    /// Walks the length prefixes of the buffered bytes without moving
+    /// them, so all slices of one batch stay valid together. Never reads;
+    /// an empty batch means at most a partial frame is buffered.
+    pub fn bufferedBatch(self: *Reader, out: [][]const u8) Batch {
+        const first = self.start;
+        var count: usize = 0;
+        while (count < out.len) {
+            const unprocessed = self.buf[self.start..self.pos];
+            if (unprocessed.len < 4) break;
+            const total_len = @as(usize, std.mem.readInt(u32, unprocessed[0..4], .little)) + 4;
+            if (unprocessed.len < total_len) break;
+
+            instrument.observe("reader.frame_size", total_len - 4);
+            out[count] = unprocessed[4..total_len];
+            count += 1;
+            self.start += total_len;
+        }
+
+        const wire = self.buf[first..self.start];
+        if (self.ring != 0 and self.start >= self.ring) {
+            self.start -= self.ring;
+            self.pos -= self.ring;
+        }
+        return .{ .frames = out[0..count], .wire = wire };
+    }
+
+    /// Makes room to read the rest of the partial frame at `start`.
+    fn ensureFrameSpace(self: *Reader) error{BufferTooSmall}!void {
+        const unprocessed = self.buf[self.start..self.pos];
+        if (unprocessed.len < 4) {
+            return self.ensureSpace(4);
+        }
+        return self.ensureSpace(@as(usize, std.mem.readInt(u32, unprocessed[0..4], .little)) + 4);
+    }
+
     pub fn readClientMessage(socket: posix.socket_t, buffer: *[BUFFER_SIZE]u8) !?[]u8 {
         var len_buf: [4]u8 = undefined;
         const len_read = try posix.read(socket, &len_buf);
@@ -91,7 +243,7 @@ pub const Reader = struct {
         const unprocessed = buf[start..pos];
 
         if (unprocessed.len < 4) {
-            try self.ensureSpace(4 - unprocessed.len);
+            try self.ensureSpace(4);
             return null;
         }
 
@@ -103,15 +255,27 @@ pub const Reader = struct {
             return null;
         }
 
+        instrument.observe("reader.frame_size", message_len);
         self.start += total_len;
+        if (self.ring != 0 and self.start >= self.ring) {
+            // Same bytes, seen through the first mapping.
+            self.start -= self.ring;
+            self.pos -= self.ring;
+        }
         return unprocessed[4..total_len];
     }
 
+    /// Makes sure `space` bytes fit from `start` on, compacting if needed.
     fn ensureSpace(self: *Reader, space: usize) error{BufferTooSmall}!void {
-        const buf = self.buf;
-        if (buf.len < space) {
+        if (self.limit < space) {
             return error.BufferTooSmall;
         }
+        // A ring always has `ring - unprocessed` contiguous bytes free.
+        if (self.ring != 0) {
+            return;
+        }
+
+        const buf = self.buf;
 
         const start = self.start;
         const spare = buf.len - start;
@@ -120,8 +284,114 @@ pub const Reader = struct {
         }
 
         const unprocessed = buf[start..self.pos];
+        instrument.observe("reader.compact_bytes", unprocessed.len);
         std.mem.copyForwards(u8, buf[0..unprocessed.len], unprocessed);
         self.start = 0;
         self.pos = unprocessed.len;
     }
 };
+
+test "mirrored reader returns frames that straddle the end of the ring intact" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+    const linux = std.os.linux;
+
+    var reader = try Reader.initMirrored(std.heap.pageSize());
+    defer reader.deinit(testing.allocator);
+
+    var fds: [2]i32 = undefined;
+    const rc = linux.socketpair(linux.AF.UNIX, linux.SOCK.STREAM | linux.SOCK.NONBLOCK | linux.SOCK.CLOEXEC, 0, &fds);
+    if (linux.E.init(rc) != .SUCCESS) return error.SocketPairFailed;
+    defer posix.close(fds[0]);
+    defer posix.close(fds[1]);
+
+    // 333 does not divide the ring size, so frames keep landing across
+    // the wrap point at different offsets.
+    var payload: [333]u8 = undefined;
+    for (0..200) |n| {
+        for (&payload, 0..) |*byte, i| byte.* = @truncate(n + i);
+        var len_buf: [4]u8 = undefined;
+        std.mem.writeInt(u32, &len_buf, payload.len, .little);
+        _ = try posix.write(fds[1], &len_buf);
+        _ = try posix.write(fds[1], &payload);
+
+        const msg = (try reader.readMessage(fds[0])).?;
+        try testing.expectEqualSlices(u8, &payload, msg);
+        try testing.expect(reader.start < reader.ring);
+    }
+    try testing.expectEqual(@as(?[]const u8, null), try reader.readMessage(fds[0]));
+}
+
+test "readBatch returns every complete frame from one read" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+    const linux = std.os.linux;
+
+    var reader = try Reader.init(testing.allocator, 64);
+    defer reader.deinit(testing.allocator);
+
+    var fds: [2]i32 = undefined;
+    const rc = linux.socketpair(linux.AF.UNIX, linux.SOCK.STREAM | linux.SOCK.NONBLOCK | linux.SOCK.CLOEXEC, 0, &fds);
+    if (linux.E.init(rc) != .SUCCESS) return error.SocketPairFailed;
+    defer posix.close(fds[0]);
+    defer posix.close(fds[1]);
+
+    // Three whole frames and the first half of a fourth.
+    const wire = "\x02\x00\x00\x00hi" ++ "\x03\x00\x00\x00abc" ++ "\x00\x00\x00\x00" ++ "\x05\x00\x00\x00fo";
+    _ = try posix.write(fds[1], wire);
+
+    var out: [8][]const u8 = undefined;
+    const batch = try reader.readBatch(fds[0], &out);
+    try testing.expectEqual(@as(usize, 3), batch.frames.len);
+    try testing.expectEqualStrings("hi", batch.frames[0]);
+    try testing.expectEqualStrings("abc", batch.frames[1]);
+    try testing.expectEqualStrings("", batch.frames[2]);
+    try testing.expectEqualStrings(wire[0..17], batch.wire);
+
+    try testing.expectEqual(@as(usize, 0), (try reader.readBatch(fds[0], &out)).frames.len);
+
+    _ = try posix.write(fds[1], "urt");
+    const rest = try reader.readBatch(fds[0], &out);
+    try testing.expectEqual(@as(usize, 1), rest.frames.len);
+    try testing.expectEqualStrings("fourt", rest.frames[0]);
+}
+
+test "a length prefix split at the end of the buffer is compacted, not read into no space" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+    const linux = std.os.linux;
+
+    var fds: [2]i32 = undefined;
+    const rc = linux.socketpair(linux.AF.UNIX, linux.SOCK.STREAM | linux.SOCK.NONBLOCK | linux.SOCK.CLOEXEC, 0, &fds);
+    if (linux.E.init(rc) != .SUCCESS) return error.SocketPairFailed;
+    defer posix.close(fds[0]);
+    defer posix.close(fds[1]);
+
+    // One frame fills all but two bytes of the buffer, and the next
+    // frame's length prefix is cut after those two.
+    var batch_reader = try Reader.init(testing.allocator, 16);
+    defer batch_reader.deinit(testing.allocator);
+    _ = try posix.write(fds[1], "\x0a\x00\x00\x000123456789" ++ "\x03\x00");
+
+    var out: [4][]const u8 = undefined;
+    const first = try batch_reader.readBatch(fds[0], &out);
+    try testing.expectEqual(@as(usize, 1), first.frames.len);
+    try testing.expectEqual(@as(usize, 0), (try batch_reader.readBatch(fds[0], &out)).frames.len);
+
+    _ = try posix.write(fds[1], "\x00\x00hey");
+    const rest = try batch_reader.readBatch(fds[0], &out);
+    try testing.expectEqual(@as(usize, 1), rest.frames.len);
+    try testing.expectEqualStrings("hey", rest.frames[0]);
+
+    // readMessage takes the same path.
+    var message_reader = try Reader.init(testing.allocator, 16);
+    defer message_reader.deinit(testing.allocator);
+    _ = try posix.write(fds[1], "\x0a\x00\x00\x000123456789" ++ "\x03\x00");
+    try testing.expectEqualStrings("0123456789", (try message_reader.readMessage(fds[0])).?);
+    try testing.expectEqual(@as(?[]const u8, null), try message_reader.readMessage(fds[0]));
+    _ = try posix.write(fds[1], "\x00\x00hey");
+    try testing.expectEqualStrings("hey", (try message_reader.readMessage(fds[0])).?);
+}
@@ -0,0 +1,251 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// Cost figures for one connection, IP or user. Counting is plain integer
+/// adds on the network thread; rollups happen on disconnect and once per
+/// report window.
+pub const ConnStats = struct {
+    /// read(2) calls on the connection's socket.
+    read_calls: u64 = 0,
+    /// writev(2) calls made to fan out this connection's frames.
+    write_calls: u64 = 0,
+    bytes_in: u64 = 0,
+    bytes_out: u64 = 0,
+    frames: u64 = 0,
+    /// Frames refused by the room's slow mode or message budget.
+    rejected: u64 = 0,
+    /// Time spent reading and parsing this connection's frames.
+    read_ns: u64 = 0,
+    /// Time spent broadcasting this connection's frames to everyone else.
+    broadcast_ns: u64 = 0,
+    connects: u64 = 0,
+
+    pub fn costNs(self: ConnStats) u64 {
+        return self.read_ns + self.broadcast_ns;
+    }
+
+    pub fn syscalls(self: ConnStats) u64 {
+        return self.read_calls + self.write_calls;
+    }
+
+    pub fn idle(self: ConnStats) bool {
+        return std.meta.eql(self, ConnStats{});
+    }
+
+    pub fn add(self: *ConnStats, other: ConnStats) void {
+        inline for (std.meta.fields(ConnStats)) |field| {
+            @field(self, field.name) += @field(other, field.name);
+        }
+    }
+
+    pub fn delta(self: ConnStats, since: ConnStats) ConnStats {
+        var result: ConnStats = .{};
+        inline for (std.meta.fields(ConnStats)) |field| {
+            @field(result, field.name) = @field(self, field.name) - @field(since, field.name);
+        }
+        return result;
+    }
+};
+
+pub const TOP_N = 5;
+
+pub const Offender = struct {
+    label: [32]u8 = undefined,
+    label_len: usize = 0,
+    stats: ConnStats = .{},
+
+    pub fn getLabel(self: *const Offender) []const u8 {
+        return self.label[0..self.label_len];
+    }
+};
+
+/// Most expensive IPs and users by read + broadcast time, as published to
+/// the TUI. Guarded by a mutex because it is copied as a whole.
+pub const TopOffenders = struct {
+    mutex: std.Thread.Mutex = .{},
+    ips: [TOP_N]Offender = @splat(.{}),
+    ip_count: usize = 0,
+    users: [TOP_N]Offender = @splat(.{}),
+    user_count: usize = 0,
+};
+
+/// Most IPs, and separately users, tracked in one report window.
+pub const MAX_TRACKED = 1024;
+
+/// Totals per IP and per user for the current report window, fed with
+/// per-connection deltas. After each report the totals start over and keys
+/// idle for the whole window are evicted, so steady traffic costs no
+/// allocations. Each map holds at most MAX_TRACKED keys, so a flood of
+/// distinct addresses or names cannot grow them; later keys go uncounted
+/// until the next window.
+pub const Accounting = struct {
+    allocator: Allocator,
+    by_ip: std.AutoHashMapUnmanaged(u32, ConnStats),
+    by_user: std.StringHashMapUnmanaged(ConnStats),
+    /// Deltas dropped this window because a map was full.
+    untracked: u64,
+
+    pub fn init(allocator: Allocator) Accounting {
+        return .{
+            .allocator = allocator,
+            .by_ip = .{},
+            .by_user = .{},
+            .untracked = 0,
+        };
+    }
+
+    pub fn deinit(self: *Accounting) void {
+        var it = self.by_user.keyIterator();
+        while (it.next()) |key| {
+            self.allocator.free(key.*);
+        }
+        self.by_user.deinit(self.allocator);
+        self.by_ip.deinit(self.allocator);
+    }
+
+    /// Starts the next window. The maps keep their capacity.
+    pub fn reset(self: *Accounting) void {
+        var ip_it = self.by_ip.iterator();
+        while (ip_it.next()) |entry| {
+            if (entry.value_ptr.idle()) {
+                self.by_ip.removeByPtr(entry.key_ptr);
+            } else {
+                entry.value_ptr.* = .{};
+            }
+        }
+        var user_it = self.by_user.iterator();
+        while (user_it.next()) |entry| {
+            if (entry.value_ptr.idle()) {
+                const key = entry.key_ptr.*;
+                self.by_user.removeByPtr(entry.key_ptr);
+                self.allocator.free(key);
+            } else {
+                entry.value_ptr.* = .{};
+            }
+        }
+        self.untracked = 0;
+    }
+
+    /// Adds `delta` to the totals of `ip` and, when known, `user`.
+    pub fn fold(self: *Accounting, ip: u32, user: []const u8, delta: ConnStats) !void {
+        if (delta.idle()) return;
+
+        if (self.by_ip.getPtr(ip)) |stats| {
+            stats.add(delta);
+        } else if (self.by_ip.count() < MAX_TRACKED) {
+            try self.by_ip.putNoClobber(self.allocator, ip, delta);
+        } else {
+            self.untracked += 1;
+        }
+
+        if (user.len == 0) return;
+
+        if (self.by_user.getPtr(user)) |stats| {
+            stats.add(delta);
+            return;
+        }
+        if (self.by_user.count() >= MAX_TRACKED) {
+            self.untracked += 1;
+            return;
+        }
+        const user_entry = try self.by_user.getOrPut(self.allocator, user);
+        if (!user_entry.found_existing) {
+            user_entry.key_ptr.* = self.allocator.dupe(u8, user) catch |err| {
+                self.by_user.removeByPtr(user_entry.key_ptr);
+                return err;
+            };
+            user_entry.value_ptr.* = .{};
+        }
+        user_entry.value_ptr.add(delta);
+    }
+
+    pub fn publish(self: *const Accounting, top: *TopOffenders) void {
+        var ips: [TOP_N]Offender = undefined;
+        var ip_count: usize = 0;
+        var ip_it = self.by_ip.iterator();
+        while (ip_it.next()) |entry| {
+            if (entry.value_ptr.idle()) continue;
+            const bytes: [4]u8 = @bitCast(entry.key_ptr.*);
+            var offender: Offender = .{ .stats = entry.value_ptr.* };
+            const label = std.fmt.bufPrint(&offender.label, "{d}.{d}.{d}.{d}", .{ bytes[0], bytes[1], bytes[2], bytes[3] }) catch continue;
+            offender.label_len = label.len;
+            insertTop(&ips, &ip_count, offender);
+        }
+
+        var users: [TOP_N]Offender = undefined;
+        var user_count: usize = 0;
+        var user_it = self.by_user.iterator();
+        while (user_it.next()) |entry| {
+            if (entry.value_ptr.idle()) continue;
+            var offender: Offender = .{ .stats = entry.value_ptr.* };
+            const len = @min(entry.key_ptr.len, offender.label.len);
+            @memcpy(offender.label[0..len], entry.key_ptr.*[0..len]);
+            offender.label_len = len;
+            insertTop(&users, &user_count, offender);
+        }
+
+        top.mutex.lock();
+        defer top.mutex.unlock();
+        top.ips = ips;
+        top.ip_count = ip_count;
+        top.users = users;
+        top.user_count = user_count;
+    }
+};
+
+/// Keeps `top[0..count.*]` sorted by descending cost.
+fn insertTop(top: *[TOP_N]Offender, count: *usize, offender: Offender) void {
+    const cost = offender.stats.costNs();
+    var pos = count.*;
+    while (pos > 0 and top[pos - 1].stats.costNs() < cost) : (pos -= 1) {}
+    if (pos >= TOP_N) return;
+
+    var i = @min(count.*, TOP_N - 1);
+    while (i > pos) : (i -= 1) {
+        top[i] = top[i - 1];
+    }
+    top[pos] = offender;
+    count.* = @min(count.* + 1, TOP_N);
+}
+
+/// Extracts the sender name from a "name: message" chat frame.
+pub fn parseUsername(message: []const u8, max_len: usize) ?[]const u8 {
+    const colon = std.mem.indexOf(u8, message, ": ") orelse return null;
+    if (colon == 0 or colon > max_len) return null;
+    return message[0..colon];
+}
+
+test "accounting tracks a bounded set of keys and evicts idle ones each window" {
+    const testing = std.testing;
+
+    var acct = Accounting.init(testing.allocator);
+    defer acct.deinit();
+
+    const cost: ConnStats = .{ .read_ns = 10 };
+    for (0..MAX_TRACKED + 8) |i| {
+        try acct.fold(@intCast(i), "", cost);
+    }
+    try acct.fold(0, "ann", cost);
+    try testing.expectEqual(@as(usize, MAX_TRACKED), acct.by_ip.count());
+    try testing.expectEqual(@as(u64, 8), acct.untracked);
+    try testing.expectEqual(@as(u64, 20), acct.by_ip.get(0).?.read_ns);
+
+    var top: TopOffenders = .{};
+    acct.publish(&top);
+    try testing.expectEqual(@as(usize, TOP_N), top.ip_count);
+    try testing.expectEqualStrings("ann", top.users[0].getLabel());
+
+    // Keys active in the window stay, with fresh totals.
+    acct.reset();
+    try testing.expectEqual(@as(usize, MAX_TRACKED), acct.by_ip.count());
+    try testing.expectEqual(@as(u64, 0), acct.by_ip.get(0).?.read_ns);
+    try acct.fold(0, "ann", cost);
+
+    // Idle ones go, which makes room for new keys.
+    acct.reset();
+    try testing.expectEqual(@as(usize, 1), acct.by_ip.count());
+    try testing.expectEqual(@as(usize, 1), acct.by_user.count());
+    try acct.fold(MAX_TRACKED + 8, "bob", cost);
+    try testing.expectEqual(@as(usize, 2), acct.by_ip.count());
+    try testing.expectEqual(@as(u64, 0), acct.untracked);
+}
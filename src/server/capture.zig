@@ -0,0 +1,218 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// File header, followed by a stream of records.
+pub const MAGIC = "ZGNCAP01";
+
+/// Record tags in the capture format. Every record starts with the tag, the
+/// time since the previous record in nanoseconds and the connection id,
+/// both as unsigned LEB128 varints:
+///   connect:    'C' dt id
+///   frame:      'F' dt id len payload
+///   disconnect: 'D' dt id
+/// Timestamps are monotonic and relative to the start of the capture, so a
+/// chat frame of a few dozen bytes costs only a few bytes of overhead.
+pub const Tag = enum(u8) {
+    connect = 'C',
+    frame = 'F',
+    disconnect = 'D',
+};
+
+pub const Record = struct {
+    tag: Tag,
+    /// Nanoseconds since the start of the capture.
+    timestamp_ns: u64,
+    conn_id: u32,
+    /// Frame payload, empty for connect and disconnect.
+    payload: []const u8,
+};
+
+/// Records connection events and every inbound frame, exactly as parsed by
+/// the server, to a compact binary file. Writes go through a large buffer
+/// on the network thread, so the loop only pays a syscall per buffer.
+pub const Capture = struct {
+    allocator: Allocator,
+    file: std.fs.File,
+    file_writer: std.fs.File.Writer,
+    write_buf: []u8,
+    timer: std.time.Timer,
+    last_ns: u64,
+    records: u64,
+
+    pub const BUFFER_SIZE = 256 * 1024;
+
+    pub fn init(allocator: Allocator, path: []const u8) !*Capture {
+        const self = try allocator.create(Capture);
+        errdefer allocator.destroy(self);
+
+        const write_buf = try allocator.alloc(u8, BUFFER_SIZE);
+        errdefer allocator.free(write_buf);
+
+        const file = try std.fs.cwd().createFile(path, .{});
+        errdefer file.close();
+
+        self.* = .{
+            .allocator = allocator,
+            .file = file,
+            .file_writer = file.writer(write_buf),
+            .write_buf = write_buf,
+            .timer = try std.time.Timer.start(),
+            .last_ns = 0,
+            .records = 0,
+        };
+        try self.file_writer.interface.writeAll(MAGIC);
+        return self;
+    }
+
+    pub fn deinit(self: *Capture) void {
+        self.file_writer.interface.flush() catch {};
+        self.file.close();
+        self.allocator.free(self.write_buf);
+        self.allocator.destroy(self);
+    }
+
+    pub fn connect(self: *Capture, conn_id: u32) !void {
+        try self.header(.connect, conn_id);
+    }
+
+    pub fn frame(self: *Capture, conn_id: u32, payload: []const u8) !void {
+        try self.header(.frame, conn_id);
+        const w = &self.file_writer.interface;
+        try writeVarint(w, payload.len);
+        try w.writeAll(payload);
+    }
+
+    pub fn disconnect(self: *Capture, conn_id: u32) !void {
+        try self.header(.disconnect, conn_id);
+    }
+
+    fn header(self: *Capture, tag: Tag, conn_id: u32) !void {
+        const now = self.timer.read();
+        const w = &self.file_writer.interface;
+        try w.writeByte(@intFromEnum(tag));
+        try writeVarint(w, now - self.last_ns);
+        try writeVarint(w, conn_id);
+        self.last_ns = now;
+        self.records += 1;
+    }
+};
+
+fn writeVarint(w: *std.Io.Writer, value: u64) !void {
+    var v = value;
+    while (v >= 0x80) : (v >>= 7) {
+        try w.writeByte(@as(u8, @truncate(v)) | 0x80);
+    }
+    try w.writeByte(@intCast(v));
+}
+
+/// Iterates over the records of a capture file held in memory. Payloads
+/// point into `data`.
+pub const Decoder = struct {
+    data: []const u8,
+    pos: usize,
+    now_ns: u64,
+
+    pub fn init(data: []const u8) !Decoder {
+        if (data.len < MAGIC.len or !std.mem.eql(u8, data[0..MAGIC.len], MAGIC)) {
+            return error.BadMagic;
+        }
+        return .{ .data = data, .pos = MAGIC.len, .now_ns = 0 };
+    }
+
+    pub fn next(self: *Decoder) !?Record {
+        if (self.pos >= self.data.len) return null;
+
+        const tag = std.meta.intToEnum(Tag, self.data[self.pos]) catch return error.BadTag;
+        self.pos += 1;
+        // A corrupt delta must not wrap the clock around.
+        self.now_ns = std.math.add(u64, self.now_ns, try self.varint()) catch return error.BadTimestamp;
+        const conn_id = std.math.cast(u32, try self.varint()) orelse return error.BadConnectionId;
+
+        var payload: []const u8 = &.{};
+        if (tag == .frame) {
+            const len = try self.varint();
+            if (len > self.data.len - self.pos) return error.Truncated;
+            payload = self.data[self.pos..][0..@intCast(len)];
+            self.pos += @intCast(len);
+        }
+
+        return .{ .tag = tag, .timestamp_ns = self.now_ns, .conn_id = conn_id, .payload = payload };
+    }
+
+    fn varint(self: *Decoder) !u64 {
+        var value: u64 = 0;
+        var shift: u7 = 0;
+        while (self.pos < self.data.len) {
+            const byte = self.data[self.pos];
+            self.pos += 1;
+            // Bits past the 64th would be lost.
+            if (shift >= 64 or (shift == 63 and byte & 0x7f > 1)) return error.BadVarint;
+            value |= @as(u64, byte & 0x7f) << @intCast(shift);
+            if (byte & 0x80 == 0) return value;
+            shift += 7;
+        }
+        return error.Truncated;
+    }
+};
+
+test "records read back as written, and a truncated file is an error" {
+    const testing = std.testing;
+
+    var tmp = testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const path = try std.fmt.allocPrint(testing.allocator, ".zig-cache/tmp/{s}/capture.bin", .{tmp.sub_path});
+    defer testing.allocator.free(path);
+
+    // Ids and a length past 127 take more than one varint byte.
+    const payload = "x" ** 200;
+    const capture = try Capture.init(testing.allocator, path);
+    try capture.connect(300);
+    try capture.frame(300, payload);
+    try capture.frame(70_000, "hi");
+    try capture.disconnect(300);
+    capture.deinit();
+
+    const data = try tmp.dir.readFileAlloc(testing.allocator, "capture.bin", 1 << 20);
+    defer testing.allocator.free(data);
+
+    var decoder = try Decoder.init(data);
+    const expected = [_]struct { Tag, u32, []const u8 }{
+        .{ .connect, 300, "" },
+        .{ .frame, 300, payload },
+        .{ .frame, 70_000, "hi" },
+        .{ .disconnect, 300, "" },
+    };
+    var last_ns: u64 = 0;
+    for (expected) |want| {
+        const record = (try decoder.next()).?;
+        try testing.expectEqual(want[0], record.tag);
+        try testing.expectEqual(want[1], record.conn_id);
+        try testing.expectEqualStrings(want[2], record.payload);
+        try testing.expect(record.timestamp_ns >= last_ns);
+        last_ns = record.timestamp_ns;
+    }
+    try testing.expectEqual(@as(?Record, null), try decoder.next());
+
+    // Cut halfway through the long payload.
+    const at = std.mem.indexOf(u8, data, payload).? + payload.len / 2;
+    var cut = try Decoder.init(data[0..at]);
+    _ = (try cut.next()).?;
+    try testing.expectError(error.Truncated, cut.next());
+}
+
+test "a time delta that would wrap the clock is rejected" {
+    const testing = std.testing;
+
+    var buf: [64]u8 = undefined;
+    var w: std.Io.Writer = .fixed(&buf);
+    try w.writeAll(MAGIC);
+    for ([_]u64{ std.math.maxInt(u64), 1 }) |dt| {
+        try w.writeByte(@intFromEnum(Tag.connect));
+        try writeVarint(&w, dt);
+        try writeVarint(&w, 1);
+    }
+
+    var decoder = try Decoder.init(w.buffered());
+    _ = (try decoder.next()).?;
+    try testing.expectError(error.BadTimestamp, decoder.next());
+}
@@ -0,0 +1,163 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// Deadlines of the ephemeral messages still held in some room's history,
+/// in a min-heap so a purge pops exactly the messages that are due and
+/// never looks at the rest of any room's history. Each message's heap
+/// position is tracked so one evicted from history early can be removed.
+pub const ExpiryIndex = struct {
+    pub const Entry = struct {
+        deadline_ms: i64,
+        id: u64,
+        /// Room the message was sent to.
+        host: u32,
+        /// Its history slot.
+        slot: u32,
+        /// Id of the connection that sent it.
+        owner: u32,
+    };
+
+    allocator: Allocator,
+    heap: std.ArrayList(Entry),
+    /// Heap position of each message, by id.
+    positions: std.AutoHashMapUnmanaged(u64, u32),
+    /// Messages held per sending connection.
+    owners: std.AutoHashMapUnmanaged(u32, u32),
+
+    pub fn init(allocator: Allocator) ExpiryIndex {
+        return .{
+            .allocator = allocator,
+            .heap = .empty,
+            .positions = .empty,
+            .owners = .empty,
+        };
+    }
+
+    pub fn deinit(self: *ExpiryIndex) void {
+        self.heap.deinit(self.allocator);
+        self.positions.deinit(self.allocator);
+        self.owners.deinit(self.allocator);
+    }
+
+    pub fn add(self: *ExpiryIndex, entry: Entry) !void {
+        try self.heap.ensureUnusedCapacity(self.allocator, 1);
+        try self.positions.ensureUnusedCapacity(self.allocator, 1);
+        const owned = try self.owners.getOrPut(self.allocator, entry.owner);
+        if (!owned.found_existing) owned.value_ptr.* = 0;
+        owned.value_ptr.* += 1;
+
+        const pos = self.heap.items.len;
+        self.heap.appendAssumeCapacity(entry);
+        self.positions.putAssumeCapacityNoClobber(entry.id, @intCast(pos));
+        self.siftUp(pos);
+    }
+
+    /// Removes message `id`, if it is indexed.
+    pub fn remove(self: *ExpiryIndex, id: u64) ?Entry {
+        const pos = self.positions.get(id) orelse return null;
+        return self.removeAt(pos);
+    }
+
+    pub fn nextDeadline(self: *const ExpiryIndex) ?i64 {
+        if (self.heap.items.len == 0) return null;
+        return self.heap.items[0].deadline_ms;
+    }
+
+    /// Pops up to `out.len` entries due at `now_ms`, earliest first.
+    pub fn popDue(self: *ExpiryIndex, now_ms: i64, out: []Entry) []Entry {
+        var n: usize = 0;
+        while (n < out.len) : (n += 1) {
+            const deadline = self.nextDeadline() orelse break;
+            if (deadline > now_ms) break;
+            out[n] = self.removeAt(0);
+        }
+        return out[0..n];
+    }
+
+    pub fn count(self: *const ExpiryIndex) usize {
+        return self.heap.items.len;
+    }
+
+    /// Messages from connection `owner` still indexed.
+    pub fn ownedBy(self: *const ExpiryIndex, owner: u32) u32 {
+        return self.owners.get(owner) orelse 0;
+    }
+
+    fn removeAt(self: *ExpiryIndex, pos: usize) Entry {
+        const removed = self.heap.items[pos];
+        _ = self.positions.remove(removed.id);
+        const owned = self.owners.getPtr(removed.owner).?;
+        owned.* -= 1;
+        if (owned.* == 0) _ = self.owners.remove(removed.owner);
+
+        const last = self.heap.pop().?;
+        if (pos < self.heap.items.len) {
+            self.place(pos, last);
+            self.siftDown(pos);
+            self.siftUp(pos);
+        }
+        return removed;
+    }
+
+    fn place(self: *ExpiryIndex, pos: usize, entry: Entry) void {
+        self.heap.items[pos] = entry;
+        self.positions.getPtr(entry.id).?.* = @intCast(pos);
+    }
+
+    fn siftUp(self: *ExpiryIndex, start: usize) void {
+        const items = self.heap.items;
+        const entry = items[start];
+        var pos = start;
+        while (pos > 0) {
+            const parent = (pos - 1) / 2;
+            if (items[parent].deadline_ms <= entry.deadline_ms) break;
+            self.place(pos, items[parent]);
+            pos = parent;
+        }
+        self.place(pos, entry);
+    }
+
+    fn siftDown(self: *ExpiryIndex, start: usize) void {
+        const items = self.heap.items;
+        const entry = items[start];
+        var pos = start;
+        while (true) {
+            const left = 2 * pos + 1;
+            if (left >= items.len) break;
+            const right = left + 1;
+            const child = if (right < items.len and items[right].deadline_ms < items[left].deadline_ms) right else left;
+            if (entry.deadline_ms <= items[child].deadline_ms) break;
+            self.place(pos, items[child]);
+            pos = child;
+        }
+        self.place(pos, entry);
+    }
+};
+
+test "popDue returns only what is due, in deadline order" {
+    const testing = std.testing;
+
+    var index = ExpiryIndex.init(testing.allocator);
+    defer index.deinit();
+
+    for ([_]i64{ 500, 100, 300, 200, 400 }, 0..) |deadline, id| {
+        try index.add(.{ .deadline_ms = deadline, .id = id, .host = 0, .slot = @intCast(id), .owner = @intCast(id % 2) });
+    }
+    try testing.expectEqual(@as(u32, 3), index.ownedBy(0));
+
+    // Evicted from history before it was due.
+    try testing.expectEqual(@as(i64, 300), index.remove(2).?.deadline_ms);
+    try testing.expectEqual(@as(?ExpiryIndex.Entry, null), index.remove(2));
+    try testing.expectEqual(@as(u32, 2), index.ownedBy(0));
+
+    var out: [2]ExpiryIndex.Entry = undefined;
+    const first = index.popDue(350, &out);
+    try testing.expectEqual(@as(usize, 2), first.len);
+    try testing.expectEqual(@as(i64, 100), first[0].deadline_ms);
+    try testing.expectEqual(@as(i64, 200), first[1].deadline_ms);
+
+    try testing.expectEqual(@as(usize, 0), index.popDue(350, &out).len);
+    try testing.expectEqual(@as(?i64, 400), index.nextDeadline());
+    try testing.expectEqual(@as(usize, 2), index.count());
+    try testing.expectEqual(@as(u32, 0), index.ownedBy(1));
+}
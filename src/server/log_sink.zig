@@ -0,0 +1,473 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const flight_recorder = @import("../flight_recorder.zig");
+const logging = @import("logging.zig");
+const Level = logging.Level;
+
+/// File header, followed by a stream of site and log records.
+pub const MAGIC = "ZGNLOG01";
+
+/// Record tags in the binary log format (all integers little-endian):
+///   site: 'S' id:u32 level:u8 fmt_len:u16 fmt
+///   log:  'L' id:u32 timestamp_ns:i64 args_len:u16 args
+/// Arguments are a sequence of tagged values:
+///   'u' u64, 'i' i64, 'f' f64 bits, 'b' u8, 's' len:u16 bytes
+pub const Tag = struct {
+    pub const site = 'S';
+    pub const log = 'L';
+
+    pub const uint = 'u';
+    pub const int = 'i';
+    pub const float = 'f';
+    pub const boolean = 'b';
+    pub const string = 's';
+};
+
+/// A log call site. One static instance exists per (format, level) pair, so
+/// the producer only hands over a pointer and the writer thread emits the
+/// format string once per file.
+pub const Site = struct {
+    id: u32,
+    level: Level,
+    fmt: []const u8,
+    written_generation: u32 = 0,
+};
+
+const slow_flush_ns = 10 * std.time.ns_per_ms;
+/// Wait after a failed rotation before trying again.
+const rotate_retry_s = 10;
+
+const Slot = struct {
+    site: *Site,
+    timestamp: i64,
+    args_len: u16,
+    args: [232]u8,
+};
+
+/// Receives each log line as text on the sink's thread.
+pub const Listener = struct {
+    ctx: *anyopaque,
+    onLine: *const fn (ctx: *anyopaque, level: Level, line: []const u8) void,
+};
+
+/// Asynchronous file sink for server logs.
+/// The network thread encodes the raw arguments into a slot of a
+/// single-producer ring; a background thread turns slots into binary
+/// records, buffers them and rotates the file by size and age. The same
+/// thread formats lines for an attached listener such as the TUI, so the
+/// network thread never formats. With no path, only the listener is fed.
+pub const FileSink = struct {
+    pub const Options = struct {
+        path: ?[]const u8,
+        slot_count: usize = config.LOG_SLOTS,
+        buffer_size: usize = config.LOG_BUFFER_SIZE,
+        max_bytes: u64 = 64 * 1024 * 1024,
+        max_age_s: i64 = 60 * 60,
+        keep: u8 = 5,
+    };
+
+    allocator: Allocator,
+    options: Options,
+    path_buf: [std.fs.max_path_bytes]u8,
+    path_len: usize,
+
+    slots: []Slot,
+    head: std.atomic.Value(usize),
+    tail: std.atomic.Value(usize),
+    dropped: std.atomic.Value(u64),
+    running: std.atomic.Value(bool),
+    thread: ?std.Thread,
+    /// Held by the sink thread while it feeds the listener, so `detach`
+    /// returns only once the listener is no longer called.
+    listener_mutex: std.Thread.Mutex,
+    listener: ?Listener,
+
+    /// Null when the sink has no path.
+    file: ?std.fs.File,
+    file_writer: std.fs.File.Writer,
+    write_buf: []u8,
+    file_bytes: u64,
+    file_opened_s: i64,
+    /// No rotation is tried before this, after one failed.
+    rotate_after_s: i64,
+    /// The files of a failed rotation were already shifted; only the new
+    /// file remains to be opened.
+    shifted: bool,
+    generation: u32,
+    /// Failed writes, flushes and rotations. Read by the TUI, like `dropped`.
+    write_errors: std.atomic.Value(u64),
+
+    pub fn init(allocator: Allocator, options: Options) !*FileSink {
+        std.debug.assert(std.math.isPowerOfTwo(options.slot_count));
+        const file_path = options.path orelse "";
+        if (file_path.len > std.fs.max_path_bytes - 4) {
+            return error.NameTooLong;
+        }
+
+        const self = try allocator.create(FileSink);
+        errdefer allocator.destroy(self);
+
+        const slots = try allocator.alloc(Slot, options.slot_count);
+        errdefer allocator.free(slots);
+
+        const write_buf = try allocator.alloc(u8, if (options.path != null) options.buffer_size else 0);
+        errdefer allocator.free(write_buf);
+
+        self.* = .{
+            .allocator = allocator,
+            .options = options,
+            .path_buf = undefined,
+            .path_len = file_path.len,
+            .slots = slots,
+            .head = .init(0),
+            .tail = .init(0),
+            .dropped = .init(0),
+            .running = .init(true),
+            .thread = null,
+            .listener_mutex = .{},
+            .listener = null,
+            .file = null,
+            .file_writer = undefined,
+            .write_buf = write_buf,
+            .file_bytes = 0,
+            .file_opened_s = 0,
+            .rotate_after_s = 0,
+            .shifted = false,
+            .generation = 0,
+            .write_errors = .init(0),
+        };
+        @memcpy(self.path_buf[0..file_path.len], file_path);
+
+        if (options.path != null) {
+            try self.openFile();
+        }
+        errdefer if (self.file) |file| file.close();
+
+        self.thread = try std.Thread.spawn(.{}, run, .{self});
+
+        return self;
+    }
+
+    pub fn deinit(self: *FileSink) void {
+        self.running.store(false, .release);
+        if (self.thread) |thread| {
+            thread.join();
+        }
+
+        if (self.file) |file| file.close();
+        self.allocator.free(self.write_buf);
+        self.allocator.free(self.slots);
+        self.allocator.destroy(self);
+    }
+
+    fn path(self: *const FileSink) []const u8 {
+        return self.path_buf[0..self.path_len];
+    }
+
+    /// Starts feeding formatted lines to `listener`.
+    pub fn attach(self: *FileSink, listener: Listener) void {
+        self.listener_mutex.lock();
+        defer self.listener_mutex.unlock();
+        self.listener = listener;
+    }
+
+    /// Stops feeding the listener; it is not called once this returns.
+    pub fn detach(self: *FileSink) void {
+        self.listener_mutex.lock();
+        defer self.listener_mutex.unlock();
+        self.listener = null;
+    }
+
+    /// Queues one log line. Called only from the network thread; never
+    /// formats, allocates or blocks. When the ring is full the line is
+    /// counted as dropped.
+    pub fn push(self: *FileSink, comptime level: Level, comptime fmt: []const u8, args: anytype) void {
+        const site = struct {
+            var info: Site = .{
+                .id = std.hash.Fnv1a_32.hash(fmt ++ @tagName(level)),
+                .level = level,
+                .fmt = fmt,
+            };
+        };
+
+        const head = self.head.load(.monotonic);
+        const tail = self.tail.load(.acquire);
+        if (head - tail >= self.slots.len) {
+            _ = self.dropped.fetchAdd(1, .monotonic);
+            return;
+        }
+
+        const slot = &self.slots[head & (self.slots.len - 1)];
+        slot.site = &site.info;
+        slot.timestamp = @intCast(std.time.nanoTimestamp());
+        slot.args_len = encodeArgs(&slot.args, args);
+
+        self.head.store(head + 1, .release);
+    }
+
+    fn run(self: *FileSink) void {
+        flight_recorder.registerThread("log-sink");
+
+        while (true) {
+            const drained = self.drain();
+            if (drained == 0) {
+                if (!self.running.load(.acquire)) break;
+
+                self.flush();
+                std.Thread.sleep(5 * std.time.ns_per_ms);
+            }
+
+            if (self.file != null and self.shouldRotate()) {
+                self.rotate() catch {
+                    _ = self.write_errors.fetchAdd(1, .monotonic);
+                    self.rotate_after_s = std.time.timestamp() + rotate_retry_s;
+                };
+            }
+        }
+
+        self.flush();
+    }
+
+    fn drain(self: *FileSink) usize {
+        const tail = self.tail.load(.monotonic);
+        const head = self.head.load(.acquire);
+
+        self.listener_mutex.lock();
+        defer self.listener_mutex.unlock();
+
+        var i = tail;
+        while (i != head) : (i += 1) {
+            const slot = &self.slots[i & (self.slots.len - 1)];
+            if (self.file != null) {
+                self.writeRecord(slot) catch {
+                    _ = self.write_errors.fetchAdd(1, .monotonic);
+                };
+            }
+            if (self.listener) |listener| {
+                var line_buf: [512]u8 = undefined;
+                var line: std.Io.Writer = .fixed(&line_buf);
+                // A line cut short by the buffer is still worth showing.
+                formatRecord(&line, slot.site.fmt, slot.args[0..slot.args_len]) catch {};
+                listener.onLine(listener.ctx, slot.site.level, line.buffered());
+            }
+        }
+
+        self.tail.store(head, .release);
+        return head - tail;
+    }
+
+    fn writeRecord(self: *FileSink, slot: *const Slot) !void {
+        const w = &self.file_writer.interface;
+        const site = slot.site;
+
+        if (site.written_generation != self.generation) {
+            try w.writeByte(Tag.site);
+            try w.writeInt(u32, site.id, .little);
+            try w.writeByte(@intFromEnum(site.level));
+            try w.writeInt(u16, @intCast(site.fmt.len), .little);
+            try w.writeAll(site.fmt);
+            site.written_generation = self.generation;
+            self.file_bytes += 8 + site.fmt.len;
+        }
+
+        try w.writeByte(Tag.log);
+        try w.writeInt(u32, site.id, .little);
+        try w.writeInt(i64, slot.timestamp, .little);
+        try w.writeInt(u16, slot.args_len, .little);
+        try w.writeAll(slot.args[0..slot.args_len]);
+        self.file_bytes += 15 + slot.args_len;
+    }
+
+    fn flush(self: *FileSink) void {
+        if (self.file == null) return;
+        const w = &self.file_writer.interface;
+        const pending = w.end;
+        if (pending == 0) return;
+
+        var timer = std.time.Timer.start() catch null;
+        w.flush() catch |err| {
+            _ = self.write_errors.fetchAdd(1, .monotonic);
+            flight_recorder.recordError(err);
+        };
+
+        if (timer) |*t| {
+            const elapsed = t.read();
+            if (elapsed >= slow_flush_ns) {
+                flight_recorder.record(.slow_flush, elapsed, pending);
+            }
+        }
+    }
+
+    fn shouldRotate(self: *const FileSink) bool {
+        const now = std.time.timestamp();
+        if (now < self.rotate_after_s) return false;
+        if (self.file_bytes >= self.options.max_bytes) return true;
+        return now - self.file_opened_s >= self.options.max_age_s;
+    }
+
+    /// Creates the file at `path` and switches writing to it. Any previous
+    /// file is closed only once the new one is open, so a failure leaves
+    /// the sink writing where it was.
+    fn openFile(self: *FileSink) !void {
+        const file = try std.fs.cwd().createFile(self.path(), .{ .truncate = true });
+        if (self.file) |old| old.close();
+        self.file = file;
+        self.file_writer = file.writer(self.write_buf);
+        self.file_opened_s = std.time.timestamp();
+        self.generation +%= 1;
+
+        try self.file_writer.interface.writeAll(MAGIC);
+        self.file_bytes = MAGIC.len;
+    }
+
+    /// Shifts `path` -> `path.1` -> ... -> `path.<keep>` and starts a new file.
+    /// The current file stays open until then; renaming it does not affect
+    /// writes to it. If the new file cannot be opened, the retry only tries
+    /// that again: shifting once more would push the open file towards
+    /// deletion.
+    fn rotate(self: *FileSink) !void {
+        self.flush();
+        if (!self.shifted) try self.shiftFiles();
+        self.shifted = true;
+        try self.openFile();
+        self.shifted = false;
+    }
+
+    fn shiftFiles(self: *FileSink) !void {
+        var from_buf: [std.fs.max_path_bytes]u8 = undefined;
+        var to_buf: [std.fs.max_path_bytes]u8 = undefined;
+
+        var i: usize = self.options.keep;
+        while (i > 0) : (i -= 1) {
+            const from = if (i == 1)
+                self.path()
+            else
+                try std.fmt.bufPrint(&from_buf, "{s}.{d}", .{ self.path(), i - 1 });
+            const to = try std.fmt.bufPrint(&to_buf, "{s}.{d}", .{ self.path(), i });
+
+            std.fs.cwd().rename(from, to) catch |err| switch (err) {
+                error.FileNotFound => {},
+                else => return err,
+            };
+        }
+    }
+};
+
+/// Substitutes each `{...}` placeholder in `fmt` with the next decoded
+/// argument. `{{` and `}}` are unescaped; missing arguments print `{?}`.
+pub fn formatRecord(out: *std.Io.Writer, fmt: []const u8, args: []const u8) !void {
+    var arg_pos: usize = 0;
+    var i: usize = 0;
+    while (i < fmt.len) {
+        const c = fmt[i];
+        if (c == '{' and i + 1 < fmt.len and fmt[i + 1] == '{') {
+            try out.writeByte('{');
+            i += 2;
+        } else if (c == '}' and i + 1 < fmt.len and fmt[i + 1] == '}') {
+            try out.writeByte('}');
+            i += 2;
+        } else if (c == '{') {
+            const end = std.mem.indexOfScalarPos(u8, fmt, i, '}') orelse fmt.len - 1;
+            const spec = fmt[i + 1 .. end];
+            arg_pos = try writeArg(out, args, arg_pos, spec);
+            i = end + 1;
+        } else {
+            try out.writeByte(c);
+            i += 1;
+        }
+    }
+}
+
+fn writeArg(out: *std.Io.Writer, args: []const u8, pos: usize, spec: []const u8) !usize {
+    if (pos >= args.len) {
+        try out.writeAll("{?}");
+        return pos;
+    }
+
+    const hex = std.mem.indexOfScalar(u8, spec, 'x') != null;
+    const tag = args[pos];
+    switch (tag) {
+        Tag.uint, Tag.int, Tag.float => {
+            if (pos + 9 > args.len) return error.Truncated;
+            const raw = std.mem.readInt(u64, args[pos + 1 ..][0..8], .little);
+            switch (tag) {
+                Tag.uint => if (hex) try out.print("{x}", .{raw}) else try out.print("{d}", .{raw}),
+                Tag.int => try out.print("{d}", .{@as(i64, @bitCast(raw))}),
+                else => try out.print("{d}", .{@as(f64, @bitCast(raw))}),
+            }
+            return pos + 9;
+        },
+        Tag.boolean => {
+            if (pos + 2 > args.len) return error.Truncated;
+            try out.writeAll(if (args[pos + 1] != 0) "true" else "false");
+            return pos + 2;
+        },
+        Tag.string => {
+            if (pos + 3 > args.len) return error.Truncated;
+            const len = std.mem.readInt(u16, args[pos + 1 ..][0..2], .little);
+            if (pos + 3 + len > args.len) return error.Truncated;
+            try out.writeAll(args[pos + 3 ..][0..len]);
+            return pos + 3 + len;
+        },
+        else => return error.BadArgument,
+    }
+}
+
+fn encodeArgs(buf: []u8, args: anytype) u16 {
+    var pos: usize = 0;
+    inline for (std.meta.fields(@TypeOf(args))) |field| {
+        pos = encodeArg(buf, pos, @field(args, field.name)) orelse break;
+    }
+    return @intCast(pos);
+}
+
+/// Appends one tagged argument, or returns null when it does not fit.
+/// Arguments that do not fit are left out; logcat prints them as `{?}`.
+fn encodeArg(buf: []u8, pos: usize, arg: anytype) ?usize {
+    const T = @TypeOf(arg);
+    switch (@typeInfo(T)) {
+        .int, .comptime_int => {
+            if (pos + 9 > buf.len) return null;
+            const signed = switch (@typeInfo(T)) {
+                .int => |info| info.signedness == .signed,
+                else => arg < 0,
+            };
+            if (signed) {
+                buf[pos] = Tag.int;
+                std.mem.writeInt(i64, buf[pos + 1 ..][0..8], @intCast(arg), .little);
+            } else {
+                buf[pos] = Tag.uint;
+                std.mem.writeInt(u64, buf[pos + 1 ..][0..8], @intCast(arg), .little);
+            }
+            return pos + 9;
+        },
+        .float, .comptime_float => {
+            if (pos + 9 > buf.len) return null;
+            buf[pos] = Tag.float;
+            std.mem.writeInt(u64, buf[pos + 1 ..][0..8], @bitCast(@as(f64, arg)), .little);
+            return pos + 9;
+        },
+        .bool => {
+            if (pos + 2 > buf.len) return null;
+            buf[pos] = Tag.boolean;
+            buf[pos + 1] = @intFromBool(arg);
+            return pos + 2;
+        },
+        .@"enum" => return encodeString(buf, pos, @tagName(arg)),
+        .error_set => return encodeString(buf, pos, @errorName(arg)),
+        .pointer => return encodeString(buf, pos, arg),
+        else => @compileError("unsupported log argument type: " ++ @typeName(T)),
+    }
+}
+
+/// Strings are truncated to the space left in the slot.
+fn encodeString(buf: []u8, pos: usize, str: []const u8) ?usize {
+    if (pos + 3 > buf.len) return null;
+    const len = @min(str.len, buf.len - pos - 3);
+    buf[pos] = Tag.string;
+    std.mem.writeInt(u16, buf[pos + 1 ..][0..2], @intCast(len), .little);
+    @memcpy(buf[pos + 3 ..][0..len], str[0..len]);
+    return pos + 3 + len;
+}
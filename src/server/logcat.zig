@@ -0,0 +1,97 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+const log_sink = @import("log_sink.zig");
+const Level = @import("logging.zig").Level;
+const Tag = log_sink.Tag;
+
+const SiteDef = struct {
+    level: Level,
+    fmt: []const u8,
+};
+
+/// Decodes binary server log files written by `FileSink` and prints one
+/// text line per record to stdout.
+pub fn run(allocator: Allocator, paths: []const []const u8) !void {
+    if (paths.len == 0) {
+        std.debug.print("Error: logcat requires at least one log file.\n", .{});
+        return error.InvalidArguments;
+    }
+
+    var out_buf: [4096]u8 = undefined;
+    var stdout = std.fs.File.stdout().writer(&out_buf);
+    const out = &stdout.interface;
+    defer out.flush() catch {};
+
+    for (paths) |path| {
+        const data = std.fs.cwd().readFileAlloc(allocator, path, std.math.maxInt(u32)) catch |err| {
+            std.debug.print("Error: Cannot read '{s}': {}\n", .{ path, err });
+            return err;
+        };
+        defer allocator.free(data);
+
+        decode(allocator, data, out) catch |err| {
+            std.debug.print("Error: '{s}' is not a valid zignal log: {}\n", .{ path, err });
+            return err;
+        };
+    }
+}
+
+fn decode(allocator: Allocator, data: []const u8, out: *std.Io.Writer) !void {
+    if (data.len < log_sink.MAGIC.len or !std.mem.eql(u8, data[0..log_sink.MAGIC.len], log_sink.MAGIC)) {
+        return error.BadMagic;
+    }
+
+    var sites: std.AutoHashMapUnmanaged(u32, SiteDef) = .{};
+    defer sites.deinit(allocator);
+
+    var pos: usize = log_sink.MAGIC.len;
+    while (pos < data.len) {
+        const tag = data[pos];
+        pos += 1;
+
+        switch (tag) {
+            Tag.site => {
+                if (pos + 7 > data.len) return error.Truncated;
+                const id = std.mem.readInt(u32, data[pos..][0..4], .little);
+                const level = std.meta.intToEnum(Level, data[pos + 4]) catch return error.BadLevel;
+                const fmt_len = std.mem.readInt(u16, data[pos + 5 ..][0..2], .little);
+                pos += 7;
+                if (pos + fmt_len > data.len) return error.Truncated;
+                try sites.put(allocator, id, .{ .level = level, .fmt = data[pos .. pos + fmt_len] });
+                pos += fmt_len;
+            },
+            Tag.log => {
+                if (pos + 14 > data.len) return error.Truncated;
+                const id = std.mem.readInt(u32, data[pos..][0..4], .little);
+                const timestamp = std.mem.readInt(i64, data[pos + 4 ..][0..8], .little);
+                const args_len = std.mem.readInt(u16, data[pos + 12 ..][0..2], .little);
+                pos += 14;
+                if (pos + args_len > data.len) return error.Truncated;
+                const args = data[pos .. pos + args_len];
+                pos += args_len;
+
+                const site = sites.get(id) orelse return error.UnknownSite;
+                try writeTimestamp(out, timestamp);
+                try out.print(" [{s}] ", .{site.level.toString()});
+                try log_sink.formatRecord(out, site.fmt, args);
+                try out.writeByte('\n');
+            },
+            else => return error.BadRecord,
+        }
+    }
+}
+
+/// The sink only writes times after the epoch, so a negative one means
+/// the record is corrupt.
+fn writeTimestamp(out: *std.Io.Writer, timestamp_ns: i64) !void {
+    const ms: u64 = std.math.cast(u64, @divTrunc(timestamp_ns, std.time.ns_per_ms)) orelse return error.BadTimestamp;
+    const epoch_seconds: std.time.epoch.EpochSeconds = .{ .secs = ms / std.time.ms_per_s };
+    const day_seconds = epoch_seconds.getDaySeconds();
+    try out.print("[{d:0>2}:{d:0>2}:{d:0>2}.{d:0>3}]", .{
+        day_seconds.getHoursIntoDay(),
+        day_seconds.getMinutesIntoHour(),
+        day_seconds.getSecondsIntoMinute(),
+        ms % std.time.ms_per_s,
+    });
+}
@@ -0,0 +1,68 @@
+const std = @import("std");
+const builtin = @import("builtin");
+
+const LogEntry = @import("tui.zig").LogEntry;
+
+pub const Level = LogEntry.Level;
+
+/// Most verbose level compiled into the server. Calls above it are removed
+/// at compile time, so they never reach `bufPrint` or the TUI queue.
+pub const min_level: Level = if (builtin.mode == .Debug) .debug else .info;
+
+pub inline fn enabled(comptime level: Level) bool {
+    return comptime @intFromEnum(level) <= @intFromEnum(min_level);
+}
+
+/// Token-style limiter for a single log call site.
+/// Allows `burst` lines per `interval_ms` window and counts what it drops,
+/// so the next line that gets through can report how many were suppressed.
+pub const RateLimiter = struct {
+    interval_ms: i64 = 1000,
+    burst: u32 = 5,
+    window_start: i64 = 0,
+    emitted: u32 = 0,
+    suppressed: u32 = 0,
+
+    /// Returns the number of calls suppressed since the last allowed one if
+    /// this call may log, or null if it should be dropped.
+    pub fn allow(self: *RateLimiter, now_ms: i64) ?u32 {
+        if (now_ms - self.window_start >= self.interval_ms) {
+            self.window_start = now_ms;
+            self.emitted = 0;
+        }
+
+        if (self.emitted >= self.burst) {
+            self.suppressed +|= 1;
+            return null;
+        }
+
+        self.emitted += 1;
+        const dropped = self.suppressed;
+        self.suppressed = 0;
+        return dropped;
+    }
+};
+
+/// Counts hot-path events so they can be reported as one summary line per
+/// window instead of one log line per event.
+pub const Aggregate = struct {
+    window_ms: i64 = 5000,
+    window_start: i64 = 0,
+    count: u64 = 0,
+    bytes: u64 = 0,
+
+    pub inline fn record(self: *Aggregate, bytes: usize) void {
+        self.count += 1;
+        self.bytes += bytes;
+    }
+
+    pub fn due(self: *const Aggregate, now_ms: i64) bool {
+        return now_ms - self.window_start >= self.window_ms;
+    }
+
+    pub fn reset(self: *Aggregate, now_ms: i64) void {
+        self.window_start = now_ms;
+        self.count = 0;
+        self.bytes = 0;
+    }
+};
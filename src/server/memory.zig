@@ -0,0 +1,174 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+const Alignment = std.mem.Alignment;
+
+/// Server memory pools. Every allocation the server makes on behalf of
+/// clients goes through one of these so it can be accounted and capped.
+pub const Pool = enum {
+    /// Poll and client tables sized by max clients.
+    tables,
+    /// Per-connection reader buffers.
+    connections,
+    /// Per-IP and per-user accounting totals.
+    accounting,
+    /// Log lines queued for the TUI.
+    log_queue,
+    /// Deadlines of live ephemeral messages.
+    expiry,
+};
+
+pub const POOL_COUNT = std.meta.fields(Pool).len;
+
+pub const Limits = struct {
+    /// Above this, new connections are refused. Pausing reads would free
+    /// nothing, since reader buffers are sized up front.
+    soft_bytes: usize = 0,
+    /// Above this, allocations fail and the heaviest connections are evicted.
+    hard_bytes: usize = 0,
+    /// Most buffered, unparsed input a connection may hold before its reads
+    /// are paused until that backlog has been relayed.
+    connection_bytes: usize = 0,
+};
+
+pub const Pressure = enum {
+    none,
+    soft,
+    hard,
+};
+
+/// Tracks bytes per pool against a global soft and hard limit. The
+/// allocators handed out are thin wrappers over `backing`; a limit of 0
+/// means unlimited. Counters are atomic because the TUI thread allocates
+/// from `log_queue`.
+pub const MemoryBudget = struct {
+    backing: Allocator,
+    limits: Limits,
+    used: [POOL_COUNT]std.atomic.Value(usize),
+    total: std.atomic.Value(usize),
+    peak: std.atomic.Value(usize),
+    failed: std.atomic.Value(u64),
+    /// Connections currently paused, refused and evicted so far, published
+    /// for the TUI.
+    paused: std.atomic.Value(usize),
+    refused: std.atomic.Value(u64),
+    evicted: std.atomic.Value(u64),
+
+    pub fn init(backing: Allocator, limits: Limits) MemoryBudget {
+        return .{
+            .backing = backing,
+            .limits = limits,
+            .used = @splat(.init(0)),
+            .total = .init(0),
+            .peak = .init(0),
+            .failed = .init(0),
+            .paused = .init(0),
+            .refused = .init(0),
+            .evicted = .init(0),
+        };
+    }
+
+    pub fn allocator(self: *MemoryBudget, comptime pool: Pool) Allocator {
+        return .{
+            .ptr = self,
+            .vtable = &PoolVTable(pool).vtable,
+        };
+    }
+
+    /// Bytes outside the `tables` pool. The tables are sized up front and
+    /// never shrink, so the limits apply to everything on top of them;
+    /// otherwise a limit below the table size would shed every client
+    /// without freeing anything.
+    pub fn sheddable(self: *const MemoryBudget) usize {
+        return self.total.load(.monotonic) -| self.poolBytes(.tables);
+    }
+
+    pub fn pressure(self: *const MemoryBudget) Pressure {
+        const total = self.sheddable();
+        if (self.limits.hard_bytes != 0 and total >= self.limits.hard_bytes) return .hard;
+        if (self.limits.soft_bytes != 0 and total >= self.limits.soft_bytes) return .soft;
+        return .none;
+    }
+
+    pub fn poolBytes(self: *const MemoryBudget, pool: Pool) usize {
+        return self.used[@intFromEnum(pool)].load(.monotonic);
+    }
+
+    /// Counts `len` bytes the pool holds outside its allocator, such as
+    /// mapped pages, under the same hard limit. Undo with `uncharge`.
+    pub fn charge(self: *MemoryBudget, pool: Pool, len: usize) error{OutOfMemory}!void {
+        if (!self.reserve(pool, len)) return error.OutOfMemory;
+    }
+
+    pub fn uncharge(self: *MemoryBudget, pool: Pool, len: usize) void {
+        self.release(pool, len);
+    }
+
+    fn reserve(self: *MemoryBudget, pool: Pool, len: usize) bool {
+        const total = self.total.fetchAdd(len, .monotonic) + len;
+        const over = total -| self.poolBytes(.tables) > self.limits.hard_bytes;
+        if (self.limits.hard_bytes != 0 and over and pool != .tables) {
+            _ = self.total.fetchSub(len, .monotonic);
+            _ = self.failed.fetchAdd(1, .monotonic);
+            return false;
+        }
+
+        _ = self.used[@intFromEnum(pool)].fetchAdd(len, .monotonic);
+        if (total > self.peak.load(.monotonic)) {
+            self.peak.store(total, .monotonic);
+        }
+        return true;
+    }
+
+    fn release(self: *MemoryBudget, pool: Pool, len: usize) void {
+        _ = self.total.fetchSub(len, .monotonic);
+        _ = self.used[@intFromEnum(pool)].fetchSub(len, .monotonic);
+    }
+};
+
+fn PoolVTable(comptime pool: Pool) type {
+    return struct {
+        const vtable: Allocator.VTable = .{
+            .alloc = alloc,
+            .resize = resize,
+            .remap = remap,
+            .free = free,
+        };
+
+        fn alloc(ctx: *anyopaque, len: usize, alignment: Alignment, ret_addr: usize) ?[*]u8 {
+            const self: *MemoryBudget = @ptrCast(@alignCast(ctx));
+            if (!self.reserve(pool, len)) return null;
+            return self.backing.rawAlloc(len, alignment, ret_addr) orelse {
+                self.release(pool, len);
+                return null;
+            };
+        }
+
+        fn resize(ctx: *anyopaque, memory: []u8, alignment: Alignment, new_len: usize, ret_addr: usize) bool {
+            const self: *MemoryBudget = @ptrCast(@alignCast(ctx));
+            if (new_len > memory.len and !self.reserve(pool, new_len - memory.len)) return false;
+            if (!self.backing.rawResize(memory, alignment, new_len, ret_addr)) {
+                if (new_len > memory.len) self.release(pool, new_len - memory.len);
+                return false;
+            }
+            if (new_len < memory.len) self.release(pool, memory.len - new_len);
+            return true;
+        }
+
+        fn remap(ctx: *anyopaque, memory: []u8, alignment: Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+            const self: *MemoryBudget = @ptrCast(@alignCast(ctx));
+            if (new_len > memory.len and !self.reserve(pool, new_len - memory.len)) return null;
+            const result = self.backing.rawRemap(memory, alignment, new_len, ret_addr) orelse {
+                if (new_len > memory.len) self.release(pool, new_len - memory.len);
+                return null;
+            };
+            if (new_len < memory.len) self.release(pool, memory.len - new_len);
+            return result;
+        }
+
+        fn free(ctx: *anyopaque, memory: []u8, alignment: Alignment, ret_addr: usize) void {
+            const self: *MemoryBudget = @ptrCast(@alignCast(ctx));
+            self.backing.rawFree(memory, alignment, ret_addr);
+            self.release(pool, memory.len);
+        }
+    };
+}
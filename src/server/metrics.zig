@@ -0,0 +1,147 @@
+const std = @import("std");
+
+const TopOffenders = @import("accounting.zig").TopOffenders;
+
+/// Server-wide metrics. Written by the network thread, read by the TUI.
+/// Every field is written by a single thread, so updates are plain
+/// load/store pairs on atomics rather than read-modify-write operations.
+pub const Metrics = struct {
+    /// Connections accepted since start.
+    accepts: std.atomic.Value(u64) = .init(0),
+    loop: LoopStats = .{},
+    top: TopOffenders = .{},
+};
+
+/// Power-of-two bucketed histogram. Bucket `i` counts values in
+/// `[2^(i-1), 2^i)`, with bucket 0 holding zero.
+pub const Histogram = struct {
+    pub const BUCKETS = 32;
+
+    buckets: [BUCKETS]std.atomic.Value(u64) = @splat(.init(0)),
+    count: std.atomic.Value(u64) = .init(0),
+    max: std.atomic.Value(u64) = .init(0),
+
+    pub fn observe(self: *Histogram, value: u64) void {
+        const idx = @min(BUCKETS - 1, 64 - @as(usize, @clz(value)));
+        bump(&self.buckets[idx], 1);
+        bump(&self.count, 1);
+        if (value > self.max.load(.monotonic)) {
+            self.max.store(value, .monotonic);
+        }
+    }
+
+    /// Like `observe`, for histograms fed from several threads at once.
+    pub fn observeShared(self: *Histogram, value: u64) void {
+        const idx = @min(BUCKETS - 1, 64 - @as(usize, @clz(value)));
+        _ = self.buckets[idx].fetchAdd(1, .monotonic);
+        _ = self.count.fetchAdd(1, .monotonic);
+        _ = self.max.fetchMax(value, .monotonic);
+    }
+
+    /// Upper bound of the bucket holding the `p`-th percentile (0-100).
+    pub fn percentile(self: *const Histogram, p: u64) u64 {
+        const total = self.count.load(.monotonic);
+        if (total == 0) return 0;
+
+        const rank = (total * p + 99) / 100;
+        var seen: u64 = 0;
+        for (&self.buckets, 0..) |*bucket, i| {
+            seen += bucket.load(.monotonic);
+            if (seen >= rank) {
+                return if (i == 0) 0 else @as(u64, 1) << @intCast(i);
+            }
+        }
+        return self.max.load(.monotonic);
+    }
+};
+
+pub inline fn bump(counter: *std.atomic.Value(u64), n: u64) void {
+    counter.store(counter.load(.monotonic) + n, .monotonic);
+}
+
+/// Phases of one `Server.start` loop iteration.
+pub const Phase = enum(u8) {
+    accept,
+    read,
+    broadcast,
+    log,
+};
+
+pub const LoopStats = struct {
+    /// Iteration duration in microseconds, from poll return to the next poll.
+    iterations: Histogram = .{},
+    /// Microseconds between poll reporting a socket ready and handling it.
+    readiness: Histogram = .{},
+    stalls: std.atomic.Value(u64) = .init(0),
+    last_stall_us: std.atomic.Value(u64) = .init(0),
+    last_stall_phase: std.atomic.Value(u8) = .init(0),
+};
+
+pub const Stall = struct {
+    total_ns: u64,
+    phase: Phase,
+    phase_ns: u64,
+};
+
+/// Per-iteration timing for the server event loop.
+/// `begin` is called when poll returns, `charge` attributes the time since a
+/// `mark` to a phase, and `end` records the iteration and reports a stall
+/// when it ran past `threshold_ns`.
+pub const LoopMonitor = struct {
+    stats: *LoopStats,
+    threshold_ns: u64,
+    timer: std.time.Timer,
+    iteration_start: u64 = 0,
+    phase_ns: [std.meta.fields(Phase).len]u64 = @splat(0),
+
+    pub fn init(stats: *LoopStats, threshold_ns: u64) !LoopMonitor {
+        return .{
+            .stats = stats,
+            .threshold_ns = threshold_ns,
+            .timer = try std.time.Timer.start(),
+        };
+    }
+
+    pub fn begin(self: *LoopMonitor) void {
+        self.iteration_start = self.timer.read();
+        @memset(&self.phase_ns, 0);
+    }
+
+    pub inline fn mark(self: *LoopMonitor) u64 {
+        return self.timer.read();
+    }
+
+    /// Returns the charged time so callers can also attribute it elsewhere.
+    pub inline fn charge(self: *LoopMonitor, phase: Phase, since: u64) u64 {
+        const elapsed = self.timer.read() - since;
+        self.phase_ns[@intFromEnum(phase)] += elapsed;
+        return elapsed;
+    }
+
+    /// Records how long a socket reported ready by the last poll waited.
+    pub fn handled(self: *LoopMonitor) void {
+        self.stats.readiness.observe((self.timer.read() - self.iteration_start) / std.time.ns_per_us);
+    }
+
+    /// Returns the iteration duration, and whether it was a stall.
+    pub fn end(self: *LoopMonitor) struct { total_ns: u64, stall: ?Stall } {
+        const total = self.timer.read() - self.iteration_start;
+        self.stats.iterations.observe(total / std.time.ns_per_us);
+
+        if (total < self.threshold_ns) {
+            return .{ .total_ns = total, .stall = null };
+        }
+
+        const slowest = std.mem.indexOfMax(u64, &self.phase_ns);
+        const stall: Stall = .{
+            .total_ns = total,
+            .phase = @enumFromInt(slowest),
+            .phase_ns = self.phase_ns[slowest],
+        };
+
+        bump(&self.stats.stalls, 1);
+        self.stats.last_stall_us.store(total / std.time.ns_per_us, .monotonic);
+        self.stats.last_stall_phase.store(@intCast(slowest), .monotonic);
+        return .{ .total_ns = total, .stall = stall };
+    }
+};
@@ -1,17 +1,61 @@
 const std = @import("std");
+const builtin = @import("builtin");
 const net = std.net;
 const posix = std.posix;
 const Allocator = std.mem.Allocator;
 
 const config = @import("../config.zig");
+const flight_recorder = @import("../flight_recorder.zig");
+const instrument = @import("../instrument.zig");
+const trace = @import("../trace.zig");
 const Reader = @import("../reader.zig").Reader;
 const Writer = @import("../writer.zig").Writer;
+const Io = @import("../io.zig").Io;
 const ServerTui = @import("tui.zig").ServerTui;
 const LogEntry = @import("tui.zig").LogEntry;
+const logging = @import("logging.zig");
+const accounting = @import("accounting.zig");
+const Accounting = accounting.Accounting;
+const ConnStats = accounting.ConnStats;
+const memory = @import("memory.zig");
+const MemoryBudget = memory.MemoryBudget;
+const metrics_mod = @import("metrics.zig");
+const Metrics = metrics_mod.Metrics;
+const LoopMonitor = metrics_mod.LoopMonitor;
+const log_sink = @import("log_sink.zig");
+const FileSink = log_sink.FileSink;
+const Capture = @import("capture.zig").Capture;
+const protocol = @import("../protocol.zig");
+const vhost = @import("vhost.zig");
+const Host = vhost.Host;
+const History = vhost.History;
+const ExpiryIndex = @import("expiry.zig").ExpiryIndex;
 
 const BUFFER_SIZE = config.BUFFER_SIZE;
 const MAX_CLIENTS = config.MAX_CLIENTS;
 
+/// Most frames taken from one connection per read and relayed together.
+const READ_BATCH = 32;
+/// Most ids in one expiry notice; keeps the notice well inside a frame
+/// even with the embedded profile.
+const EXPIRY_BATCH = 32;
+/// Ephemeral messages one connection, or one room, may have waiting to
+/// expire. Only messages a room's history holds are tracked, so the
+/// expiry index never outgrows the histories either.
+const MAX_EPHEMERAL_PER_CONNECTION = 32;
+const MAX_EPHEMERAL_PER_ROOM = 128;
+/// Most room history replayed on join, newest frames first, so the replay
+/// fits in a fresh socket's send buffer.
+const REPLAY_BYTES = 64 * 1024;
+/// How long a join waits for a full socket to take the rest of a frame
+/// it has started, so the stream never stops mid-frame.
+const REPLAY_WAIT_MS = 50;
+
+/// Loop iterations at least this long are kept in the flight recorder.
+const slow_iteration_ns = std.time.ns_per_ms;
+/// Loop iterations at least this long are reported as stalls.
+const stall_threshold_ns = 50 * std.time.ns_per_ms;
+
 var local_ip_buf: [16]u8 = undefined;
 
 fn getLocalIp() ?[]const u8 {
@@ -34,50 +78,162 @@ fn getLocalIp() ?[]const u8 {
 }
 
 const ClientConnection = struct {
+    /// Unique for the life of the server; identifies the connection in captures.
+    id: u32,
     reader: Reader,
     socket: posix.socket_t,
     address: std.net.Address,
+    stats: ConnStats,
+    /// Snapshot of `stats` already folded into the per-IP and per-user totals.
+    reported: ConnStats,
+    username: [24]u8,
+    username_len: usize,
+    /// Reads are paused while over quota.
+    paused: bool,
+    /// Paused because its backlog exceeded the connection quota; resumes
+    /// once the backlog has been relayed.
+    over_quota: bool,
+    /// Index of the virtual host the client is in. Null until its first
+    /// frame when the server has named hosts.
+    host: ?usize,
+    /// Earliest time the room's slow mode lets this connection post again,
+    /// used until the connection has a user name.
+    next_send_ms: i64,
+    /// Chat frames received so far; the cumulative ack, for clients that
+    /// asked for acks in their hello.
+    received: u32,
+    acks: bool,
 
-    fn init(allocator: Allocator, socket: posix.socket_t, address: std.net.Address) !ClientConnection {
-        const reader = try Reader.init(allocator, BUFFER_SIZE);
+    fn init(budget: *MemoryBudget, id: u32, socket: posix.socket_t, address: std.net.Address) !ClientConnection {
+        const reader = try Reader.initBackend(budget.allocator(.connections), BUFFER_SIZE, config.READER_BACKEND);
+        // A mirrored ring is mapped, not allocated, so it is charged here.
+        if (reader.ring != 0) budget.charge(.connections, reader.capacity()) catch |err| {
+            reader.deinit(budget.allocator(.connections));
+            return err;
+        };
         return .{
+            .id = id,
             .reader = reader,
             .socket = socket,
             .address = address,
+            .stats = .{ .connects = 1 },
+            .reported = .{},
+            .username = undefined,
+            .username_len = 0,
+            .paused = false,
+            .over_quota = false,
+            .host = null,
+            .next_send_ms = 0,
+            .received = 0,
+            .acks = false,
         };
     }
 
-    fn deinit(self: *ClientConnection, allocator: Allocator) void {
-        self.reader.deinit(allocator);
+    /// Bytes held for this connection: its reader buffer plus any
+    /// buffered, not yet parsed input.
+    fn footprint(self: *const ClientConnection) usize {
+        return self.reader.capacity() + (self.reader.pos - self.reader.start);
+    }
+
+    /// Buffered input not yet parsed and relayed.
+    fn backlog(self: *const ClientConnection) usize {
+        return self.reader.pos - self.reader.start;
+    }
+
+    /// Footprint plus input received since the last stats window, used to
+    /// pick which connection to evict first.
+    fn weight(self: *const ClientConnection) usize {
+        return self.footprint() + @as(usize, @intCast(self.reader.bytes - self.reported.bytes_in));
+    }
+
+    fn getUsername(self: *const ClientConnection) []const u8 {
+        return self.username[0..self.username_len];
     }
 
-    fn readMessage(self: *ClientConnection) !?[]const u8 {
-        return self.reader.readMessage(self.socket);
+    fn learnUsername(self: *ClientConnection, msg: []const u8) void {
+        const name = accounting.parseUsername(msg, self.username.len) orelse return;
+        @memcpy(self.username[0..name.len], name);
+        self.username_len = name.len;
+    }
+
+    /// Returns the stats gathered since the last call.
+    fn takeDelta(self: *ClientConnection) ConnStats {
+        self.stats.read_calls = self.reader.reads;
+        self.stats.bytes_in = self.reader.bytes;
+        const delta = self.stats.delta(self.reported);
+        self.reported = self.stats;
+        return delta;
+    }
+
+    fn deinit(self: *ClientConnection, budget: *MemoryBudget) void {
+        if (self.reader.ring != 0) budget.uncharge(.connections, self.reader.capacity());
+        self.reader.deinit(budget.allocator(.connections));
+    }
+
+    fn readBatch(self: *ClientConnection, io: Io, out: [][]const u8) !Reader.Batch {
+        return self.reader.readBatchIo(io, self.socket, out);
     }
 };
 
 pub const Server = struct {
     allocator: Allocator,
+    /// Sockets and clock used by the event loop; replaced by the simulator.
+    io: Io,
+    budget: *MemoryBudget,
     address: net.Address,
     max_clients: usize,
     polls: []posix.pollfd,
     clients: []ClientConnection,
     client_polls: []posix.pollfd,
+    /// Virtual hosts; the first is the default host with an empty name.
+    /// Each keeps the sockets of its members, so a broadcast needs no
+    /// per-message scratch.
+    hosts: std.ArrayList(Host),
     connected: usize,
     running: bool,
+    /// Run without the TUI, e.g. under the load generator or in tests.
+    headless: bool,
     tui: ?*ServerTui,
+    sink: ?*FileSink,
+    /// Records connections and inbound frames for `zignal replay`.
+    capture: ?*Capture,
+    next_conn_id: u32,
     bound_port: u16,
     local_ip: [16]u8,
     local_ip_len: usize,
+    relayed: logging.Aggregate,
+    metrics: Metrics,
+    accounting: Accounting,
+    /// When each live ephemeral message expires.
+    expiries: ExpiryIndex,
+    next_message_id: u64,
+    /// Connections paused over their quota, still holding frames to relay.
+    over_quota: usize,
 
     pub fn init(allocator: Allocator, address: net.Address, max_clients: ?usize) !Server {
         const actual_max = max_clients orelse MAX_CLIENTS;
 
-        const polls = try allocator.alloc(posix.pollfd, actual_max + 1);
-        errdefer allocator.free(polls);
+        const budget = try allocator.create(MemoryBudget);
+        errdefer allocator.destroy(budget);
+        budget.* = MemoryBudget.init(allocator, .{});
+        const tables = budget.allocator(.tables);
 
-        const clients = try allocator.alloc(ClientConnection, actual_max);
-        errdefer allocator.free(clients);
+        const polls = try tables.alloc(posix.pollfd, actual_max + 1);
+        errdefer tables.free(polls);
+
+        const clients = try tables.alloc(ClientConnection, actual_max);
+        errdefer tables.free(clients);
+
+        var hosts: std.ArrayList(Host) = .empty;
+        errdefer {
+            for (hosts.items) |*host| host.deinit(tables);
+            hosts.deinit(tables);
+        }
+        try hosts.ensureTotalCapacity(tables, 1);
+        hosts.appendAssumeCapacity(try Host.init(tables, "", actual_max, 0, .{}));
+
+        // No listener until `start` binds one; poll ignores negative fds.
+        polls[0] = .{ .fd = -1, .events = 0, .revents = 0 };
 
         var local_ip: [16]u8 = undefined;
         var local_ip_len: usize = 0;
@@ -92,40 +248,107 @@ pub const Server = struct {
 
         return .{
             .allocator = allocator,
+            .io = Io.system,
+            .budget = budget,
             .address = address,
             .max_clients = actual_max,
             .polls = polls,
             .clients = clients,
             .client_polls = polls[1..],
+            .hosts = hosts,
             .connected = 0,
             .running = true,
+            .headless = false,
             .tui = null,
+            .sink = null,
+            .capture = null,
+            .next_conn_id = 0,
             .bound_port = 0,
             .local_ip = local_ip,
             .local_ip_len = local_ip_len,
+            .relayed = .{},
+            .metrics = .{},
+            .accounting = Accounting.init(budget.allocator(.accounting)),
+            .expiries = ExpiryIndex.init(budget.allocator(.expiry)),
+            .next_message_id = 1,
+            .over_quota = 0,
         };
     }
 
     pub fn deinit(self: *Server) void {
         for (0..self.connected) |i| {
-            posix.close(self.clients[i].socket);
-            self.clients[i].deinit(self.allocator);
+            self.io.close(self.clients[i].socket);
+            self.clients[i].deinit(self.budget);
         }
         self.connected = 0;
 
-        self.allocator.free(self.polls);
-        self.allocator.free(self.clients);
+        self.accounting.deinit();
+        self.expiries.deinit();
+        const tables = self.budget.allocator(.tables);
+        tables.free(self.polls);
+        tables.free(self.clients);
+        for (self.hosts.items) |*host| host.deinit(tables);
+        self.hosts.deinit(tables);
+        self.allocator.destroy(self.budget);
     }
 
-    fn log(self: *Server, comptime fmt: []const u8, args: anytype, level: LogEntry.Level) void {
-        var buf: [512]u8 = undefined;
-        const msg = std.fmt.bufPrint(&buf, fmt, args) catch return;
-        if (self.tui) |tui| {
-            tui.queueLog(msg, level);
+    fn log(self: *Server, comptime fmt: []const u8, args: anytype, comptime level: LogEntry.Level) void {
+        if (comptime !logging.enabled(level)) return;
+
+        // The sink's thread formats lines for the TUI.
+        if (self.sink) |sink| {
+            sink.push(level, fmt, args);
         }
     }
 
+    /// Like `log`, but each call site emits at most a few lines per second.
+    /// Dropped lines are counted and reported by the next line that gets through.
+    fn logLimited(self: *Server, comptime fmt: []const u8, args: anytype, comptime level: LogEntry.Level) void {
+        if (comptime !logging.enabled(level)) return;
+
+        const site = struct {
+            var limiter: logging.RateLimiter = .{};
+        };
+        const suppressed = site.limiter.allow(self.io.milliTimestamp()) orelse return;
+        if (suppressed > 0) {
+            self.log(fmt ++ " ({} similar suppressed)", args ++ .{suppressed}, level);
+        } else {
+            self.log(fmt, args, level);
+        }
+    }
+
+    /// Once per aggregation window: logs the relay summary, publishes the
+    /// most expensive IPs and users of the window and starts a new one.
+    fn flushWindowStats(self: *Server) void {
+        const now = self.io.milliTimestamp();
+        if (!self.relayed.due(now)) return;
+
+        for (self.clients[0..self.connected]) |*client| {
+            self.foldStats(client);
+        }
+        self.accounting.publish(&self.metrics.top);
+        if (self.accounting.untracked > 0) {
+            self.log("Cost accounting dropped {d} updates in last window (tracking limit)", .{self.accounting.untracked}, .info);
+        }
+        self.accounting.reset();
+
+        if (self.relayed.count > 0) {
+            const window_s = @divTrunc(now - self.relayed.window_start, std.time.ms_per_s);
+            self.log("Relayed {d} messages ({d} bytes) in last {d}s", .{ self.relayed.count, self.relayed.bytes, window_s }, .info);
+        }
+        for (self.hosts.items) |*host| {
+            if (host.rejected == 0) continue;
+            const room = if (host.name_len == 0) "the default room" else host.name();
+            self.log("Refused {d} messages in {s} (slow mode or room budget)", .{ host.rejected, room }, .info);
+            host.rejected = 0;
+        }
+        self.relayed.reset(now);
+    }
+
     pub fn start(self: *Server) !void {
+        flight_recorder.registerThread("network");
+        trace.registerThread("network");
+
         const tpe: u32 = posix.SOCK.STREAM | posix.SOCK.NONBLOCK;
         const protocol = posix.IPPROTO.TCP;
         const listener = try posix.socket(self.address.any.family, tpe, protocol);
@@ -133,88 +356,515 @@ pub const Server = struct {
 
         try posix.setsockopt(listener, posix.SOL.SOCKET, posix.SO.REUSEADDR, &std.mem.toBytes(@as(c_int, 1)));
         try posix.bind(listener, &self.address.any, self.address.getOsSockLen());
-        try posix.listen(listener, 128);
+        try posix.listen(listener, config.LISTEN_BACKLOG);
 
         var addr: net.Address = undefined;
         var addr_len: posix.socklen_t = @sizeOf(net.Address);
         try posix.getsockname(listener, &addr.any, &addr_len);
 
-        self.bound_port = addr.getPort();
+        @atomicStore(u16, &self.bound_port, addr.getPort(), .release);
         self.log("Listening on port: {}", .{self.bound_port}, .info);
 
-        const tui = try ServerTui.init(
-            self.allocator,
-            self.local_ip[0..self.local_ip_len],
-            &self.bound_port,
-            &self.connected,
-            self.max_clients,
-            &self.running,
-        );
-        defer tui.deinit();
-        self.tui = tui;
+        // Without a log file the TUI still gets its lines through a sink,
+        // one that writes no file.
+        var own_sink: ?*FileSink = null;
+        defer if (own_sink) |sink| {
+            self.sink = null;
+            sink.deinit();
+        };
+
+        var tui_thread: ?std.Thread = null;
+        defer if (self.tui) |tui| {
+            if (self.sink) |sink| sink.detach();
+            tui.deinit();
+            self.tui = null;
+        };
+
+        if (!self.headless) {
+            if (self.sink == null) {
+                own_sink = try FileSink.init(self.allocator, .{ .path = null });
+                self.sink = own_sink;
+            }
 
-        const tui_thread = try std.Thread.spawn(.{}, runTui, .{tui});
+            const tui = try ServerTui.init(
+                self.allocator,
+                self.local_ip[0..self.local_ip_len],
+                &self.bound_port,
+                &self.connected,
+                self.max_clients,
+                &self.running,
+                &self.metrics,
+                self.budget,
+            );
+            self.tui = tui;
+            tui.sink = self.sink;
+            self.sink.?.attach(tui.logListener());
 
+            tui_thread = try std.Thread.spawn(.{}, runTui, .{tui});
+        }
+
+        self.adoptListener(listener);
+
+        var monitor = try LoopMonitor.init(&self.metrics.loop, stall_threshold_ns);
+
+        while (@atomicLoad(bool, &self.running, .acquire)) {
+            self.tick(&monitor, 100);
+        }
+
+        self.log("Server shutting down...", .{}, .info);
+        if (tui_thread) |thread| {
+            thread.join();
+        }
+    }
+
+    /// Starts serving an already listening socket from `self.io`. `start`
+    /// calls this; the simulator calls it directly and then drives the loop
+    /// with `tick`.
+    pub fn adoptListener(self: *Server, listener: posix.socket_t) void {
+        self.relayed.reset(self.io.milliTimestamp());
         self.polls[0] = .{
             .fd = listener,
             .revents = 0,
             .events = posix.POLL.IN,
         };
+    }
 
-        while (self.running) {
-            _ = posix.poll(self.polls[0 .. self.connected + 1], 100) catch |err| {
-                self.log("Poll error: {}", .{err}, .err);
-                continue;
+    /// One event loop iteration: waits up to `timeout_ms` for readiness,
+    /// then accepts, reads and broadcasts. Once the tables and reader
+    /// buffers are warm, relaying a message allocates nothing.
+    pub fn tick(self: *Server, monitor: *LoopMonitor, timeout_ms: i32) void {
+        const poll_span = trace.span("poll");
+        // Backlogs of paused connections are relayed without waiting.
+        const wait = if (self.over_quota > 0) 0 else timeout_ms;
+        const polled = self.io.poll(self.polls[0 .. self.connected + 1], wait);
+        poll_span.end();
+        _ = polled catch |err| {
+            flight_recorder.recordError(err);
+            self.logLimited("Poll error: {}", .{err}, .err);
+            return;
+        };
+        monitor.begin();
+        instrument.count("server.loop_iterations", 1);
+
+        var since = monitor.mark();
+        self.flushWindowStats();
+        _ = monitor.charge(.log, since);
+
+        if (self.polls[0].revents != 0) {
+            monitor.handled();
+            since = monitor.mark();
+            const accept_span = trace.span("accept");
+            self.acceptClients(self.polls[0].fd) catch |err| {
+                flight_recorder.recordError(err);
+                self.logLimited("Failed to accept clients: {}", .{err}, .err);
             };
+            accept_span.end();
+            _ = monitor.charge(.accept, since);
+        }
 
-            if (self.polls[0].revents != 0) {
-                self.acceptClients(listener) catch |err| {
-                    self.log("Failed to accept clients: {}", .{err}, .err);
-                };
+        var i: usize = 0;
+        while (i < self.connected) {
+            const revents = self.client_polls[i].revents;
+            if (revents == 0) {
+                i += 1;
+                continue;
             }
 
-            var i: usize = 0;
-            while (i < self.connected) {
-                const revents = self.client_polls[i].revents;
-                if (revents == 0) {
-                    i += 1;
-                    continue;
-                }
+            monitor.handled();
+            var client = &self.clients[i];
 
-                var client = &self.clients[i];
+            if (revents & posix.POLL.HUP == posix.POLL.HUP) {
+                self.log("Client disconnected", .{}, .warn);
+                self.removeClient(i);
+                continue;
+            }
 
-                if (revents & posix.POLL.HUP == posix.POLL.HUP) {
-                    self.log("Client disconnected", .{}, .warn);
-                    self.removeClient(i);
-                    continue;
+            if (revents & posix.POLL.IN == posix.POLL.IN) {
+                var frames: [READ_BATCH][]const u8 = undefined;
+                while (true) {
+                    since = monitor.mark();
+                    const read_span = trace.span("read");
+                    const read = client.readBatch(self.io, &frames);
+                    read_span.end();
+                    const batch = read catch |err| {
+                        client.stats.read_ns += monitor.charge(.read, since);
+                        flight_recorder.recordError(err);
+                        self.logLimited("Error reading from client: {}", .{err}, .err);
+                        self.removeClient(i);
+                        break;
+                    };
+                    client.stats.read_ns += monitor.charge(.read, since);
+                    if (batch.frames.len == 0) {
+                        i += 1;
+                        break;
+                    }
+                    client.stats.frames += batch.frames.len;
+                    if (!self.relayBatch(monitor, i, batch)) break;
+
+                    // A read that left more buffered than the quota stops
+                    // reading until the rest has been relayed.
+                    const quota = self.budget.limits.connection_bytes;
+                    if (quota != 0 and client.backlog() > quota) {
+                        self.logLimited("Connection backlog over quota ({d} bytes), pausing reads", .{client.backlog()}, .warn);
+                        client.over_quota = true;
+                        self.over_quota += 1;
+                        self.setPaused(i, true);
+                        i += 1;
+                        break;
+                    }
                 }
+            }
+        }
+
+        self.drainOverQuota(monitor);
+        self.purgeExpired();
+        self.shedLoad();
 
-                if (revents & posix.POLL.IN == posix.POLL.IN) {
-                    while (true) {
-                        const msg = client.readMessage() catch |err| {
-                            self.log("Error reading from client: {}", .{err}, .err);
-                            self.removeClient(i);
-                            break;
-                        } orelse {
-                            i += 1;
-                            break;
-                        };
-
-                        self.log("Message: {s}", .{msg}, .info);
-
-                        const sockets = self.allocator.alloc(posix.socket_t, self.connected) catch continue;
-                        defer self.allocator.free(sockets);
-                        for (0..self.connected) |j| {
-                            sockets[j] = self.clients[j].socket;
-                        }
-                        Writer.broadcastMessage(sockets, msg, client.socket);
+        const iteration = monitor.end();
+        if (iteration.total_ns >= slow_iteration_ns) {
+            flight_recorder.record(.loop_iteration, iteration.total_ns, self.connected);
+        }
+        if (iteration.stall) |stall| {
+            self.logLimited("Event loop stall: {d}ms, mostly in {s} ({d}ms)", .{
+                stall.total_ns / std.time.ns_per_ms,
+                @tagName(stall.phase),
+                stall.phase_ns / std.time.ns_per_ms,
+            }, .warn);
+        }
+    }
+
+    /// Relays a batch from client `idx` to the other members of its room.
+    /// Control frames are acted on here and never forwarded; the chat
+    /// frames around them go out in one write per recipient for each run.
+    /// Returns false if the client was removed.
+    fn relayBatch(self: *Server, monitor: *LoopMonitor, idx: usize, batch: Reader.Batch) bool {
+        const client = &self.clients[idx];
+        var since = monitor.mark();
+        var run_start: usize = 0;
+        var offset: usize = 0;
+        var now: ?i64 = null;
+        var refused: ?protocol.Rejected = null;
+        var chat = false;
+        for (batch.frames) |msg| {
+            const next = offset + 4 + msg.len;
+            defer offset = next;
+
+            if (self.capture) |capture| {
+                capture.frame(client.id, msg) catch |err| self.stopCapture(err);
+            }
+
+            // Ephemeral posts are chat and go through the same checks below.
+            const ephemeral = isEphemeralPost(msg);
+            if (protocol.isControl(msg) and !ephemeral) {
+                _ = monitor.charge(.log, since);
+                self.broadcast(monitor, idx, batch.wire[run_start..offset]);
+                run_start = next;
+                if (!self.handleControl(idx, msg)) return false;
+                since = monitor.mark();
+                continue;
+            }
+
+            // A client that sends chat without a hello is in the default room.
+            if (client.host == null) self.joinDefault(idx) catch {
+                self.logLimited("Client is not reading its room history, closing connection", .{}, .warn);
+                self.removeClient(idx);
+                return false;
+            };
+            if (!ephemeral) {
+                client.received +%= 1;
+                chat = true;
+                if (client.username_len == 0) client.learnUsername(msg);
+            }
+
+            // Refused frames are cut out of the run before fan-out.
+            if (self.admit(client, &now)) |refusal| {
+                _ = monitor.charge(.log, since);
+                self.broadcast(monitor, idx, batch.wire[run_start..offset]);
+                run_start = next;
+                client.stats.rejected += 1;
+                self.hosts.items[client.host.?].rejected += 1;
+                // A notice names one run of refused chat frames; a gap
+                // after an admitted frame starts another.
+                if (refused) |notice| {
+                    const gap = notice.seq_count > 0 and notice.first_seq +% notice.seq_count != client.received;
+                    if (!ephemeral and gap) {
+                        self.sendRejected(client.socket, notice);
+                        refused = null;
                     }
                 }
+                if (refused) |*notice| {
+                    notice.reason = refusal.reason;
+                    notice.count +|= 1;
+                    notice.retry_after_ms = @max(notice.retry_after_ms, refusal.retry_after_ms);
+                } else {
+                    refused = refusal;
+                }
+                if (!ephemeral) {
+                    const notice = &refused.?;
+                    if (notice.seq_count == 0) notice.first_seq = client.received;
+                    notice.seq_count +|= 1;
+                }
+                since = monitor.mark();
+                continue;
             }
+
+            if (ephemeral) {
+                _ = monitor.charge(.log, since);
+                self.broadcast(monitor, idx, batch.wire[run_start..offset]);
+                run_start = next;
+                self.relayEphemeral(idx, msg, &now);
+                since = monitor.mark();
+                continue;
+            }
+
+            const host = &self.hosts.items[client.host.?];
+            _ = host.history.push(msg, 0, 0);
+            if (host.history.dropped.items.len > 0) self.forgetDropped(client.host.?);
+            self.relayed.record(msg.len);
+            self.logLimited("Message: {s}", .{msg}, .debug);
         }
+        _ = monitor.charge(.log, since);
 
-        self.log("Server shutting down...", .{}, .info);
-        tui_thread.join();
+        self.broadcast(monitor, idx, batch.wire[run_start..]);
+        // The notice goes first, so the client knows which frames the ack
+        // covers without delivering them.
+        if (refused) |notice| self.sendRejected(client.socket, notice);
+        if (chat and client.acks) self.sendAck(client);
+        return true;
+    }
+
+    /// Acknowledges every chat frame read from `client` so far, refused
+    /// ones included; those also got a rejection notice.
+    fn sendAck(self: *Server, client: *const ClientConnection) void {
+        var buf: [6]u8 = undefined;
+        Writer.writeToSocketIo(self.io, client.socket, protocol.encodeAck(&buf, client.received)) catch |err| {
+            self.logLimited("Failed to send ack: {}", .{err}, .warn);
+        };
+    }
+
+    /// Applies the room's slow mode and message budget to one chat frame
+    /// from `client`. Returns the refusal, or null to relay the frame.
+    /// The clock is read at most once per batch, and only in limited rooms.
+    fn admit(self: *Server, client: *ClientConnection, now: *?i64) ?protocol.Rejected {
+        const host = &self.hosts.items[client.host.?];
+        const policy = host.policy;
+        if (policy.slow_ms == 0 and policy.rate == 0) return null;
+
+        const now_ms = self.batchClock(now);
+        // Slow mode is per user in the room. A connection that has not
+        // named itself yet, or finds the room's table full, keeps its own
+        // deadline instead.
+        var next_send = &client.next_send_ms;
+        if (policy.slow_ms > 0 and client.username_len > 0) {
+            next_send = host.senderDeadline(self.budget.allocator(.tables), client.getUsername(), now_ms) orelse next_send;
+        }
+        if (now_ms < next_send.*) {
+            return .{ .reason = .slow_mode, .count = 1, .retry_after_ms = @intCast(next_send.* - now_ms) };
+        }
+        if (host.budget.take(now_ms)) |wait_ms| {
+            return .{ .reason = .room_budget, .count = 1, .retry_after_ms = wait_ms };
+        }
+        next_send.* = now_ms + policy.slow_ms;
+        return null;
+    }
+
+    fn batchClock(self: *Server, now: *?i64) i64 {
+        if (now.*) |t| return t;
+        const t = self.io.milliTimestamp();
+        now.* = t;
+        return t;
+    }
+
+    fn isEphemeralPost(frame: []const u8) bool {
+        const kind = protocol.kind(frame) orelse return false;
+        return kind == .post_ephemeral;
+    }
+
+    /// Gives an ephemeral post from client `idx` an id, keeps it in the
+    /// room's history and sends it to the whole room, the sender included
+    /// so it learns the id its expiry notice will carry.
+    fn relayEphemeral(self: *Server, idx: usize, frame: []const u8, now: *?i64) void {
+        const client = &self.clients[idx];
+        const post = protocol.Ephemeral.decodePost(protocol.body(frame)) orelse return;
+        const host_idx = client.host.?;
+        const host = &self.hosts.items[host_idx];
+
+        const message: protocol.Ephemeral = .{
+            .id = self.next_message_id,
+            .ttl_ms = std.math.clamp(post.ttl_ms, 1, protocol.MAX_TTL_MS),
+            .text = post.text,
+        };
+        // Relayed frames must fit a reader buffer, length prefix included.
+        var wire: [BUFFER_SIZE]u8 = undefined;
+        const out = message.encode(wire[4..]) catch {
+            self.logLimited("Ephemeral message too long ({d} bytes), dropped", .{post.text.len}, .warn);
+            return;
+        };
+        std.mem.writeInt(u32, wire[0..4], @intCast(out.len), .little);
+
+        if (self.expiries.ownedBy(client.id) >= MAX_EPHEMERAL_PER_CONNECTION or host.ephemeral >= MAX_EPHEMERAL_PER_ROOM) {
+            client.stats.rejected += 1;
+            host.rejected += 1;
+            self.sendRejected(client.socket, .{ .reason = .ephemeral_limit, .count = 1, .retry_after_ms = 0 });
+            return;
+        }
+        self.next_message_id += 1;
+
+        // A room without history never replays the message, so there is
+        // nothing to expire on the server; clients drop it after its TTL.
+        const deadline = self.batchClock(now) + message.ttl_ms;
+        if (host.history.push(out, message.id, deadline)) |slot| {
+            self.forgetDropped(host_idx);
+            self.expiries.add(.{
+                .deadline_ms = deadline,
+                .id = message.id,
+                .host = @intCast(host_idx),
+                .slot = @intCast(slot),
+                .owner = client.id,
+            }) catch |err| {
+                // Without a deadline it would never expire, so it is not sent.
+                host.history.expire(slot, message.id);
+                self.logLimited("Failed to schedule message expiry, dropped: {}", .{err}, .warn);
+                return;
+            };
+            host.ephemeral += 1;
+        }
+
+        if (client.username_len == 0) {
+            client.learnUsername(post.text);
+        }
+        self.relayed.record(out.len);
+        for (self.clients[0..self.connected]) |*peer| {
+            if (peer.host != null and peer.host.? == host_idx) peer.stats.bytes_out += out.len + 4;
+        }
+        client.stats.write_calls += host.members;
+        Writer.broadcastFramesIo(self.io, host.memberSockets(), wire[0 .. out.len + 4], null);
+    }
+
+    /// Unindexes the ephemeral messages room `host_idx` dropped from its
+    /// history to make room; they can no longer be replayed, and clients
+    /// drop them after their TTL.
+    fn forgetDropped(self: *Server, host_idx: usize) void {
+        const host = &self.hosts.items[host_idx];
+        for (host.history.dropped.items) |id| {
+            if (self.expiries.remove(id) != null) host.ephemeral -= 1;
+        }
+        host.history.dropped.clearRetainingCapacity();
+    }
+
+    /// Expires every ephemeral message that is due: wipes it from its
+    /// room's history and tells the room, with one notice per room for up
+    /// to `EXPIRY_BATCH` messages at a time.
+    fn purgeExpired(self: *Server) void {
+        const deadline = self.expiries.nextDeadline() orelse return;
+        const now = self.io.milliTimestamp();
+        if (deadline > now) return;
+
+        var due: [EXPIRY_BATCH]ExpiryIndex.Entry = undefined;
+        while (true) {
+            const expired = self.expiries.popDue(now, &due);
+            if (expired.len == 0) break;
+
+            std.mem.sort(ExpiryIndex.Entry, expired, {}, byHost);
+            var start: usize = 0;
+            while (start < expired.len) {
+                const host = &self.hosts.items[expired[start].host];
+                var buf: [2 + EXPIRY_BATCH * 8]u8 = undefined;
+                buf[0] = protocol.CONTROL;
+                buf[1] = @intFromEnum(protocol.Kind.expired);
+                var len: usize = 2;
+
+                var end = start;
+                while (end < expired.len and expired[end].host == expired[start].host) : (end += 1) {
+                    const entry = expired[end];
+                    host.history.expire(entry.slot, entry.id);
+                    host.ephemeral -= 1;
+                    std.mem.writeInt(u64, buf[len..][0..8], entry.id, .little);
+                    len += 8;
+                }
+                Writer.broadcastMessageIo(self.io, host.memberSockets(), buf[0..len], null);
+                start = end;
+            }
+            if (expired.len < due.len) break;
+        }
+    }
+
+    fn byHost(_: void, a: ExpiryIndex.Entry, b: ExpiryIndex.Entry) bool {
+        return a.host < b.host;
+    }
+
+    /// One small control frame answers every refusal from a read.
+    fn sendRejected(self: *Server, socket: posix.socket_t, notice: protocol.Rejected) void {
+        var buf: [2 + protocol.Rejected.SIZE]u8 = undefined;
+        const frame = notice.encode(&buf) catch unreachable;
+        Writer.writeToSocketIo(self.io, socket, frame) catch |err| {
+            self.logLimited("Failed to send rejection notice: {}", .{err}, .warn);
+        };
+    }
+
+    /// Sends already framed bytes from client `idx` to the rest of its room.
+    fn broadcast(self: *Server, monitor: *LoopMonitor, idx: usize, wire: []const u8) void {
+        if (wire.len == 0) return;
+
+        const since = monitor.mark();
+        const broadcast_span = trace.span("broadcast");
+        const client = &self.clients[idx];
+        defer {
+            broadcast_span.end();
+            client.stats.broadcast_ns += monitor.charge(.broadcast, since);
+        }
+
+        const host_idx = client.host.?;
+        const host = &self.hosts.items[host_idx];
+        for (self.clients[0..self.connected], 0..) |*peer, j| {
+            if (j != idx and peer.host != null and peer.host.? == host_idx) peer.stats.bytes_out += wire.len;
+        }
+        client.stats.write_calls += host.members - 1;
+        Writer.broadcastFramesIo(self.io, host.memberSockets(), wire, client.socket);
+    }
+
+    /// Acts on a control frame from client `idx`. Unknown kinds are ignored
+    /// so newer clients can talk to older servers. Returns false if the
+    /// client was removed.
+    fn handleControl(self: *Server, idx: usize, frame: []const u8) bool {
+        switch (protocol.kind(frame) orelse return true) {
+            .hello => {
+                const hello = protocol.Hello.decode(protocol.body(frame));
+                const name = hello.host;
+                self.clients[idx].acks = hello.flags.acks;
+                const socket = self.clients[idx].socket;
+                const host_idx = self.findHost(name) orelse {
+                    self.logLimited("Client asked for an unknown virtual host, closing connection", .{}, .warn);
+                    Writer.writeToSocketIo(self.io, socket, "[Server] Unknown host") catch {};
+                    self.removeClient(idx);
+                    return false;
+                };
+                self.join(idx, host_idx) catch |err| {
+                    switch (err) {
+                        error.HostFull => {
+                            self.logLimited("Virtual host {s} is full, closing connection", .{name}, .warn);
+                            Writer.writeToSocketIo(self.io, socket, "[Server] Host is full") catch {};
+                        },
+                        error.Stalled => self.logLimited("Client is not reading its room history, closing connection", .{}, .warn),
+                    }
+                    self.removeClient(idx);
+                    return false;
+                };
+            },
+            _ => {},
+        }
+        return true;
+    }
+
+    /// Asks `start` to return after its current iteration. Safe to call
+    /// from another thread.
+    pub fn stop(self: *Server) void {
+        @atomicStore(bool, &self.running, false, .release);
+    }
+
+    /// The listening port once `start` has bound it, or 0 before that.
+    pub fn boundPort(self: *const Server) u16 {
+        return @atomicLoad(u16, &self.bound_port, .acquire);
     }
 
     fn runTui(tui: *ServerTui) void {
@@ -224,47 +874,298 @@ pub const Server = struct {
     fn acceptClients(self: *Server, listener: posix.socket_t) !void {
         while (true) {
             var client_address: net.Address = undefined;
-            var client_address_len: posix.socklen_t = @sizeOf(net.Address);
-
-            const socket = posix.accept(listener, &client_address.any, &client_address_len, posix.SOCK.NONBLOCK) catch |err| switch (err) {
+            const socket = self.io.accept(listener, &client_address) catch |err| switch (err) {
                 error.WouldBlock => return,
                 else => return err,
             };
 
-            if (self.connected >= self.max_clients) {
-                self.log("Max clients reached, rejecting connection", .{}, .warn);
-                posix.close(socket);
+            // Each connection costs a reader buffer that nothing can take
+            // back short of closing it, so past the soft limit the cheapest
+            // shedding is not to take on more.
+            if (self.budget.pressure() != .none) {
+                _ = self.budget.refused.fetchAdd(1, .monotonic);
+                self.logLimited("Memory above soft limit ({d} bytes), refusing connection", .{self.budget.sheddable()}, .warn);
+                self.io.close(socket);
                 continue;
             }
 
-            const client = ClientConnection.init(self.allocator, socket, client_address) catch |err| {
-                self.log("Failed to initialize client: {}", .{err}, .err);
-                posix.close(socket);
-                continue;
+            self.addClient(socket, client_address) catch |err| switch (err) {
+                error.ServerFull => {
+                    self.logLimited("Max clients reached, rejecting connection", .{}, .warn);
+                    self.io.close(socket);
+                },
+                else => {
+                    self.log("Failed to initialize client: {}", .{err}, .err);
+                    self.io.close(socket);
+                },
             };
+        }
+    }
 
-            const idx = self.connected;
-            self.clients[idx] = client;
-            self.client_polls[idx] = .{
-                .fd = socket,
-                .revents = 0,
-                .events = posix.POLL.IN,
-            };
-            self.connected += 1;
+    /// Registers an already connected, non-blocking socket as a client.
+    /// Without named hosts it joins the default room and gets the welcome
+    /// line right away; otherwise that waits for its first frame. The
+    /// socket is closed by the server once added; on error it stays with
+    /// the caller.
+    fn addClient(self: *Server, socket: posix.socket_t, address: net.Address) !void {
+        if (self.connected >= self.max_clients) {
+            return error.ServerFull;
+        }
 
-            self.log("Client connected (total: {})", .{self.connected}, .info);
+        const client = try ClientConnection.init(self.budget, self.next_conn_id, socket, address);
+        self.next_conn_id +%= 1;
 
-            const welcome = "[Server] Thanks for joining!";
-            Writer.writeToSocket(socket, welcome) catch |err| {
-                self.log("Failed to send welcome: {}", .{err}, .warn);
-            };
+        const idx = self.connected;
+        self.clients[idx] = client;
+        self.client_polls[idx] = .{
+            .fd = socket,
+            .revents = 0,
+            .events = posix.POLL.IN,
+        };
+        self.connected += 1;
+        metrics_mod.bump(&self.metrics.accepts, 1);
+        instrument.count("server.accepts", 1);
+        flight_recorder.record(.accept, @intCast(socket), self.connected);
+
+        self.log("Client connected (total: {})", .{self.connected}, .info);
+        if (self.capture) |capture| {
+            capture.connect(client.id) catch |err| self.stopCapture(err);
+        }
+
+        if (self.hosts.items.len == 1) self.joinDefault(idx) catch {
+            self.logLimited("Client is not reading its room history, closing connection", .{}, .warn);
+            self.removeClient(idx);
+        };
+    }
+
+    /// Sets the history and default ingress limits of every room and adds
+    /// the named virtual hosts, whose specs may override the limits. Call
+    /// before `start`. Named hosts are capped at the server's own size.
+    pub fn configureHosts(self: *Server, specs: []const vhost.Spec, history_frames: usize, policy: vhost.Policy) !void {
+        std.debug.assert(self.connected == 0);
+        const tables = self.budget.allocator(.tables);
+
+        const history = try History.init(tables, history_frames);
+        self.hosts.items[0].history.deinit(tables);
+        self.hosts.items[0].history = history;
+        self.hosts.items[0].setPolicy(policy);
+
+        for (specs) |spec| {
+            if (self.findHost(spec.name) != null) return error.DuplicateHost;
+            const max_clients = @min(spec.max_clients orelse self.max_clients, self.max_clients);
+            var host = try Host.init(tables, spec.name, max_clients, history_frames, spec.policy(policy));
+            errdefer host.deinit(tables);
+            try self.hosts.append(tables, host);
+        }
+    }
+
+    /// Hosts are few and only looked up on hello, so a scan is enough.
+    fn findHost(self: *const Server, name: []const u8) ?usize {
+        for (self.hosts.items, 0..) |*host, idx| {
+            if (std.mem.eql(u8, host.name(), name)) return idx;
+        }
+        return null;
+    }
+
+    /// Moves client `idx` into room `host_idx` and sends it the welcome
+    /// line and the room's history. A client stays where it was if the
+    /// room is full; one whose history could not be sent should be removed.
+    fn join(self: *Server, idx: usize, host_idx: usize) error{ HostFull, Stalled }!void {
+        const client = &self.clients[idx];
+        if (client.host != null and client.host.? == host_idx) return;
+
+        const host = &self.hosts.items[host_idx];
+        try host.add(client.socket);
+        self.leave(idx);
+        client.host = host_idx;
+
+        var buf: [64]u8 = undefined;
+        const welcome = if (host.name_len == 0)
+            "[Server] Thanks for joining!"
+        else
+            std.fmt.bufPrint(&buf, "[Server] Thanks for joining {s}!", .{host.name()}) catch unreachable;
+        try self.sendJoin(idx, welcome, &host.history);
+
+        if (host.name_len > 0) {
+            self.log("Client joined {s} ({d}/{d})", .{ host.name(), host.members, host.max_clients }, .info);
+        }
+    }
+
+    /// Sends client `idx` the welcome line, the newest `REPLAY_BYTES` of its
+    /// room's history and `history_end`, in one write if the socket takes
+    /// it. If it takes only part, the frame it stopped in is finished and
+    /// `history_end` follows, waiting up to `REPLAY_WAIT_MS`, and the rest
+    /// of the history is left out. Fails if the socket will not take even
+    /// that, as its stream would stop mid-frame.
+    fn sendJoin(self: *Server, idx: usize, welcome: []const u8, history: *History) error{Stalled}!void {
+        const client = &self.clients[idx];
+        var iov: [History.MAX_FRAMES + 4]posix.iovec_const = undefined;
+        var ends: [History.MAX_FRAMES]usize = undefined;
+        history.stampRemaining(self.io.milliTimestamp());
+        const replay = history.gather(iov[2..][0 .. History.MAX_FRAMES + 1], &ends, REPLAY_BYTES);
+
+        var welcome_len: [4]u8 = undefined;
+        std.mem.writeInt(u32, &welcome_len, @intCast(welcome.len), .little);
+        iov[0] = .{ .base = &welcome_len, .len = welcome_len.len };
+        iov[1] = .{ .base = welcome.ptr, .len = welcome.len };
+        var end_frame: [6]u8 = undefined;
+        std.mem.writeInt(u32, end_frame[0..4], 2, .little);
+        _ = protocol.encodeControl(end_frame[4..], .history_end, "") catch unreachable;
+        const runs = 2 + replay.runs.len;
+        iov[runs] = .{ .base = &end_frame, .len = end_frame.len };
+
+        const history_start = welcome_len.len + welcome.len;
+        const history_end = history_start + replay.bytes();
+        const total = history_end + end_frame.len;
+        const written = self.io.writev(client.socket, iov[0 .. runs + 1]) catch |err| switch (err) {
+            error.WouldBlock => 0,
+            else => {
+                self.logLimited("Failed to send welcome: {}", .{err}, .warn);
+                return;
+            },
+        };
+        client.stats.bytes_out += written;
+        if (written == total) return;
+
+        const frame_end = if (written < history_start)
+            history_start
+        else if (written < history_end)
+            history_start + replay.frameEnd(written - history_start)
+        else
+            total;
+        const deadline_ms = self.io.milliTimestamp() + REPLAY_WAIT_MS;
+        const rest = Writer.takeBytes(Writer.skipBytes(iov[0 .. runs + 1], written), frame_end - written);
+        const n = Writer.writevAllIo(self.io, client.socket, rest, deadline_ms);
+        client.stats.bytes_out += n;
+        if (written + n < frame_end) return error.Stalled;
+        if (frame_end == total) return;
+
+        var end_iov = [_]posix.iovec_const{.{ .base = &end_frame, .len = end_frame.len }};
+        const end_n = Writer.writevAllIo(self.io, client.socket, &end_iov, deadline_ms);
+        client.stats.bytes_out += end_n;
+        if (end_n < end_frame.len) return error.Stalled;
+        self.logLimited("Room history cut short to fit the socket buffer ({d} of {d} bytes)", .{
+            frame_end - history_start,
+            replay.bytes(),
+        }, .warn);
+    }
+
+    /// The default room is as large as the server, so it is never full.
+    fn joinDefault(self: *Server, idx: usize) error{Stalled}!void {
+        self.join(idx, 0) catch |err| switch (err) {
+            error.HostFull => unreachable,
+            error.Stalled => return error.Stalled,
+        };
+    }
+
+    fn leave(self: *Server, idx: usize) void {
+        const client = &self.clients[idx];
+        const host_idx = client.host orelse return;
+        self.hosts.items[host_idx].remove(client.socket);
+        client.host = null;
+    }
+
+    /// Relays one batch of the frames already buffered for each connection
+    /// paused over its quota, without reading more. Once at most a partial
+    /// frame is left, reads resume.
+    fn drainOverQuota(self: *Server, monitor: *LoopMonitor) void {
+        if (self.over_quota == 0) return;
+
+        var idx: usize = 0;
+        while (idx < self.connected) {
+            const client = &self.clients[idx];
+            if (!client.over_quota) {
+                idx += 1;
+                continue;
+            }
+
+            var frames: [READ_BATCH][]const u8 = undefined;
+            const batch = client.reader.bufferedBatch(&frames);
+            if (batch.frames.len == 0) {
+                self.clearOverQuota(idx);
+                if (self.budget.pressure() == .none) self.setPaused(idx, false);
+                idx += 1;
+                continue;
+            }
+            client.stats.frames += batch.frames.len;
+            if (self.relayBatch(monitor, idx, batch)) idx += 1;
         }
     }
 
+    fn clearOverQuota(self: *Server, idx: usize) void {
+        if (!self.clients[idx].over_quota) return;
+        self.clients[idx].over_quota = false;
+        self.over_quota -= 1;
+    }
+
+    /// Applies memory pressure one connection per iteration: above the soft
+    /// limit the heaviest connection stops being read, above the hard limit
+    /// it is disconnected. Paused connections resume once usage drops well
+    /// below the soft limit.
+    /// Above the hard limit the heaviest connection is evicted, one per
+    /// loop iteration. The soft limit is enforced when accepting.
+    fn shedLoad(self: *Server) void {
+        if (self.budget.pressure() != .hard) return;
+
+        const idx = self.heaviestClient() orelse return;
+        _ = self.budget.evicted.fetchAdd(1, .monotonic);
+        self.logLimited("Memory above hard limit ({d} bytes), evicting heaviest connection", .{self.budget.sheddable()}, .err);
+        self.removeClient(idx);
+    }
+
+    fn heaviestClient(self: *const Server) ?usize {
+        var best: ?usize = null;
+        var best_weight: usize = 0;
+        for (self.clients[0..self.connected], 0..) |*client, idx| {
+            const w = client.weight();
+            if (best == null or w > best_weight) {
+                best = idx;
+                best_weight = w;
+            }
+        }
+        return best;
+    }
+
+    fn setPaused(self: *Server, idx: usize, paused: bool) void {
+        const client = &self.clients[idx];
+        if (client.paused == paused) return;
+
+        client.paused = paused;
+        self.client_polls[idx].events = if (paused) 0 else posix.POLL.IN;
+        if (paused) {
+            _ = self.budget.paused.fetchAdd(1, .monotonic);
+        } else {
+            _ = self.budget.paused.fetchSub(1, .monotonic);
+        }
+    }
+
+    /// A failed capture write leaves a truncated record behind, so the rest
+    /// of the session is not recorded. The owner still closes the file.
+    fn stopCapture(self: *Server, err: anyerror) void {
+        flight_recorder.recordError(err);
+        self.log("Traffic capture failed, capture stopped: {}", .{err}, .err);
+        self.capture = null;
+    }
+
+    fn foldStats(self: *Server, client: *ClientConnection) void {
+        const delta = client.takeDelta();
+        self.accounting.fold(client.address.in.sa.addr, client.getUsername(), delta) catch |err| {
+            self.logLimited("Failed to record connection stats: {}", .{err}, .warn);
+        };
+    }
+
     fn removeClient(self: *Server, idx: usize) void {
+        self.foldStats(&self.clients[idx]);
+        self.leave(idx);
+
         var client = self.clients[idx];
-        posix.close(client.socket);
-        client.deinit(self.allocator);
+        self.io.close(client.socket);
+        if (self.capture) |capture| {
+            capture.disconnect(client.id) catch |err| self.stopCapture(err);
+        }
+        self.clearOverQuota(idx);
+        if (client.paused) self.setPaused(idx, false);
+        client.deinit(self.budget);
 
         const last_idx = self.connected - 1;
         if (idx != last_idx) {
@@ -273,6 +1174,535 @@ pub const Server = struct {
         }
 
         self.connected = last_idx;
+        flight_recorder.record(.disconnect, @intCast(client.socket), self.connected);
         self.log("Client removed (total: {})", .{self.connected}, .info);
     }
 };
+
+/// Forwards to `parent`, except that once `armed` every request for more
+/// memory fails and is counted. Frees always go through.
+const TestAllocationGate = struct {
+    parent: Allocator,
+    armed: bool = false,
+    refused: usize = 0,
+
+    fn allocator(self: *TestAllocationGate) Allocator {
+        return .{ .ptr = self, .vtable = &.{
+            .alloc = alloc,
+            .resize = resize,
+            .remap = remap,
+            .free = free,
+        } };
+    }
+
+    fn refuse(self: *TestAllocationGate) bool {
+        if (self.armed) self.refused += 1;
+        return self.armed;
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, alignment: std.mem.Alignment, ret_addr: usize) ?[*]u8 {
+        const self: *TestAllocationGate = @ptrCast(@alignCast(ctx));
+        if (self.refuse()) return null;
+        return self.parent.rawAlloc(len, alignment, ret_addr);
+    }
+
+    fn resize(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) bool {
+        const self: *TestAllocationGate = @ptrCast(@alignCast(ctx));
+        if (new_len > memory.len and self.refuse()) return false;
+        return self.parent.rawResize(memory, alignment, new_len, ret_addr);
+    }
+
+    fn remap(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+        const self: *TestAllocationGate = @ptrCast(@alignCast(ctx));
+        if (new_len > memory.len and self.refuse()) return null;
+        return self.parent.rawRemap(memory, alignment, new_len, ret_addr);
+    }
+
+    fn free(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, ret_addr: usize) void {
+        const self: *TestAllocationGate = @ptrCast(@alignCast(ctx));
+        self.parent.rawFree(memory, alignment, ret_addr);
+    }
+};
+
+fn testSocketPair() ![2]posix.socket_t {
+    const linux = std.os.linux;
+    var fds: [2]i32 = undefined;
+    const rc = linux.socketpair(linux.AF.UNIX, linux.SOCK.STREAM | linux.SOCK.NONBLOCK | linux.SOCK.CLOEXEC, 0, &fds);
+    if (linux.E.init(rc) != .SUCCESS) return error.SocketPairFailed;
+    return fds;
+}
+
+/// Adds one end of a fresh socket pair to `server` as a client and returns
+/// the other, the peer's end, for the caller to close.
+fn testAddPeer(server: *Server) !posix.socket_t {
+    const pair = try testSocketPair();
+    server.addClient(pair[0], try net.Address.parseIp4("127.0.0.1", 0)) catch |err| {
+        posix.close(pair[0]);
+        posix.close(pair[1]);
+        return err;
+    };
+    return pair[1];
+}
+
+/// Fills `peers` with `testAddPeer`; on error, closes the ones added.
+fn testAddPeers(server: *Server, peers: []posix.socket_t) !void {
+    for (peers, 0..) |*peer, i| {
+        peer.* = testAddPeer(server) catch |err| {
+            for (peers[0..i]) |added| posix.close(added);
+            return err;
+        };
+    }
+}
+
+/// The system's sockets with a clock the test moves, so deadlines pass
+/// without sleeping.
+const TestClock = struct {
+    now_ms: i64,
+
+    fn io(self: *TestClock) Io {
+        return .{ .ptr = self, .vtable = &vtable };
+    }
+
+    const vtable: Io.VTable = blk: {
+        var v = Io.system.vtable.*;
+        v.milliTimestamp = milliTimestamp;
+        break :blk v;
+    };
+
+    fn milliTimestamp(ptr: ?*anyopaque) i64 {
+        const self: *TestClock = @ptrCast(@alignCast(ptr.?));
+        return self.now_ms;
+    }
+};
+
+/// Reads everything currently queued on a non-blocking socket.
+fn testDrain(socket: posix.socket_t) !usize {
+    var buf: [4096]u8 = undefined;
+    var total: usize = 0;
+    while (true) {
+        const n = posix.read(socket, &buf) catch |err| switch (err) {
+            error.WouldBlock => return total,
+            else => return err,
+        };
+        if (n == 0) return error.Closed;
+        total += n;
+    }
+}
+
+test "relaying messages allocates nothing once warmed up" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+    const peer_count = 4;
+    const warmup_messages = 1_000;
+    const measured_messages = 100_000;
+
+    // Every allocator the server holds, from its own to the budget pools
+    // behind the readers and tables, draws from the gate.
+    var gate: TestAllocationGate = .{ .parent = testing.allocator };
+    var server = try Server.init(gate.allocator(), try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+
+    var peers: [peer_count]posix.socket_t = undefined;
+    try testAddPeers(&server, &peers);
+    defer for (peers) |peer| posix.close(peer);
+
+    for (peers) |peer| _ = try testDrain(peer);
+
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    const frame_len = "peer: hello".len + 4;
+
+    const pump = struct {
+        fn run(srv: *Server, mon: *LoopMonitor, socks: []const posix.socket_t, count: usize) !usize {
+            var received: usize = 0;
+            for (0..count) |n| {
+                try Writer.writeToSocket(socks[n % socks.len], "peer: hello");
+                srv.tick(mon, 0);
+                for (socks) |sock| received += try testDrain(sock);
+            }
+            return received;
+        }
+    }.run;
+
+    const warm = try pump(&server, &monitor, &peers, warmup_messages);
+    try testing.expectEqual(warmup_messages * (peer_count - 1) * frame_len, warm);
+
+    // Close a stats window so per-IP and per-user totals already exist.
+    server.relayed.window_start = 0;
+    server.flushWindowStats();
+
+    // From here on, any allocation or growth by the server fails and is
+    // counted.
+    gate.armed = true;
+    defer gate.armed = false;
+
+    const relayed = try pump(&server, &monitor, &peers, measured_messages);
+
+    try testing.expectEqual(@as(usize, 0), gate.refused);
+    try testing.expectEqual(measured_messages * (peer_count - 1) * frame_len, relayed);
+    try testing.expectEqual(@as(usize, peer_count), server.connected);
+}
+
+test "virtual hosts relay and replay history only within their room" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{ .{ .name = "red" }, .{ .name = "blue" } }, 4, .{});
+
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    var hello_buf: [64]u8 = undefined;
+
+    const connect = struct {
+        fn run(srv: *Server, buf: []u8, room: []const u8) !posix.socket_t {
+            const peer = try testAddPeer(srv);
+            errdefer posix.close(peer);
+            try Writer.writeToSocket(peer, try protocol.hello(buf, room));
+            return peer;
+        }
+    }.run;
+
+    const rooms = [_][]const u8{ "red", "red", "blue" };
+    var peers: [rooms.len]posix.socket_t = undefined;
+    var opened: usize = 0;
+    defer for (peers[0..opened]) |peer| posix.close(peer);
+    for (rooms) |room| {
+        peers[opened] = try connect(&server, &hello_buf, room);
+        opened += 1;
+    }
+    server.tick(&monitor, 0);
+    for (peers) |peer| _ = try testDrain(peer);
+
+    try Writer.writeToSocket(peers[0], "alice: hi red");
+    server.tick(&monitor, 0);
+    try testing.expectEqual(@as(usize, "alice: hi red".len + 4), try testDrain(peers[1]));
+    try testing.expectEqual(@as(usize, 0), try testDrain(peers[2]));
+    try testing.expectEqual(@as(usize, 0), try testDrain(peers[0]));
+
+    // A late joiner gets the welcome line, then the room's history, then
+    // the mark that the replay is over.
+    const late = try connect(&server, &hello_buf, "red");
+    defer posix.close(late);
+    server.tick(&monitor, 0);
+
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+    try testing.expectEqualStrings("[Server] Thanks for joining red!", (try reader.readMessage(late)).?);
+    try testing.expectEqualStrings("alice: hi red", (try reader.readMessage(late)).?);
+    try testing.expectEqual(protocol.Kind.history_end, protocol.kind((try reader.readMessage(late)).?).?);
+
+    // An unknown host is refused and the connection closed.
+    const stray = try connect(&server, &hello_buf, "green");
+    defer posix.close(stray);
+    server.tick(&monitor, 0);
+    try testing.expectError(error.Closed, testDrain(stray));
+    try testing.expectEqual(@as(usize, rooms.len + 1), server.connected);
+}
+
+test "slow mode relays the first message and answers the rest with one notice" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{}, 0, .{ .slow_ms = 60 * std.time.ms_per_s });
+
+    var peers: [2]posix.socket_t = undefined;
+    try testAddPeers(&server, &peers);
+    defer for (peers) |peer| posix.close(peer);
+    for (peers) |peer| _ = try testDrain(peer);
+
+    for ([_][]const u8{ "ann: one", "ann: two", "ann: three" }) |msg| {
+        try Writer.writeToSocket(peers[0], msg);
+    }
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+
+    try testing.expectEqual(@as(usize, "ann: one".len + 4), try testDrain(peers[1]));
+
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+    const frame = (try reader.readMessage(peers[0])).?;
+    try testing.expectEqual(protocol.Kind.rejected, protocol.kind(frame).?);
+    const notice = protocol.Rejected.decode(protocol.body(frame)).?;
+    try testing.expectEqual(protocol.Reason.slow_mode, notice.reason);
+    try testing.expectEqual(@as(u16, 2), notice.count);
+    try testing.expectEqual(@as(usize, 0), try testDrain(peers[0]));
+}
+
+test "slow mode follows a user across connections" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{}, 0, .{ .slow_ms = 60 * std.time.ms_per_s });
+
+    var peers: [3]posix.socket_t = undefined;
+    try testAddPeers(&server, &peers);
+    defer for (peers) |peer| posix.close(peer);
+    for (peers) |peer| _ = try testDrain(peer);
+
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    try Writer.writeToSocket(peers[0], "ann: one");
+    server.tick(&monitor, 0);
+    for (peers[1..]) |peer| {
+        try testing.expectEqual(@as(usize, "ann: one".len + 4), try testDrain(peer));
+    }
+
+    // The same user on a second connection waits out the first post.
+    try Writer.writeToSocket(peers[1], "ann: two");
+    server.tick(&monitor, 0);
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+    const frame = (try reader.readMessage(peers[1])).?;
+    try testing.expectEqual(protocol.Kind.rejected, protocol.kind(frame).?);
+    try testing.expectEqual(protocol.Reason.slow_mode, protocol.Rejected.decode(protocol.body(frame)).?.reason);
+
+    // Another user is not held back.
+    try Writer.writeToSocket(peers[2], "bob: hi");
+    server.tick(&monitor, 0);
+    try testing.expectEqual(@as(usize, "bob: hi".len + 4), try testDrain(peers[1]));
+    try testing.expectEqual(@as(usize, 0), try testDrain(peers[2]));
+}
+
+test "a connection over its quota pauses until its backlog is relayed" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    // The quota is the only limit set.
+    server.budget.limits = .{ .connection_bytes = 64 };
+
+    var peers: [2]posix.socket_t = undefined;
+    try testAddPeers(&server, &peers);
+    defer for (peers) |peer| posix.close(peer);
+    for (peers) |peer| _ = try testDrain(peer);
+
+    // More frames than one batch, all arriving in a single read.
+    const frames = READ_BATCH + 18;
+    for (0..frames) |_| try Writer.writeToSocket(peers[0], "bob: x");
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+
+    try testing.expect(server.clients[0].paused);
+    try testing.expectEqual(@as(usize, frames * ("bob: x".len + 4)), try testDrain(peers[1]));
+
+    server.tick(&monitor, 0);
+    try testing.expect(!server.clients[0].paused);
+    try testing.expectEqual(@as(usize, 0), server.over_quota);
+
+    // Reads are live again.
+    try Writer.writeToSocket(peers[0], "bob: y");
+    server.tick(&monitor, 0);
+    try testing.expectEqual(@as(usize, "bob: y".len + 4), try testDrain(peers[1]));
+}
+
+test "a connection's reader buffer is charged to the connections pool, mapped or not" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+
+    const peer = try testAddPeer(&server);
+    defer posix.close(peer);
+    try testing.expect(server.budget.poolBytes(.connections) >= server.clients[0].reader.capacity());
+
+    server.removeClient(0);
+    try testing.expectEqual(@as(usize, 0), server.budget.poolBytes(.connections));
+}
+
+test "acks are cumulative and sent once per read to clients that ask" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+
+    var peers: [2]posix.socket_t = undefined;
+    try testAddPeers(&server, &peers);
+    defer for (peers) |peer| posix.close(peer);
+
+    var buf: [8]u8 = undefined;
+    const hello: protocol.Hello = .{ .host = "", .flags = .{ .acks = true } };
+    try Writer.writeToSocket(peers[0], try hello.encode(&buf));
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+    for (peers) |peer| _ = try testDrain(peer);
+
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+    var total: u32 = 0;
+    for ([_]u32{ 3, 2 }) |batch| {
+        for (0..batch) |_| try Writer.writeToSocket(peers[0], "amy: hi");
+        total += batch;
+        server.tick(&monitor, 0);
+
+        // One ack for the whole read, counting from the first frame.
+        const frame = (try reader.readMessage(peers[0])).?;
+        try testing.expectEqual(protocol.Kind.ack, protocol.kind(frame).?);
+        try testing.expectEqual(@as(?u32, total), protocol.decodeAck(protocol.body(frame)));
+        try testing.expectEqual(@as(usize, 0), try testDrain(peers[0]));
+    }
+
+    // The other client never asked, so it only sees the chat.
+    try testing.expectEqual(@as(usize, 5 * ("amy: hi".len + 4)), try testDrain(peers[1]));
+}
+
+test "lines refused under slow mode are named in the notice and left out of the ack" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{}, 0, .{ .slow_ms = 60 * std.time.ms_per_s });
+
+    const peer = try testAddPeer(&server);
+    defer posix.close(peer);
+
+    var buf: [8]u8 = undefined;
+    const hello: protocol.Hello = .{ .host = "", .flags = .{ .acks = true } };
+    try Writer.writeToSocket(peer, try hello.encode(&buf));
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+    _ = try testDrain(peer);
+
+    for ([_][]const u8{ "ann: one", "ann: two", "ann: three" }) |msg| {
+        try Writer.writeToSocket(peer, msg);
+    }
+    server.tick(&monitor, 0);
+
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+
+    // The notice names the refused lines before the ack counts past them.
+    const rejected = (try reader.readMessage(peer)).?;
+    try testing.expectEqual(protocol.Kind.rejected, protocol.kind(rejected).?);
+    const notice = protocol.Rejected.decode(protocol.body(rejected)).?;
+    try testing.expectEqual(@as(u32, 2), notice.first_seq);
+    try testing.expectEqual(@as(u16, 2), notice.seq_count);
+
+    const ack = (try reader.readMessage(peer)).?;
+    try testing.expectEqual(protocol.Kind.ack, protocol.kind(ack).?);
+    try testing.expectEqual(@as(?u32, 3), protocol.decodeAck(protocol.body(ack)));
+    try testing.expectEqual(@as(usize, 0), try testDrain(peer));
+}
+
+test "ephemeral messages expire from history with one notice per room" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{}, 4, .{});
+
+    var clock: TestClock = .{ .now_ms = std.time.milliTimestamp() };
+    server.io = clock.io();
+
+    var peers: [3]posix.socket_t = undefined;
+    var opened: usize = 0;
+    defer for (peers[0..opened]) |peer| posix.close(peer);
+    for (0..2) |_| {
+        peers[opened] = try testAddPeer(&server);
+        opened += 1;
+    }
+    for (peers[0..opened]) |peer| _ = try testDrain(peer);
+
+    var buf: [64]u8 = undefined;
+    for ([_][]const u8{ "eve: one", "eve: two" }) |text| {
+        try Writer.writeToSocket(peers[0], try protocol.Ephemeral.encodePost(&buf, 1, text));
+    }
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+
+    // The sender gets its own messages back too, with their ids.
+    const relayed_len: usize = 2 * (4 + 2 + protocol.Ephemeral.HEADER) + "eve: one".len + "eve: two".len;
+    for (peers[0..opened]) |peer| try testing.expectEqual(relayed_len, try testDrain(peer));
+
+    clock.now_ms += 5;
+    server.tick(&monitor, 0);
+    try testing.expectEqual(@as(usize, 0), server.expiries.count());
+
+    for (peers[0..opened]) |peer| {
+        var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+        defer reader.deinit(testing.allocator);
+        const frame = (try reader.readMessage(peer)).?;
+        try testing.expectEqual(protocol.Kind.expired, protocol.kind(frame).?);
+        var ids = protocol.ExpiredIds.init(protocol.body(frame));
+        try testing.expectEqual(@as(?u64, 1), ids.next());
+        try testing.expectEqual(@as(?u64, 2), ids.next());
+        try testing.expectEqual(@as(?u64, null), ids.next());
+    }
+
+    // Nothing expired is replayed to a client joining later: it gets the
+    // welcome line and history_end.
+    peers[opened] = try testAddPeer(&server);
+    opened += 1;
+    try testing.expectEqual(@as(usize, "[Server] Thanks for joining!".len + 4 + 6), try testDrain(peers[2]));
+}
+
+test "only ephemeral messages held in history are indexed, and replays carry the time left" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+
+    var server = try Server.init(testing.allocator, try net.Address.parseIp4("127.0.0.1", 0), 8);
+    defer server.deinit();
+    server.headless = true;
+    try server.configureHosts(&.{}, 2, .{});
+
+    var clock: TestClock = .{ .now_ms = std.time.milliTimestamp() };
+    server.io = clock.io();
+
+    var peers: [2]posix.socket_t = undefined;
+    var opened: usize = 0;
+    defer for (peers[0..opened]) |peer| posix.close(peer);
+    peers[opened] = try testAddPeer(&server);
+    opened += 1;
+
+    var buf: [64]u8 = undefined;
+    for ([_][]const u8{ "eve: one", "eve: two", "eve: three" }) |text| {
+        try Writer.writeToSocket(peers[0], try protocol.Ephemeral.encodePost(&buf, 60_000, text));
+    }
+    var monitor = try LoopMonitor.init(&server.metrics.loop, stall_threshold_ns);
+    server.tick(&monitor, 0);
+
+    // The first one fell out of the two-frame history and was unindexed.
+    try testing.expectEqual(@as(usize, 2), server.expiries.count());
+    try Writer.writeToSocket(peers[0], "eve: plain");
+    server.tick(&monitor, 0);
+    try testing.expectEqual(@as(usize, 1), server.expiries.count());
+    try testing.expectEqual(@as(usize, 1), server.hosts.items[0].ephemeral);
+
+    clock.now_ms += 20;
+    peers[opened] = try testAddPeer(&server);
+    opened += 1;
+
+    var reader = try Reader.init(testing.allocator, BUFFER_SIZE);
+    defer reader.deinit(testing.allocator);
+    _ = (try reader.readMessage(peers[1])).?; // welcome
+    const frame = (try reader.readMessage(peers[1])).?;
+    const message = protocol.Ephemeral.decode(protocol.body(frame)).?;
+    try testing.expectEqualStrings("eve: three", message.text);
+    try testing.expectEqual(@as(u32, 60_000 - 20), message.ttl_ms);
+}
@@ -4,8 +4,16 @@ const posix = std.posix;
 const net = std.net;
 
 const config = @import("../config.zig");
+const flight_recorder = @import("../flight_recorder.zig");
+const trace = @import("../trace.zig");
 const utils = @import("../utils.zig");
 const components = @import("../tui/components.zig");
+const metrics_mod = @import("metrics.zig");
+const Metrics = metrics_mod.Metrics;
+const Offender = @import("accounting.zig").Offender;
+const MemoryBudget = @import("memory.zig").MemoryBudget;
+const log_sink = @import("log_sink.zig");
+const FileSink = log_sink.FileSink;
 
 const Cell = vaxis.Cell;
 const Key = vaxis.Key;
@@ -28,10 +36,11 @@ pub const LogEntry = struct {
     level: Level,
     allocator: std.mem.Allocator,
 
+    /// Ordered by severity so levels can be compared against a cutoff.
     pub const Level = enum {
-        info,
-        warn,
         err,
+        warn,
+        info,
         debug,
 
         pub fn toString(self: Level) []const u8 {
@@ -77,7 +86,9 @@ pub const ServerTui = struct {
 
     // Vaxis components
     vx: vaxis.Vaxis,
-    tty: vaxis.Tty,
+    /// Null when rendering offscreen; output then goes to `discard`.
+    tty: ?vaxis.Tty,
+    discard: std.Io.Writer.Discarding,
 
     // Server info
     ip: []const u8,
@@ -89,6 +100,18 @@ pub const ServerTui = struct {
     port_display_len: usize,
     conn_display: [32]u8,
     conn_display_len: usize,
+    loop_display: [96]u8,
+    top_ip_display: [160]u8,
+    top_user_display: [160]u8,
+    memory_display: [128]u8,
+    log_display: [64]u8,
+
+    metrics: *Metrics,
+    /// The sink feeding the log pane, for its dropped and failed counts.
+    sink: ?*const FileSink,
+    budget: *const MemoryBudget,
+    /// Allocator for queued log lines, accounted in the budget's log_queue pool.
+    queue_allocator: std.mem.Allocator,
 
     logs: ScrollableList(LogEntry),
     filter_input: InputField,
@@ -105,21 +128,57 @@ pub const ServerTui = struct {
         connected: *usize,
         max_clients: usize,
         running: *bool,
+        metrics: *Metrics,
+        budget: *MemoryBudget,
     ) !*ServerTui {
-        const self = try allocator.create(ServerTui);
-        errdefer allocator.destroy(self);
-
         var tty_buf: [1024]u8 = undefined;
         var tty = try vaxis.Tty.init(&tty_buf);
         errdefer tty.deinit();
 
-        var vx = try vaxis.Vaxis.init(allocator, .{});
-        errdefer vx.deinit(allocator, tty.writer());
+        return create(allocator, tty, ip, port, connected, max_clients, running, metrics, budget);
+    }
+
+    /// A TUI with no terminal, drawing into a screen of the given size.
+    /// Used by the render benchmark.
+    pub fn initOffscreen(
+        allocator: std.mem.Allocator,
+        ip: []const u8,
+        port: *u16,
+        connected: *usize,
+        max_clients: usize,
+        running: *bool,
+        metrics: *Metrics,
+        budget: *MemoryBudget,
+        winsize: vaxis.Winsize,
+    ) !*ServerTui {
+        const self = try create(allocator, null, ip, port, connected, max_clients, running, metrics, budget);
+        errdefer self.deinit();
+
+        try self.vx.resize(allocator, self.output(), winsize);
+        return self;
+    }
+
+    fn create(
+        allocator: std.mem.Allocator,
+        tty: ?vaxis.Tty,
+        ip: []const u8,
+        port: *u16,
+        connected: *usize,
+        max_clients: usize,
+        running: *bool,
+        metrics: *Metrics,
+        budget: *MemoryBudget,
+    ) !*ServerTui {
+        const self = try allocator.create(ServerTui);
+        errdefer allocator.destroy(self);
+
+        const vx = try vaxis.Vaxis.init(allocator, .{});
 
         self.* = .{
             .allocator = allocator,
             .vx = vx,
             .tty = tty,
+            .discard = .init(&.{}),
             .ip = ip,
             .port = port,
             .connected = connected,
@@ -128,6 +187,15 @@ pub const ServerTui = struct {
             .port_display_len = 0,
             .conn_display = undefined,
             .conn_display_len = 0,
+            .loop_display = undefined,
+            .top_ip_display = undefined,
+            .top_user_display = undefined,
+            .memory_display = undefined,
+            .log_display = undefined,
+            .sink = null,
+            .budget = budget,
+            .queue_allocator = budget.allocator(.log_queue),
+            .metrics = metrics,
             .logs = ScrollableList(LogEntry).init(allocator),
             .filter_input = InputField.init(allocator),
             .running = running,
@@ -148,21 +216,24 @@ pub const ServerTui = struct {
 
         self.log_mutex.lock();
         for (self.pending_logs.items) |item| {
-            self.allocator.free(item.msg);
+            self.queue_allocator.free(item.msg);
         }
-        self.pending_logs.deinit(self.allocator);
+        self.pending_logs.deinit(self.queue_allocator);
         self.log_mutex.unlock();
 
         self.filter_input.deinit();
-        self.vx.deinit(self.allocator, self.tty.writer());
-        self.tty.deinit();
+        self.vx.deinit(self.allocator, self.output());
+        if (self.tty) |*tty| tty.deinit();
 
         self.allocator.destroy(self);
     }
 
     pub fn run(self: *ServerTui) !void {
+        flight_recorder.registerThread("tui");
+        trace.registerThread("server-tui");
+
         var loop: vaxis.Loop(Event) = .{
-            .tty = &self.tty,
+            .tty = &self.tty.?,
             .vaxis = &self.vx,
         };
         try loop.init();
@@ -170,8 +241,8 @@ pub const ServerTui = struct {
         try loop.start();
         defer loop.stop();
 
-        try self.vx.enterAltScreen(self.tty.writer());
-        try self.vx.queryTerminal(self.tty.writer(), 1 * std.time.ns_per_s);
+        try self.vx.enterAltScreen(self.output());
+        try self.vx.queryTerminal(self.output(), 1 * std.time.ns_per_s);
 
         try self.addLog("Server TUI started", .info);
 
@@ -188,24 +259,37 @@ pub const ServerTui = struct {
         }
     }
 
+    /// Called on the log sink's thread with each formatted line.
+    pub fn logListener(self: *ServerTui) log_sink.Listener {
+        return .{ .ctx = self, .onLine = onLogLine };
+    }
+
+    fn onLogLine(ctx: *anyopaque, level: LogEntry.Level, line: []const u8) void {
+        const self: *ServerTui = @ptrCast(@alignCast(ctx));
+        self.queueLog(line, level);
+    }
+
     pub fn queueLog(self: *ServerTui, message: []const u8, level: LogEntry.Level) void {
-        const owned = self.allocator.dupe(u8, message) catch return;
+        const owned = self.queue_allocator.dupe(u8, message) catch return;
 
         self.log_mutex.lock();
         defer self.log_mutex.unlock();
 
-        self.pending_logs.append(self.allocator, .{ .msg = owned, .level = level }) catch {
-            self.allocator.free(owned);
+        self.pending_logs.append(self.queue_allocator, .{ .msg = owned, .level = level }) catch {
+            self.queue_allocator.free(owned);
         };
     }
 
     fn processPendingLogs(self: *ServerTui) void {
+        const span = trace.span("processPendingLogs");
+        defer span.end();
+
         self.log_mutex.lock();
         defer self.log_mutex.unlock();
 
         for (self.pending_logs.items) |item| {
             self.addLog(item.msg, item.level) catch {};
-            self.allocator.free(item.msg);
+            self.queue_allocator.free(item.msg);
         }
         self.pending_logs.clearRetainingCapacity();
     }
@@ -241,20 +325,33 @@ pub const ServerTui = struct {
                 try self.filter_input.handleKeyPress(key);
             },
             .winsize => |ws| {
-                try self.vx.resize(self.allocator, self.tty.writer(), ws);
+                try self.vx.resize(self.allocator, self.output(), ws);
             },
             else => {},
         }
     }
 
-    fn render(self: *ServerTui) !void {
-        const win = self.vx.window();
+    fn output(self: *ServerTui) *std.Io.Writer {
+        if (self.tty) |*tty| return tty.writer();
+        return &self.discard.writer;
+    }
+
+    pub fn render(self: *ServerTui) !void {
+        const span = trace.span("render");
+        defer span.end();
+
+        self.draw(self.vx.window());
+        try self.vx.render(self.output());
+    }
+
+    /// Lays out the whole screen into `win` without writing to the terminal.
+    pub fn draw(self: *ServerTui, win: Window) void {
         win.clear();
 
         const width = win.width;
         const height = win.height;
 
-        if (height < 12 or width < 50) {
+        if (height < 17 or width < 50) {
             return;
         }
 
@@ -270,7 +367,7 @@ pub const ServerTui = struct {
         const title_segment = [_]Cell.Segment{.{ .text = title_text, .style = title_style }};
         _ = win.print(&title_segment, .{ .col_offset = title_start });
 
-        const info_height: u16 = 5;
+        const info_height: u16 = 10;
         const info_box = win.child(.{
             .x_off = 0,
             .y_off = 1,
@@ -301,8 +398,6 @@ pub const ServerTui = struct {
             .border = .{ .where = .all, .style = border_style },
         });
         self.renderLogs(logs_box, logs_height - 2);
-
-        try self.vx.render(self.tty.writer());
     }
 
     fn renderInfoBox(self: *ServerTui, area: Window) void {
@@ -334,6 +429,107 @@ pub const ServerTui = struct {
             .{ .text = self.conn_display[0..self.conn_display_len], .style = connected_style },
         };
         _ = area.print(&conn_label, .{ .row_offset = 2 });
+
+        const loop = &self.metrics.loop;
+        const stalls = loop.stalls.load(.monotonic);
+        const loop_text = if (stalls == 0)
+            std.fmt.bufPrint(&self.loop_display, "p50 {d}us  p99 {d}us  max {d}us  wait p99 {d}us", .{
+                loop.iterations.percentile(50),
+                loop.iterations.percentile(99),
+                loop.iterations.max.load(.monotonic),
+                loop.readiness.percentile(99),
+            }) catch "?"
+        else
+            std.fmt.bufPrint(&self.loop_display, "p50 {d}us  p99 {d}us  max {d}us  stalls {d} (last {d}ms in {s})", .{
+                loop.iterations.percentile(50),
+                loop.iterations.percentile(99),
+                loop.iterations.max.load(.monotonic),
+                stalls,
+                loop.last_stall_us.load(.monotonic) / std.time.us_per_ms,
+                @tagName(@as(metrics_mod.Phase, @enumFromInt(loop.last_stall_phase.load(.monotonic)))),
+            }) catch "?";
+        const loop_style: Cell.Style = .{
+            .fg = if (stalls > 0) colors.disconnected else colors.text,
+        };
+        const loop_label = [_]Cell.Segment{
+            .{ .text = "  Loop: ", .style = label_style },
+            .{ .text = loop_text, .style = loop_style },
+        };
+        _ = area.print(&loop_label, .{ .row_offset = 3 });
+
+        const top = &self.metrics.top;
+        top.mutex.lock();
+        const ip_text = formatOffenders(&self.top_ip_display, top.ips[0..top.ip_count]);
+        const user_text = formatOffenders(&self.top_user_display, top.users[0..top.user_count]);
+        top.mutex.unlock();
+
+        const ip_row = [_]Cell.Segment{
+            .{ .text = "  Top IPs: ", .style = label_style },
+            .{ .text = ip_text, .style = value_style },
+        };
+        _ = area.print(&ip_row, .{ .row_offset = 4 });
+
+        const user_row = [_]Cell.Segment{
+            .{ .text = "  Top users: ", .style = label_style },
+            .{ .text = user_text, .style = value_style },
+        };
+        _ = area.print(&user_row, .{ .row_offset = 5 });
+
+        const budget = self.budget;
+        const limits = budget.limits;
+        const mib = 1024 * 1024;
+        const memory_text = std.fmt.bufPrint(&self.memory_display, "{d} KiB (peak {d} KiB, soft {d} MiB, hard {d} MiB)  paused {d}  refused {d}  evicted {d}", .{
+            budget.total.load(.monotonic) / 1024,
+            budget.peak.load(.monotonic) / 1024,
+            limits.soft_bytes / mib,
+            limits.hard_bytes / mib,
+            budget.paused.load(.monotonic),
+            budget.refused.load(.monotonic),
+            budget.evicted.load(.monotonic),
+        }) catch "?";
+        const memory_style: Cell.Style = .{
+            .fg = switch (budget.pressure()) {
+                .none => colors.text,
+                .soft => LogEntry.Level.warn.color(),
+                .hard => colors.disconnected,
+            },
+        };
+        const memory_row = [_]Cell.Segment{
+            .{ .text = "  Memory: ", .style = label_style },
+            .{ .text = memory_text, .style = memory_style },
+        };
+        _ = area.print(&memory_row, .{ .row_offset = 6 });
+
+        const log_dropped = if (self.sink) |sink| sink.dropped.load(.monotonic) else 0;
+        const log_errors = if (self.sink) |sink| sink.write_errors.load(.monotonic) else 0;
+        const log_text = std.fmt.bufPrint(&self.log_display, "dropped {d}  write errors {d}", .{ log_dropped, log_errors }) catch "?";
+        const log_style: Cell.Style = .{
+            .fg = if (log_dropped + log_errors > 0) colors.disconnected else colors.text,
+        };
+        const log_row = [_]Cell.Segment{
+            .{ .text = "  Log: ", .style = label_style },
+            .{ .text = log_text, .style = log_style },
+        };
+        _ = area.print(&log_row, .{ .row_offset = 7 });
+    }
+
+    /// Formats up to three offenders as "label cost/syscalls/frames" entries.
+    fn formatOffenders(buf: []u8, offenders: []const Offender) []const u8 {
+        if (offenders.len == 0) return "-";
+
+        var len: usize = 0;
+        for (offenders[0..@min(3, offenders.len)], 0..) |*offender, idx| {
+            const entry = std.fmt.bufPrint(buf[len..], "{s}{s} {d}ms {d}sc {d}f {d}c", .{
+                if (idx == 0) "" else "  ",
+                offender.getLabel(),
+                offender.stats.costNs() / std.time.ns_per_ms,
+                offender.stats.syscalls(),
+                offender.stats.frames,
+                offender.stats.connects,
+            }) catch break;
+            len += entry.len;
+        }
+        return buf[0..len];
     }
 
     fn renderFilterBox(self: *ServerTui, area: Window) void {
@@ -341,7 +537,7 @@ pub const ServerTui = struct {
         self.filter_input.drawWithLabel(area, " Filter: ", label_style);
     }
 
-    fn renderLogs(self: *ServerTui, area: Window, max_lines: u16) void {
+    pub fn renderLogs(self: *ServerTui, area: Window, max_lines: u16) void {
         if (max_lines == 0) return;
 
         var filter_buf: [256]u8 = undefined;
@@ -379,12 +575,11 @@ pub const ServerTui = struct {
         self.logs.drawFiltered(area, @intCast(max_lines), filter, shouldInclude, renderEntry);
     }
 
-    fn addLog(self: *ServerTui, message: []const u8, level: LogEntry.Level) !void {
+    pub fn addLog(self: *ServerTui, message: []const u8, level: LogEntry.Level) !void {
         const entry = try LogEntry.create(self.allocator, message, level);
         try self.logs.append(entry);
 
-        const max_logs: usize = 1000;
-        while (self.logs.count() > max_logs) {
+        while (self.logs.count() > config.LOG_HISTORY) {
             if (self.logs.removeAt(0)) |old_entry| {
                 var mutable_entry = old_entry;
                 mutable_entry.destroy();
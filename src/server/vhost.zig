@@ -0,0 +1,455 @@
+const std = @import("std");
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const protocol = @import("../protocol.zig");
+
+/// Ingress limits of a room, checked for each chat frame before it is
+/// relayed. Zero turns a limit off.
+pub const Policy = struct {
+    /// Least time between two messages from the same connection.
+    slow_ms: u32 = 0,
+    /// Messages per second the whole room may send on average.
+    rate: u32 = 0,
+    /// Messages the room may send back to back; 0 for one second's worth.
+    burst: u32 = 0,
+};
+
+/// A virtual host given on the command line as
+/// `name[:size][,slow=<ms>][,rate=<msg/s>][,burst=<n>]`.
+pub const Spec = struct {
+    name: []const u8,
+    /// Most members; null for the server's --size.
+    max_clients: ?usize = null,
+    /// Limits that override the server-wide defaults.
+    slow_ms: ?u32 = null,
+    rate: ?u32 = null,
+    burst: ?u32 = null,
+
+    pub fn parse(text: []const u8) !Spec {
+        var options = std.mem.splitScalar(u8, text, ',');
+        var it = std.mem.splitScalar(u8, options.first(), ':');
+        var spec: Spec = .{ .name = it.first() };
+        if (!protocol.validHostName(spec.name)) return error.InvalidHostName;
+
+        if (it.next()) |size| {
+            if (it.next() != null) return error.InvalidHostSpec;
+            const max_clients = std.fmt.parseInt(usize, size, 10) catch return error.InvalidHostSpec;
+            if (max_clients == 0) return error.InvalidHostSpec;
+            spec.max_clients = max_clients;
+        }
+
+        while (options.next()) |option| {
+            const eq = std.mem.indexOfScalar(u8, option, '=') orelse return error.InvalidHostSpec;
+            const value = std.fmt.parseInt(u32, option[eq + 1 ..], 10) catch return error.InvalidHostSpec;
+            const key = option[0..eq];
+            if (std.mem.eql(u8, key, "slow")) {
+                spec.slow_ms = value;
+            } else if (std.mem.eql(u8, key, "rate")) {
+                spec.rate = value;
+            } else if (std.mem.eql(u8, key, "burst")) {
+                spec.burst = value;
+            } else {
+                return error.InvalidHostSpec;
+            }
+        }
+        return spec;
+    }
+
+    pub fn policy(self: Spec, defaults: Policy) Policy {
+        return .{
+            .slow_ms = self.slow_ms orelse defaults.slow_ms,
+            .rate = self.rate orelse defaults.rate,
+            .burst = self.burst orelse defaults.burst,
+        };
+    }
+};
+
+/// Token bucket for a room's message budget. Tokens are kept in
+/// thousandths, so refilling `rate` per second is `rate` per millisecond
+/// and nothing is lost to rounding.
+pub const Bucket = struct {
+    rate: u64,
+    capacity: u64,
+    milli_tokens: u64,
+    last_ms: i64,
+
+    pub fn init(rate: u32, burst: u32) Bucket {
+        const capacity = @as(u64, if (burst != 0) burst else rate) * 1000;
+        return .{ .rate = rate, .capacity = capacity, .milli_tokens = capacity, .last_ms = 0 };
+    }
+
+    /// Takes one token. Returns null if there was one, otherwise how many
+    /// milliseconds until there will be.
+    pub fn take(self: *Bucket, now_ms: i64) ?u32 {
+        if (self.rate == 0) return null;
+
+        if (now_ms > self.last_ms) {
+            const elapsed: u64 = @intCast(now_ms - self.last_ms);
+            self.milli_tokens = @min(self.capacity, self.milli_tokens +| elapsed *| self.rate);
+        }
+        self.last_ms = now_ms;
+
+        if (self.milli_tokens >= 1000) {
+            self.milli_tokens -= 1000;
+            return null;
+        }
+        return @intCast(std.math.divCeil(u64, 1000 - self.milli_tokens, self.rate) catch unreachable);
+    }
+};
+
+/// One isolated room: its own member list, size limit and history. All
+/// hosts share the server's event loop, poll table and memory pools.
+pub const Host = struct {
+    name_buf: [protocol.MAX_HOST_NAME]u8,
+    name_len: usize,
+    max_clients: usize,
+    /// Sockets of the members, the broadcast list for this room.
+    sockets: []posix.socket_t,
+    members: usize,
+    history: History,
+    policy: Policy,
+    budget: Bucket,
+    /// Chat frames refused by `policy`, for the window stats.
+    rejected: u64,
+    /// Ephemeral messages in `history` waiting to expire.
+    ephemeral: usize,
+    /// When each sender may next post under slow mode, by hash of the user
+    /// name, so opening more connections does not get around it. Holds at
+    /// most `max_clients` senders; those whose wait is over are pruned when
+    /// it fills.
+    senders: std.AutoHashMapUnmanaged(u64, i64),
+
+    /// The default host has an empty name.
+    pub fn init(allocator: Allocator, host_name: []const u8, max_clients: usize, history_frames: usize, policy: Policy) !Host {
+        std.debug.assert(host_name.len <= protocol.MAX_HOST_NAME);
+
+        const sockets = try allocator.alloc(posix.socket_t, max_clients);
+        errdefer allocator.free(sockets);
+
+        var host: Host = .{
+            .name_buf = undefined,
+            .name_len = host_name.len,
+            .max_clients = max_clients,
+            .sockets = sockets,
+            .members = 0,
+            .history = try History.init(allocator, history_frames),
+            .policy = policy,
+            .budget = Bucket.init(policy.rate, policy.burst),
+            .rejected = 0,
+            .ephemeral = 0,
+            .senders = .empty,
+        };
+        @memcpy(host.name_buf[0..host_name.len], host_name);
+        return host;
+    }
+
+    pub fn setPolicy(self: *Host, policy: Policy) void {
+        self.policy = policy;
+        self.budget = Bucket.init(policy.rate, policy.burst);
+    }
+
+    pub fn deinit(self: *Host, allocator: Allocator) void {
+        self.senders.deinit(allocator);
+        self.history.deinit(allocator);
+        allocator.free(self.sockets);
+    }
+
+    /// The slow-mode deadline of `user`, 0 for a new sender. Null if the
+    /// table is full of senders still waiting or cannot grow.
+    pub fn senderDeadline(self: *Host, allocator: Allocator, user: []const u8, now_ms: i64) ?*i64 {
+        const key = std.hash.Wyhash.hash(0, user);
+        if (self.senders.getPtr(key)) |deadline| return deadline;
+
+        if (self.senders.count() >= self.max_clients) {
+            var it = self.senders.iterator();
+            while (it.next()) |entry| {
+                if (entry.value_ptr.* <= now_ms) self.senders.removeByPtr(entry.key_ptr);
+            }
+            if (self.senders.count() >= self.max_clients) return null;
+        }
+        const entry = self.senders.getOrPut(allocator, key) catch return null;
+        entry.value_ptr.* = 0;
+        return entry.value_ptr;
+    }
+
+    pub fn name(self: *const Host) []const u8 {
+        return self.name_buf[0..self.name_len];
+    }
+
+    pub fn memberSockets(self: *const Host) []const posix.socket_t {
+        return self.sockets[0..self.members];
+    }
+
+    pub fn add(self: *Host, socket: posix.socket_t) error{HostFull}!void {
+        if (self.members >= self.max_clients) return error.HostFull;
+        self.sockets[self.members] = socket;
+        self.members += 1;
+    }
+
+    /// Rooms are unordered, so the last member takes the leaver's slot.
+    pub fn remove(self: *Host, socket: posix.socket_t) void {
+        const idx = std.mem.indexOfScalar(posix.socket_t, self.memberSockets(), socket) orelse return;
+        self.members -= 1;
+        self.sockets[idx] = self.sockets[self.members];
+    }
+};
+
+/// The latest frames relayed in a room, replayed to clients as they join.
+/// Frames are kept in wire format in a byte ring, with an entry each in a
+/// parallel ring so an ephemeral frame can be expired where it sits. Once
+/// `max_frames` are held the oldest is dropped for each new one. The byte
+/// ring holds that many frames of the largest size, so it never fills
+/// before the entry ring does.
+pub const History = struct {
+    /// Most frames a room may keep.
+    pub const MAX_FRAMES = 256;
+
+    pub const Entry = struct {
+        offset: usize,
+        /// Wire length, length prefix included.
+        len: usize,
+        /// Message id of an ephemeral frame, 0 for ordinary chat.
+        id: u64,
+        /// When an ephemeral frame expires.
+        deadline_ms: i64,
+        /// Cleared when the frame expires or is dropped.
+        live: bool,
+    };
+
+    /// Where the TTL sits in a stored ephemeral frame.
+    const TTL_OFFSET = 4 + protocol.Ephemeral.TTL_OFFSET;
+
+    ring: []u8,
+    entries: []Entry,
+    /// Offset of the oldest frame and the bytes held from there on.
+    head: usize,
+    len: usize,
+    /// Slot of the oldest entry and the number of entries held.
+    first: usize,
+    frames: usize,
+    /// Ids of the live ephemeral frames the last push dropped to make room.
+    dropped: std.ArrayList(u64),
+
+    pub fn init(allocator: Allocator, max_frames: usize) !History {
+        const ring = try allocator.alloc(u8, max_frames * (config.BUFFER_SIZE + 4));
+        errdefer allocator.free(ring);
+        const entries = try allocator.alloc(Entry, max_frames);
+        errdefer allocator.free(entries);
+        return .{
+            .ring = ring,
+            .entries = entries,
+            .head = 0,
+            .len = 0,
+            .first = 0,
+            .frames = 0,
+            .dropped = try std.ArrayList(u64).initCapacity(allocator, max_frames),
+        };
+    }
+
+    pub fn deinit(self: *History, allocator: Allocator) void {
+        self.dropped.deinit(allocator);
+        allocator.free(self.entries);
+        allocator.free(self.ring);
+    }
+
+    /// Appends a frame and returns its slot, or null if it was not kept.
+    /// An ephemeral frame carries its id and deadline; chat passes 0 for
+    /// both. Live ephemeral frames dropped to make room are listed in
+    /// `dropped` until the next push.
+    pub fn push(self: *History, frame: []const u8, id: u64, deadline_ms: i64) ?usize {
+        self.dropped.clearRetainingCapacity();
+        const need = frame.len + 4;
+        if (self.entries.len == 0 or need > self.ring.len) return null;
+        while (self.frames == self.entries.len or self.ring.len - self.len < need) {
+            self.dropOldest();
+        }
+
+        const slot = (self.first + self.frames) % self.entries.len;
+        self.entries[slot] = .{
+            .offset = (self.head + self.len) % self.ring.len,
+            .len = need,
+            .id = id,
+            .deadline_ms = deadline_ms,
+            .live = true,
+        };
+
+        var len_buf: [4]u8 = undefined;
+        std.mem.writeInt(u32, &len_buf, @intCast(frame.len), .little);
+        self.copyIn(&len_buf);
+        self.copyIn(frame);
+        self.frames += 1;
+        return slot;
+    }
+
+    /// Wipes the ephemeral frame `id` so it is never replayed. If `slot`
+    /// has been reused since, the id no longer matches and nothing happens.
+    pub fn expire(self: *History, slot: usize, id: u64) void {
+        const entry = &self.entries[slot];
+        if (!entry.live or entry.id != id) return;
+        entry.live = false;
+
+        // The bytes stay in the ring until they are dropped, but the
+        // message should not.
+        const first = @min(entry.len, self.ring.len - entry.offset);
+        @memset(self.ring[entry.offset..][0..first], 0);
+        @memset(self.ring[0 .. entry.len - first], 0);
+    }
+
+    /// Rewrites the TTL of each live ephemeral frame to the time it has
+    /// left, so a replay does not restart its clock.
+    pub fn stampRemaining(self: *History, now_ms: i64) void {
+        for (0..self.frames) |i| {
+            const entry = self.entries[(self.first + i) % self.entries.len];
+            if (!entry.live or entry.id == 0) continue;
+
+            const left = std.math.clamp(entry.deadline_ms - now_ms, 1, protocol.MAX_TTL_MS);
+            var ttl: [4]u8 = undefined;
+            std.mem.writeInt(u32, &ttl, @intCast(left), .little);
+            self.writeAt((entry.offset + TTL_OFFSET) % self.ring.len, &ttl);
+        }
+    }
+
+    /// Frames gathered for a replay: runs of whole frames for `writev`,
+    /// and where each frame ends in the stream they make up.
+    pub const Replay = struct {
+        runs: []posix.iovec_const,
+        ends: []usize,
+
+        pub fn bytes(self: Replay) usize {
+            return if (self.ends.len == 0) 0 else self.ends[self.ends.len - 1];
+        }
+
+        /// Where the frame holding stream offset `at` ends, or `at` itself
+        /// on a boundary, so a write cut short can be finished to one.
+        pub fn frameEnd(self: Replay, at: usize) usize {
+            if (at == 0) return 0;
+            for (self.ends) |end| {
+                if (end >= at) return end;
+            }
+            return self.bytes();
+        }
+    };
+
+    /// Fills `iov` with the newest live frames that fit in `max_bytes`,
+    /// oldest first, merging neighbours into one run, and `ends` with
+    /// where each one ends. `iov` needs room for `MAX_FRAMES + 1` runs, as
+    /// at most one frame wraps around the end of the ring, and `ends` for
+    /// `MAX_FRAMES`.
+    pub fn gather(self: *const History, iov: []posix.iovec_const, ends: []usize, max_bytes: usize) Replay {
+        // Newest first, to find the oldest frame that still fits.
+        var start = self.frames;
+        var total: usize = 0;
+        while (start > 0) : (start -= 1) {
+            const entry = self.entries[(self.first + start - 1) % self.entries.len];
+            if (!entry.live) continue;
+            if (total + entry.len > max_bytes) break;
+            total += entry.len;
+        }
+
+        var n: usize = 0;
+        var frames: usize = 0;
+        var end: usize = 0;
+        for (start..self.frames) |i| {
+            const entry = self.entries[(self.first + i) % self.entries.len];
+            if (!entry.live) continue;
+
+            const first = @min(entry.len, self.ring.len - entry.offset);
+            n = appendRun(iov, n, self.ring[entry.offset..][0..first]);
+            if (first < entry.len) n = appendRun(iov, n, self.ring[0 .. entry.len - first]);
+            end += entry.len;
+            ends[frames] = end;
+            frames += 1;
+        }
+        return .{ .runs = iov[0..n], .ends = ends[0..frames] };
+    }
+
+    fn appendRun(iov: []posix.iovec_const, n: usize, bytes: []const u8) usize {
+        if (n > 0 and iov[n - 1].base + iov[n - 1].len == bytes.ptr) {
+            iov[n - 1].len += bytes.len;
+            return n;
+        }
+        iov[n] = .{ .base = bytes.ptr, .len = bytes.len };
+        return n + 1;
+    }
+
+    fn dropOldest(self: *History) void {
+        const entry = &self.entries[self.first];
+        // At most one per slot, so `dropped` never outgrows its capacity.
+        if (entry.live and entry.id != 0) self.dropped.appendAssumeCapacity(entry.id);
+        entry.live = false;
+        self.head = (entry.offset + entry.len) % self.ring.len;
+        self.len -= entry.len;
+        self.first = (self.first + 1) % self.entries.len;
+        self.frames -= 1;
+    }
+
+    fn copyIn(self: *History, bytes: []const u8) void {
+        self.writeAt((self.head + self.len) % self.ring.len, bytes);
+        self.len += bytes.len;
+    }
+
+    fn writeAt(self: *History, at: usize, bytes: []const u8) void {
+        const first = @min(bytes.len, self.ring.len - at);
+        @memcpy(self.ring[at..][0..first], bytes[0..first]);
+        @memcpy(self.ring[0 .. bytes.len - first], bytes[first..]);
+    }
+};
+
+test "room budget allows a burst, then refills at its rate" {
+    const testing = std.testing;
+
+    var bucket = Bucket.init(2, 3);
+    for (0..3) |_| try testing.expectEqual(@as(?u32, null), bucket.take(10_000));
+    try testing.expectEqual(@as(?u32, 500), bucket.take(10_000));
+    try testing.expectEqual(@as(?u32, 100), bucket.take(10_400));
+    try testing.expectEqual(@as(?u32, null), bucket.take(10_500));
+    try testing.expectEqual(@as(?u32, 500), bucket.take(10_500));
+}
+
+test "history replays the latest live frames across the end of the ring" {
+    const testing = std.testing;
+
+    var history = try History.init(testing.allocator, 3);
+    defer history.deinit(testing.allocator);
+
+    var buf: [16]u8 = undefined;
+    var slot: ?usize = null;
+    for (0..2000) |n| {
+        slot = history.push(try std.fmt.bufPrint(&buf, "message {d}", .{n}), n, 0);
+    }
+    try testing.expectEqual(@as(usize, 3), history.frames);
+    try testing.expectEqualSlices(u64, &.{1996}, history.dropped.items);
+
+    // Expiring with a stale id is a no-op; the right one wipes the frame.
+    history.expire(slot.?, 1);
+    history.expire(slot.?, 1999);
+
+    var iov: [History.MAX_FRAMES + 1]posix.iovec_const = undefined;
+    var ends: [History.MAX_FRAMES]usize = undefined;
+    var wire: [3 * 32]u8 = undefined;
+    var len: usize = 0;
+    const replay = history.gather(&iov, &ends, std.math.maxInt(usize));
+    for (replay.runs) |run| {
+        @memcpy(wire[len..][0..run.len], run.base[0..run.len]);
+        len += run.len;
+    }
+
+    var pos: usize = 0;
+    for (1997..1999) |n| {
+        const frame_len = std.mem.readInt(u32, wire[pos..][0..4], .little);
+        const expected = try std.fmt.bufPrint(&buf, "message {d}", .{n});
+        try testing.expectEqualStrings(expected, wire[pos + 4 ..][0..frame_len]);
+        pos += 4 + frame_len;
+        try testing.expectEqual(pos, replay.frameEnd(pos - 1));
+    }
+    try testing.expectEqual(len, pos);
+    try testing.expectEqual(len, replay.bytes());
+
+    // A byte cap keeps the newest frames that fit.
+    const oldest_len = replay.ends[0];
+    const newest = history.gather(&iov, &ends, len - 1);
+    try testing.expectEqual(@as(usize, 1), newest.ends.len);
+    try testing.expectEqual(len - oldest_len, newest.bytes());
+}
@@ -0,0 +1,406 @@
+const std = @import("std");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const Io = @import("../io.zig").Io;
+
+/// One direction of a simulated connection.
+pub const Link = struct {
+    /// One-way delay.
+    latency_ns: u64 = 200 * std.time.ns_per_us,
+    /// Bytes per second; 0 is unlimited.
+    bandwidth: u64 = 0,
+    /// Bytes in flight plus unread at the receiver before writes would
+    /// block, like a socket's send and receive buffers together.
+    buffer: usize = 256 * 1024,
+};
+
+/// Bytes up to `end` of the inbox become readable at `at_ns`.
+const Arrival = struct {
+    at_ns: u64,
+    end: usize,
+};
+
+const Endpoint = struct {
+    peer: ?*Endpoint,
+    /// The remote address reported by accept().
+    address: net.Address,
+    /// The link carrying data towards this endpoint.
+    link: Link,
+    inbox: std.ArrayListUnmanaged(u8) = .{},
+    consumed: usize = 0,
+    arrivals: std.ArrayListUnmanaged(Arrival) = .{},
+    arrival_head: usize = 0,
+    /// End of the bytes that have arrived.
+    readable: usize = 0,
+    /// When the link finishes sending what is queued.
+    link_free_ns: u64 = 0,
+    /// When the peer's close becomes visible, once all data before it is read.
+    eof_at_ns: ?u64 = null,
+
+    fn deinit(self: *Endpoint, allocator: Allocator) void {
+        self.inbox.deinit(allocator);
+        self.arrivals.deinit(allocator);
+    }
+
+    fn refresh(self: *Endpoint, now: u64) void {
+        while (self.arrival_head < self.arrivals.items.len) {
+            const arrival = self.arrivals.items[self.arrival_head];
+            if (arrival.at_ns > now) break;
+            self.readable = arrival.end;
+            self.arrival_head += 1;
+        }
+    }
+
+    fn lastArrivalNs(self: *const Endpoint) u64 {
+        const items = self.arrivals.items;
+        return if (items.len > self.arrival_head) items[items.len - 1].at_ns else 0;
+    }
+
+    fn eofVisible(self: *const Endpoint, now: u64) bool {
+        const eof = self.eof_at_ns orelse return false;
+        return now >= eof and self.consumed == self.inbox.items.len;
+    }
+
+    /// Drops consumed bytes once they outweigh the receive buffer.
+    fn compact(self: *Endpoint) void {
+        if (self.consumed == self.inbox.items.len) {
+            self.inbox.clearRetainingCapacity();
+            self.arrivals.clearRetainingCapacity();
+            self.consumed = 0;
+            self.readable = 0;
+            self.arrival_head = 0;
+            return;
+        }
+        if (self.consumed < self.link.buffer) return;
+
+        const shift = self.consumed;
+        const rest = self.inbox.items[shift..];
+        std.mem.copyForwards(u8, self.inbox.items[0..rest.len], rest);
+        self.inbox.items.len = rest.len;
+
+        const pending = self.arrivals.items[self.arrival_head..];
+        std.mem.copyForwards(Arrival, self.arrivals.items[0..pending.len], pending);
+        self.arrivals.items.len = pending.len;
+        for (self.arrivals.items) |*arrival| arrival.end -= shift;
+
+        self.arrival_head = 0;
+        self.readable -= shift;
+        self.consumed = 0;
+    }
+};
+
+const Pending = struct {
+    at_ns: u64,
+    socket: posix.socket_t,
+};
+
+const Listener = struct {
+    pending: std.ArrayListUnmanaged(Pending) = .{},
+    head: usize = 0,
+};
+
+const Socket = union(enum) {
+    listener: Listener,
+    endpoint: Endpoint,
+};
+
+/// An in-memory TCP-like network with a virtual clock. Sockets are small
+/// integers that mean nothing to the OS. Data written to an endpoint
+/// arrives at its peer after the link's latency and serialization time,
+/// in order, and writes block once the link's buffer is full. Time only
+/// moves when `poll` waits or the caller calls `advanceTo`, so a run is
+/// reproducible for a given sequence of calls.
+pub const Network = struct {
+    allocator: Allocator,
+    now_ns: u64,
+    /// `poll` never waits past this, so the driver gets control back in
+    /// time for its next scheduled action.
+    wake_ns: u64 = std.math.maxInt(u64),
+    sockets: std.ArrayListUnmanaged(?*Socket) = .{},
+    free: std.ArrayListUnmanaged(posix.socket_t) = .{},
+
+    /// Socket numbers start here, to stay clear of stdio in log output.
+    const FIRST_SOCKET = 3;
+
+    pub fn init(allocator: Allocator, start_ns: u64) Network {
+        return .{ .allocator = allocator, .now_ns = start_ns };
+    }
+
+    pub fn deinit(self: *Network) void {
+        for (self.sockets.items) |maybe| {
+            const socket = maybe orelse continue;
+            self.destroySocket(socket);
+        }
+        self.sockets.deinit(self.allocator);
+        self.free.deinit(self.allocator);
+    }
+
+    pub fn io(self: *Network) Io {
+        return .{ .ptr = self, .vtable = &vtable };
+    }
+
+    pub fn listen(self: *Network) !posix.socket_t {
+        return self.create(.{ .listener = .{} });
+    }
+
+    /// Opens a connection to `listener` and returns the client's socket.
+    /// The server side becomes acceptable after `up.latency_ns`.
+    pub fn connect(self: *Network, listener: posix.socket_t, address: net.Address, up: Link, down: Link) !posix.socket_t {
+        const l = &(self.lookup(listener) orelse return error.ConnectionRefused).listener;
+        try l.pending.ensureUnusedCapacity(self.allocator, 1);
+
+        const server_side = try self.create(.{ .endpoint = .{ .peer = null, .address = address, .link = up } });
+        errdefer self.close(server_side);
+        const client_side = try self.create(.{ .endpoint = .{ .peer = null, .address = address, .link = down } });
+
+        const s = &self.lookup(server_side).?.endpoint;
+        const c = &self.lookup(client_side).?.endpoint;
+        s.peer = c;
+        c.peer = s;
+        l.pending.appendAssumeCapacity(.{ .at_ns = self.now_ns + up.latency_ns, .socket = server_side });
+        return client_side;
+    }
+
+    /// Moves the clock forward; it never goes back.
+    pub fn advanceTo(self: *Network, ns: u64) void {
+        self.now_ns = @max(self.now_ns, ns);
+    }
+
+    /// The earliest future time at which data, a close or a connection
+    /// arrives anywhere in the network.
+    pub fn nextEventNs(self: *const Network) ?u64 {
+        var next: ?u64 = null;
+        for (self.sockets.items) |maybe| {
+            const socket = maybe orelse continue;
+            const t: ?u64 = switch (socket.*) {
+                .listener => |l| if (l.head < l.pending.items.len) l.pending.items[l.head].at_ns else null,
+                .endpoint => |e| blk: {
+                    if (e.arrival_head < e.arrivals.items.len) break :blk e.arrivals.items[e.arrival_head].at_ns;
+                    if (e.eof_at_ns) |eof| if (eof > self.now_ns) break :blk eof;
+                    break :blk null;
+                },
+            };
+            if (t) |time| {
+                if (time > self.now_ns and (next == null or time < next.?)) next = time;
+            }
+        }
+        return next;
+    }
+
+    pub fn read(self: *Network, socket: posix.socket_t, buf: []u8) posix.ReadError!usize {
+        const s = self.lookup(socket) orelse return error.NotOpenForReading;
+        const e = switch (s.*) {
+            .endpoint => |*e| e,
+            .listener => return error.NotOpenForReading,
+        };
+        e.refresh(self.now_ns);
+
+        const available = e.readable - e.consumed;
+        if (available == 0) {
+            if (e.eofVisible(self.now_ns)) return 0;
+            return error.WouldBlock;
+        }
+        const n = @min(available, buf.len);
+        @memcpy(buf[0..n], e.inbox.items[e.consumed..][0..n]);
+        e.consumed += n;
+        e.compact();
+        return n;
+    }
+
+    pub fn write(self: *Network, socket: posix.socket_t, bytes: []const u8) posix.WriteError!usize {
+        return self.writev(socket, &.{.{ .base = bytes.ptr, .len = bytes.len }});
+    }
+
+    pub fn writev(self: *Network, socket: posix.socket_t, iov: []const posix.iovec_const) posix.WriteError!usize {
+        const s = self.lookup(socket) orelse return error.NotOpenForWriting;
+        const e = switch (s.*) {
+            .endpoint => |*e| e,
+            .listener => return error.NotOpenForWriting,
+        };
+
+        var total: usize = 0;
+        for (iov) |v| total += v.len;
+
+        // Once the peer has closed, writes keep succeeding and the data is
+        // dropped; unlike a real socket, no reset ever turns them into
+        // errors. Writers find out from the end of stream on read instead.
+        const peer = e.peer orelse return total;
+
+        const unread = peer.inbox.items.len - peer.consumed;
+        const space = peer.link.buffer -| unread;
+        if (space == 0) return error.WouldBlock;
+        const n = @min(total, space);
+
+        peer.inbox.ensureUnusedCapacity(self.allocator, n) catch return error.SystemResources;
+        peer.arrivals.ensureUnusedCapacity(self.allocator, 1) catch return error.SystemResources;
+        var left = n;
+        for (iov) |v| {
+            const part = @min(left, v.len);
+            peer.inbox.appendSliceAssumeCapacity(v.base[0..part]);
+            left -= part;
+            if (left == 0) break;
+        }
+
+        const sent_ns = @max(self.now_ns, peer.link_free_ns) + serializationNs(peer.link, n);
+        peer.link_free_ns = sent_ns;
+        const at = @max(sent_ns + peer.link.latency_ns, peer.lastArrivalNs());
+        peer.arrivals.appendAssumeCapacity(.{ .at_ns = at, .end = peer.inbox.items.len });
+        return n;
+    }
+
+    pub fn close(self: *Network, socket: posix.socket_t) void {
+        const s = self.lookup(socket) orelse return;
+        self.sockets.items[@intCast(socket - FIRST_SOCKET)] = null;
+        self.free.append(self.allocator, socket) catch {};
+        self.destroySocket(s);
+    }
+
+    pub fn accept(self: *Network, listener: posix.socket_t, address: *net.Address) posix.AcceptError!posix.socket_t {
+        const s = self.lookup(listener) orelse return error.SocketNotListening;
+        const l = switch (s.*) {
+            .listener => |*l| l,
+            .endpoint => return error.SocketNotListening,
+        };
+        if (l.head == l.pending.items.len or l.pending.items[l.head].at_ns > self.now_ns) {
+            return error.WouldBlock;
+        }
+        const pending = l.pending.items[l.head];
+        l.head += 1;
+        if (l.head == l.pending.items.len) {
+            l.pending.clearRetainingCapacity();
+            l.head = 0;
+        }
+        address.* = self.lookup(pending.socket).?.endpoint.address;
+        return pending.socket;
+    }
+
+    /// Fills in readiness for `fds` at the current time. With nothing
+    /// ready, jumps the clock to the next network event, the driver's
+    /// `wake_ns` or the timeout, whichever is first.
+    pub fn poll(self: *Network, fds: []posix.pollfd, timeout_ms: i32) usize {
+        const ready = self.scan(fds);
+        if (ready > 0 or timeout_ms == 0) return ready;
+
+        var until = self.wake_ns;
+        if (timeout_ms > 0) until = @min(until, self.now_ns + @as(u64, @intCast(timeout_ms)) * std.time.ns_per_ms);
+        if (self.nextEventNs()) |next| until = @min(until, next);
+        if (until == std.math.maxInt(u64)) return 0;
+
+        self.advanceTo(until);
+        return self.scan(fds);
+    }
+
+    fn scan(self: *Network, fds: []posix.pollfd) usize {
+        var ready: usize = 0;
+        for (fds) |*pfd| {
+            pfd.revents = 0;
+            if (pfd.fd < 0) continue;
+            const s = self.lookup(pfd.fd) orelse {
+                pfd.revents = posix.POLL.NVAL;
+                ready += 1;
+                continue;
+            };
+            switch (s.*) {
+                .listener => |l| {
+                    if (l.head < l.pending.items.len and l.pending.items[l.head].at_ns <= self.now_ns) {
+                        pfd.revents |= pfd.events & posix.POLL.IN;
+                    }
+                },
+                .endpoint => |*e| {
+                    e.refresh(self.now_ns);
+                    if (e.readable > e.consumed or e.eofVisible(self.now_ns)) {
+                        pfd.revents |= pfd.events & posix.POLL.IN;
+                    }
+                    if (e.peer) |peer| {
+                        if (peer.inbox.items.len - peer.consumed < peer.link.buffer) {
+                            pfd.revents |= pfd.events & posix.POLL.OUT;
+                        }
+                    }
+                },
+            }
+            if (pfd.revents != 0) ready += 1;
+        }
+        return ready;
+    }
+
+    fn create(self: *Network, value: Socket) !posix.socket_t {
+        const s = try self.allocator.create(Socket);
+        errdefer self.allocator.destroy(s);
+        s.* = value;
+
+        if (self.free.pop()) |socket| {
+            self.sockets.items[@intCast(socket - FIRST_SOCKET)] = s;
+            return socket;
+        }
+        try self.sockets.append(self.allocator, s);
+        return @intCast(self.sockets.items.len - 1 + FIRST_SOCKET);
+    }
+
+    fn lookup(self: *const Network, socket: posix.socket_t) ?*Socket {
+        if (socket < FIRST_SOCKET) return null;
+        const idx: usize = @intCast(socket - FIRST_SOCKET);
+        if (idx >= self.sockets.items.len) return null;
+        return self.sockets.items[idx];
+    }
+
+    fn destroySocket(self: *Network, s: *Socket) void {
+        switch (s.*) {
+            .listener => |*l| {
+                for (l.pending.items[l.head..]) |pending| self.close(pending.socket);
+                l.pending.deinit(self.allocator);
+            },
+            .endpoint => |*e| {
+                if (e.peer) |peer| {
+                    peer.peer = null;
+                    peer.eof_at_ns = @max(self.now_ns + peer.link.latency_ns, peer.lastArrivalNs());
+                }
+                e.deinit(self.allocator);
+            },
+        }
+        self.allocator.destroy(s);
+    }
+
+    fn serializationNs(link: Link, bytes: usize) u64 {
+        if (link.bandwidth == 0) return 0;
+        return @as(u64, bytes) * std.time.ns_per_s / link.bandwidth;
+    }
+
+    const vtable: Io.VTable = .{
+        .poll = ioPoll,
+        .accept = ioAccept,
+        .read = ioRead,
+        .writev = ioWritev,
+        .close = ioClose,
+        .milliTimestamp = ioMilliTimestamp,
+    };
+
+    fn cast(ptr: ?*anyopaque) *Network {
+        return @ptrCast(@alignCast(ptr.?));
+    }
+
+    fn ioPoll(ptr: ?*anyopaque, fds: []posix.pollfd, timeout_ms: i32) posix.PollError!usize {
+        return cast(ptr).poll(fds, timeout_ms);
+    }
+
+    fn ioAccept(ptr: ?*anyopaque, listener: posix.socket_t, address: *net.Address) posix.AcceptError!posix.socket_t {
+        return cast(ptr).accept(listener, address);
+    }
+
+    fn ioRead(ptr: ?*anyopaque, socket: posix.socket_t, buf: []u8) posix.ReadError!usize {
+        return cast(ptr).read(socket, buf);
+    }
+
+    fn ioWritev(ptr: ?*anyopaque, socket: posix.socket_t, iov: []const posix.iovec_const) posix.WriteError!usize {
+        return cast(ptr).writev(socket, iov);
+    }
+
+    fn ioClose(ptr: ?*anyopaque, socket: posix.socket_t) void {
+        cast(ptr).close(socket);
+    }
+
+    fn ioMilliTimestamp(ptr: ?*anyopaque) i64 {
+        return @intCast(cast(ptr).now_ns / std.time.ns_per_ms);
+    }
+};
@@ -0,0 +1,366 @@
+const std = @import("std");
+const builtin = @import("builtin");
+const net = std.net;
+const posix = std.posix;
+const Allocator = std.mem.Allocator;
+
+const config = @import("../config.zig");
+const protocol = @import("../protocol.zig");
+const Reader = @import("../reader.zig").Reader;
+const Writer = @import("../writer.zig").Writer;
+const Server = @import("../server/server.zig").Server;
+const LoopMonitor = @import("../server/metrics.zig").LoopMonitor;
+const network = @import("network.zig");
+const Network = network.Network;
+const Link = network.Link;
+
+const usage =
+    \\Usage: zignal simulate [--clients N] [--seconds N] [--seed N] [--interval MS]
+    \\                       [--reconnect PCT] [--slow PCT] [--burst-every MS] [--burst N]
+    \\
+;
+
+/// Virtual time at the start of a run: an arbitrary fixed epoch, so
+/// timestamps look plausible and runs repeat exactly.
+const EPOCH_NS: u64 = 1_700_000_000 * std.time.ns_per_s;
+/// Longest accepted time option, so nanosecond arithmetic cannot overflow.
+const MAX_OPTION_MS = std.time.ms_per_day;
+
+pub const Options = struct {
+    clients: usize = 1000,
+    seed: u64 = 1,
+    /// Length of the run in virtual time.
+    duration_ms: u64 = 60_000,
+    /// Mean time between messages from one client.
+    message_interval_ms: u64 = 5_000,
+    /// Chance, per client action, of dropping the connection and
+    /// reconnecting a little later.
+    reconnect_pct: u8 = 2,
+    /// Share of clients on a slow, small-buffered downlink that read only
+    /// a few times per second.
+    slow_pct: u8 = 5,
+    /// Every connected client sends `burst_size` messages at once this
+    /// often; 0 disables bursts.
+    burst_every_ms: u64 = 10_000,
+    burst_size: usize = 3,
+};
+
+pub const Report = struct {
+    virtual_ms: u64 = 0,
+    wall_ns: u64 = 0,
+    ticks: u64 = 0,
+    connects: u64 = 0,
+    reconnects: u64 = 0,
+    /// Connections the server closed, e.g. after a corrupt frame.
+    dropped: u64 = 0,
+    sent: u64 = 0,
+    /// Sends that found the uplink full.
+    send_blocked: u64 = 0,
+    delivered: u64 = 0,
+    /// Deliveries older than one already seen from the same sender.
+    out_of_order: u64 = 0,
+    /// Streams that stopped parsing, e.g. after a partial server write.
+    corrupt: u64 = 0,
+    max_connected: usize = 0,
+    /// Hash of every delivery in order; equal for equal seeds.
+    digest: u64 = 0,
+};
+
+const SimClient = struct {
+    id: u32,
+    socket: ?posix.socket_t = null,
+    reader: Reader,
+    slow: bool,
+    next_action_ns: u64,
+    next_read_ns: u64 = 0,
+    seq: u32 = 0,
+};
+
+const Sim = struct {
+    allocator: Allocator,
+    options: Options,
+    net: Network,
+    random: std.Random,
+    listener: posix.socket_t,
+    clients: []SimClient,
+    /// Last sequence number each receiver saw from each sender.
+    last_seen: std.AutoHashMapUnmanaged(u64, u32) = .{},
+    hasher: std.hash.Wyhash,
+    report: Report = .{},
+
+    fn interval(self: *Sim, mean_ms: u64) u64 {
+        return self.random.uintAtMost(u64, 2 * mean_ms * std.time.ns_per_ms);
+    }
+
+    fn act(self: *Sim, client: *SimClient) !void {
+        const now = self.net.now_ns;
+        const socket = client.socket orelse {
+            const fast: Link = .{};
+            const slow: Link = .{ .latency_ns = 40 * std.time.ns_per_ms, .bandwidth = 16 * 1024, .buffer = 8 * 1024 };
+            const address = net.Address.initIp4(.{ 10, @truncate(client.id >> 16), @truncate(client.id >> 8), @truncate(client.id) }, 40000);
+            client.socket = try self.net.connect(self.listener, address, fast, if (client.slow) slow else fast);
+            client.reader.start = 0;
+            client.reader.pos = 0;
+            self.report.connects += 1;
+            client.next_action_ns = now + self.interval(self.options.message_interval_ms);
+            return;
+        };
+
+        if (self.random.uintLessThan(u8, 100) < self.options.reconnect_pct) {
+            self.disconnect(client);
+            self.report.reconnects += 1;
+            client.next_action_ns = now + std.time.ns_per_ms * self.random.intRangeAtMost(u64, 100, 2_000);
+            return;
+        }
+
+        try self.send(client, socket);
+        client.next_action_ns = now + self.interval(self.options.message_interval_ms);
+    }
+
+    fn send(self: *Sim, client: *SimClient, socket: posix.socket_t) !void {
+        var buf: [64]u8 = undefined;
+        const msg = try std.fmt.bufPrint(&buf, "sim{d}: {d}", .{ client.id, client.seq });
+        client.seq += 1;
+        Writer.writeToSocketIo(self.net.io(), socket, msg) catch |err| switch (err) {
+            error.WouldBlock => {
+                self.report.send_blocked += 1;
+                return;
+            },
+            else => return err,
+        };
+        self.report.sent += 1;
+    }
+
+    fn disconnect(self: *Sim, client: *SimClient) void {
+        const socket = client.socket orelse return;
+        self.net.close(socket);
+        client.socket = null;
+    }
+
+    fn receive(self: *Sim, client: *SimClient) !void {
+        const socket = client.socket orelse return;
+        if (client.slow) {
+            if (self.net.now_ns < client.next_read_ns) return;
+            client.next_read_ns = self.net.now_ns + 250 * std.time.ns_per_ms;
+        }
+
+        while (true) {
+            const msg = client.reader.readMessageIo(self.net.io(), socket) catch |err| {
+                if (err == error.Closed) {
+                    self.report.dropped += 1;
+                } else {
+                    self.report.corrupt += 1;
+                }
+                self.disconnect(client);
+                client.next_action_ns = self.net.now_ns + std.time.ns_per_s;
+                return;
+            } orelse return;
+            self.deliver(client, msg) catch |err| switch (err) {
+                // Nothing after a bad frame can be trusted.
+                error.CorruptFrame => {
+                    self.report.corrupt += 1;
+                    self.disconnect(client);
+                    client.next_action_ns = self.net.now_ns + std.time.ns_per_s;
+                    return;
+                },
+                else => return err,
+            };
+        }
+    }
+
+    fn deliver(self: *Sim, client: *SimClient, msg: []const u8) !void {
+        if (std.mem.startsWith(u8, msg, "[Server]") or protocol.isControl(msg)) return;
+
+        const parsed = parseFrame(msg) orelse return error.CorruptFrame;
+        self.report.delivered += 1;
+        self.hasher.update(std.mem.asBytes(&[_]u32{ client.id, parsed.sender, parsed.seq }));
+
+        const key = (@as(u64, client.id) << 32) | parsed.sender;
+        const gop = try self.last_seen.getOrPut(self.allocator, key);
+        if (gop.found_existing and parsed.seq <= gop.value_ptr.*) {
+            self.report.out_of_order += 1;
+        }
+        gop.value_ptr.* = parsed.seq;
+    }
+
+    fn parseFrame(msg: []const u8) ?struct { sender: u32, seq: u32 } {
+        if (!std.mem.startsWith(u8, msg, "sim")) return null;
+        const colon = std.mem.indexOf(u8, msg, ": ") orelse return null;
+        const sender = std.fmt.parseInt(u32, msg[3..colon], 10) catch return null;
+        const seq = std.fmt.parseInt(u32, msg[colon + 2 ..], 10) catch return null;
+        return .{ .sender = sender, .seq = seq };
+    }
+};
+
+/// Runs a server event loop against `options.clients` simulated clients on
+/// an in-memory network with a seeded virtual clock. Clients connect at
+/// staggered times, chat, drop and reconnect, some sit on slow links and
+/// all of them send in periodic bursts. The same options always produce
+/// the same report, including its digest of every delivery.
+pub fn simulate(allocator: Allocator, options: Options) !Report {
+    var wall = try std.time.Timer.start();
+
+    var prng = std.Random.DefaultPrng.init(options.seed);
+    var sim: Sim = .{
+        .allocator = allocator,
+        .options = options,
+        .net = Network.init(allocator, EPOCH_NS),
+        .random = prng.random(),
+        .listener = undefined,
+        .clients = &.{},
+        .hasher = std.hash.Wyhash.init(options.seed),
+    };
+    defer sim.net.deinit();
+    defer sim.last_seen.deinit(allocator);
+
+    sim.listener = try sim.net.listen();
+
+    // Old connections linger on the server until it sees their close.
+    var server = try Server.init(allocator, net.Address.initIp4(.{ 0, 0, 0, 0 }, 0), options.clients + options.clients / 4 + 16);
+    defer server.deinit();
+    server.headless = true;
+    server.io = sim.net.io();
+    server.adoptListener(sim.listener);
+    var monitor = try LoopMonitor.init(&server.metrics.loop, 50 * std.time.ns_per_ms);
+
+    const clients = try allocator.alloc(SimClient, options.clients);
+    defer allocator.free(clients);
+    var initialized: usize = 0;
+    defer for (clients[0..initialized]) |*client| client.reader.deinit(allocator);
+    for (clients, 0..) |*client, i| {
+        client.* = .{
+            .id = @intCast(i),
+            .reader = try Reader.init(allocator, config.BUFFER_SIZE),
+            .slow = sim.random.uintLessThan(u8, 100) < options.slow_pct,
+            .next_action_ns = EPOCH_NS + sim.random.uintLessThan(u64, 2 * std.time.ns_per_s),
+        };
+        initialized += 1;
+    }
+    sim.clients = clients;
+    // Close client sockets before the network goes away.
+    defer for (clients) |*client| sim.disconnect(client);
+
+    const end_ns = EPOCH_NS + options.duration_ms * std.time.ns_per_ms;
+    const burst_ns = options.burst_every_ms * std.time.ns_per_ms;
+    var next_burst_ns = if (burst_ns != 0) EPOCH_NS + burst_ns else std.math.maxInt(u64);
+
+    while (sim.net.now_ns < end_ns) {
+        const now = sim.net.now_ns;
+        var wake = @min(end_ns, next_burst_ns);
+
+        if (now >= next_burst_ns) {
+            for (clients) |*client| {
+                const socket = client.socket orelse continue;
+                for (0..options.burst_size) |_| try sim.send(client, socket);
+            }
+            next_burst_ns += burst_ns;
+        }
+
+        for (clients) |*client| {
+            if (now >= client.next_action_ns) try sim.act(client);
+            try sim.receive(client);
+            wake = @min(wake, client.next_action_ns);
+            if (client.slow and client.socket != null) wake = @min(wake, client.next_read_ns);
+        }
+
+        sim.net.wake_ns = @max(wake, now + 1);
+        server.tick(&monitor, 100);
+        sim.report.ticks += 1;
+        sim.report.max_connected = @max(sim.report.max_connected, server.connected);
+    }
+
+    sim.report.virtual_ms = options.duration_ms;
+    sim.report.wall_ns = wall.read();
+    sim.hasher.update(std.mem.asBytes(&[_]u64{ sim.report.sent, sim.report.delivered, sim.report.connects }));
+    sim.report.digest = sim.hasher.final();
+    return sim.report;
+}
+
+/// Command line front end for `simulate`.
+pub fn run(allocator: Allocator, args: []const []const u8) !void {
+    var options: Options = .{};
+
+    var arg_index: usize = 0;
+    while (arg_index < args.len) : (arg_index += 2) {
+        const flag = args[arg_index];
+        if (arg_index + 1 >= args.len) {
+            std.debug.print("Error: {s} requires a value.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+        const value = std.fmt.parseInt(u64, args[arg_index + 1], 10) catch {
+            std.debug.print("Error: Invalid {s} value '{s}'.\n{s}", .{ flag, args[arg_index + 1], usage });
+            return error.InvalidArguments;
+        };
+        const is_seconds = std.mem.eql(u8, flag, "--seconds");
+        const is_time = is_seconds or std.mem.eql(u8, flag, "--interval") or std.mem.eql(u8, flag, "--burst-every");
+        const ms = if (is_seconds) std.math.mul(u64, value, std.time.ms_per_s) catch std.math.maxInt(u64) else value;
+        if (is_time and ms > MAX_OPTION_MS) {
+            std.debug.print("Error: {s} value '{s}' is out of range (at most {d}ms).\n{s}", .{ flag, args[arg_index + 1], MAX_OPTION_MS, usage });
+            return error.InvalidArguments;
+        }
+
+        if (std.mem.eql(u8, flag, "--clients")) {
+            options.clients = @max(1, value);
+        } else if (is_seconds) {
+            options.duration_ms = ms;
+        } else if (std.mem.eql(u8, flag, "--seed")) {
+            options.seed = value;
+        } else if (std.mem.eql(u8, flag, "--interval")) {
+            options.message_interval_ms = @max(1, value);
+        } else if (std.mem.eql(u8, flag, "--reconnect")) {
+            options.reconnect_pct = @intCast(@min(value, 100));
+        } else if (std.mem.eql(u8, flag, "--slow")) {
+            options.slow_pct = @intCast(@min(value, 100));
+        } else if (std.mem.eql(u8, flag, "--burst-every")) {
+            options.burst_every_ms = value;
+        } else if (std.mem.eql(u8, flag, "--burst")) {
+            options.burst_size = value;
+        } else {
+            std.debug.print("Error: Unknown simulate option '{s}'.\n{s}", .{ flag, usage });
+            return error.InvalidArguments;
+        }
+    }
+
+    const report = try simulate(allocator, options);
+
+    var buffer: [1024]u8 = undefined;
+    var stdout_writer = std.fs.File.stdout().writer(&buffer);
+    const out = &stdout_writer.interface;
+
+    try out.print("{d} clients, {d}s virtual in {d:.2}s wall ({d} loop iterations), seed {d}\n", .{
+        options.clients,
+        report.virtual_ms / std.time.ms_per_s,
+        @as(f64, @floatFromInt(report.wall_ns)) / std.time.ns_per_s,
+        report.ticks,
+        options.seed,
+    });
+    try out.print("connects {d}, reconnects {d}, closed by server {d}, peak connected {d}\n", .{
+        report.connects, report.reconnects, report.dropped, report.max_connected,
+    });
+    try out.print("sent {d} (blocked {d}), delivered {d}, out of order {d}, corrupt streams {d}\n", .{
+        report.sent, report.send_blocked, report.delivered, report.out_of_order, report.corrupt,
+    });
+    try out.print("digest {x:0>16}\n", .{report.digest});
+    try out.flush();
+}
+
+test "simulation is reproducible for a seed" {
+    if (builtin.os.tag != .linux) return error.SkipZigTest;
+
+    const testing = std.testing;
+    const options: Options = .{
+        .clients = 200,
+        .seed = 42,
+        .duration_ms = 20_000,
+        .message_interval_ms = 1_000,
+    };
+
+    const first = try simulate(testing.allocator, options);
+    const second = try simulate(testing.allocator, options);
+
+    try testing.expect(first.delivered > 0);
+    try testing.expectEqual(@as(u64, 0), first.out_of_order);
+    try testing.expectEqual(first.digest, second.digest);
+    try testing.expectEqual(first.delivered, second.delivered);
+    try testing.expectEqual(first.ticks, second.ticks);
+}
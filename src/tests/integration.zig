@@ -0,0 +1,69 @@
+const std = @import("std");
+const testing = std.testing;
+
+const loadgen = @import("../bench/loadgen.zig");
+
+/// Send-to-receive p99 budgets. Generous enough for debug builds on a
+/// loaded CI machine, tight enough to catch a blocking call or a quadratic
+/// fan-out creeping into the event loop.
+const small_room_p99_us = 20 * std.time.us_per_ms;
+const large_room_p99_us = 250 * std.time.us_per_ms;
+
+/// Checks that every broadcast reached every other client intact, in the
+/// order each sender sent them, within the latency budget.
+fn expectClean(result: loadgen.Result, p99_budget_us: u64) !void {
+    try testing.expect(result.sent > 0);
+    try testing.expectEqual(result.expected, result.delivered);
+    try testing.expectEqual(@as(u64, 0), result.out_of_order);
+    try testing.expectEqual(@as(u64, 0), result.corrupt);
+
+    const p99 = result.latency.percentile(99);
+    if (p99 > p99_budget_us) {
+        std.debug.print("p99 latency {d}us is over the {d}us budget\n", .{ p99, p99_budget_us });
+        return error.LatencyBudgetExceeded;
+    }
+}
+
+test "small room delivers every message in order" {
+    const server = try loadgen.HeadlessServer.start(testing.allocator, 16);
+    defer server.stop();
+
+    const result = try loadgen.run(testing.allocator, server.address(), .{
+        .clients = 8,
+        .messages_per_client = 200,
+        .message_size = 64,
+        .rate = 4000,
+        .idle_timeout_ms = 2000,
+    });
+    try expectClean(result, small_room_p99_us);
+}
+
+test "hundreds of clients receive every broadcast in order" {
+    const server = try loadgen.HeadlessServer.start(testing.allocator, 300);
+    defer server.stop();
+
+    // Throttled so that receivers keep up: the server drops frames to
+    // sockets whose send buffer is full.
+    const result = try loadgen.run(testing.allocator, server.address(), .{
+        .clients = 250,
+        .messages_per_client = 8,
+        .message_size = 96,
+        .rate = 2000,
+        .idle_timeout_ms = 2000,
+    });
+    try expectClean(result, large_room_p99_us);
+}
+
+test "maximum-size frames are relayed intact" {
+    const server = try loadgen.HeadlessServer.start(testing.allocator, 4);
+    defer server.stop();
+
+    const result = try loadgen.run(testing.allocator, server.address(), .{
+        .clients = 3,
+        .messages_per_client = 100,
+        .message_size = std.math.maxInt(usize),
+        .rate = 2000,
+        .idle_timeout_ms = 2000,
+    });
+    try expectClean(result, small_room_p99_us);
+}
@@ -0,0 +1,168 @@
+const std = @import("std");
+const Allocator = std.mem.Allocator;
+
+/// Opt-in span tracer that writes Chrome/Perfetto trace-event JSON.
+/// Each thread records begin/end events into its own preallocated buffer,
+/// so recording is a bounds check and a store. When tracing is off every
+/// call returns after a single load.
+pub const MAX_THREADS = 8;
+pub const EVENTS_PER_THREAD = 256 * 1024;
+
+const Event = struct {
+    name: [*:0]const u8,
+    timestamp_ns: u64,
+    phase: u8,
+};
+
+const Buffer = struct {
+    name: []const u8,
+    tid: usize,
+    events: []Event,
+    len: usize,
+    dropped: u64,
+};
+
+/// Read by every traced thread; `init` publishes the settings below
+/// with its release store.
+var active: std.atomic.Value(bool) = .init(false);
+var allocator: Allocator = undefined;
+var path_buf: [std.fs.max_path_bytes]u8 = undefined;
+var path_len: usize = 0;
+var start_ns: i128 = 0;
+var buffers: [MAX_THREADS]*Buffer = undefined;
+var buffer_count: std.atomic.Value(usize) = .init(0);
+threadlocal var local_buffer: ?*Buffer = null;
+
+/// Enables tracing. Events are written to `path` by `deinit`.
+pub fn init(gpa: Allocator, path: []const u8) !void {
+    if (path.len > path_buf.len) return error.NameTooLong;
+    @memcpy(path_buf[0..path.len], path);
+    path_len = path.len;
+    allocator = gpa;
+    start_ns = std.time.nanoTimestamp();
+    active.store(true, .release);
+}
+
+/// Writes the trace file and frees all thread buffers. Every traced thread
+/// must have stopped recording before this is called.
+pub fn deinit() void {
+    if (!active.swap(false, .acq_rel)) return;
+
+    writeFile() catch |err| {
+        std.debug.print("Failed to write trace file: {}\n", .{err});
+    };
+
+    const count = @min(buffer_count.load(.acquire), MAX_THREADS);
+    for (buffers[0..count]) |buffer| {
+        allocator.free(buffer.events);
+        allocator.destroy(buffer);
+    }
+    buffer_count.store(0, .release);
+}
+
+/// Allocates the calling thread's event buffer. A no-op when tracing is off.
+pub fn registerThread(name: []const u8) void {
+    if (!active.load(.acquire) or local_buffer != null) return;
+
+    const buffer = allocator.create(Buffer) catch return;
+    const events = allocator.alloc(Event, EVENTS_PER_THREAD) catch {
+        allocator.destroy(buffer);
+        return;
+    };
+
+    const idx = buffer_count.fetchAdd(1, .acq_rel);
+    if (idx >= MAX_THREADS) {
+        allocator.free(events);
+        allocator.destroy(buffer);
+        return;
+    }
+
+    buffer.* = .{
+        .name = name,
+        .tid = idx + 1,
+        .events = events,
+        .len = 0,
+        .dropped = 0,
+    };
+    buffers[idx] = buffer;
+    local_buffer = buffer;
+}
+
+pub inline fn begin(comptime name: [:0]const u8) void {
+    if (!active.load(.acquire)) return;
+    emit(name, 'B');
+}
+
+pub inline fn end(comptime name: [:0]const u8) void {
+    if (!active.load(.acquire)) return;
+    emit(name, 'E');
+}
+
+pub const Span = struct {
+    name: [*:0]const u8,
+
+    pub inline fn end(self: Span) void {
+        if (!active.load(.acquire)) return;
+        emit(self.name, 'E');
+    }
+};
+
+pub inline fn span(comptime name: [:0]const u8) Span {
+    begin(name);
+    return .{ .name = name };
+}
+
+fn emit(name: [*:0]const u8, phase: u8) void {
+    const buffer = local_buffer orelse return;
+    if (buffer.len == buffer.events.len) {
+        buffer.dropped += 1;
+        return;
+    }
+
+    buffer.events[buffer.len] = .{
+        .name = name,
+        .timestamp_ns = @intCast(std.time.nanoTimestamp() - start_ns),
+        .phase = phase,
+    };
+    buffer.len += 1;
+}
+
+fn writeFile() !void {
+    const file = try std.fs.cwd().createFile(path_buf[0..path_len], .{ .truncate = true });
+    defer file.close();
+
+    var write_buf: [64 * 1024]u8 = undefined;
+    var file_writer = file.writer(&write_buf);
+    const w = &file_writer.interface;
+
+    try w.writeAll("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    var first = true;
+    const count = @min(buffer_count.load(.acquire), MAX_THREADS);
+    for (buffers[0..count]) |buffer| {
+        if (!first) try w.writeAll(",\n");
+        first = false;
+        try w.print("{{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":{d},\"args\":{{\"name\":\"{s}\"}}}}", .{
+            buffer.tid, buffer.name,
+        });
+
+        for (buffer.events[0..buffer.len]) |event| {
+            try w.print(",\n{{\"name\":\"{s}\",\"ph\":\"{c}\",\"ts\":{d}.{d:0>3},\"pid\":1,\"tid\":{d}}}", .{
+                std.mem.span(event.name),
+                event.phase,
+                event.timestamp_ns / std.time.ns_per_us,
+                event.timestamp_ns % std.time.ns_per_us,
+                buffer.tid,
+            });
+        }
+
+        if (buffer.dropped > 0) {
+            std.debug.print("Trace buffer for thread '{s}' overflowed, {d} events dropped\n", .{
+                buffer.name, buffer.dropped,
+            });
+        }
+    }
+
+    try w.writeAll("\n]}\n");
+    try w.flush();
+}
@@ -115,6 +115,40 @@ pub fn ScrollableList(comptime T: type) type {
             }
         }
 
+        /// Like `draw`, leaving out the items `is_visible` rejects; the
+        /// scroll offset counts visible items only. Costs the rows drawn
+        /// plus any hidden items between them.
+        pub fn drawVisible(
+            self: *Self,
+            area: Window,
+            max_lines: u16,
+            is_visible: fn (*const T) bool,
+            render_fn: fn (*const T, u16, Window) void,
+        ) void {
+            if (max_lines == 0) return;
+            const items = self.items.items;
+
+            var end = items.len;
+            var skipped: usize = 0;
+            while (end > 0 and skipped < self.scroll_offset) : (end -= 1) {
+                if (is_visible(&items[end - 1])) skipped += 1;
+            }
+            self.scroll_offset = skipped;
+
+            var start = end;
+            var shown: usize = 0;
+            while (start > 0 and shown < max_lines) : (start -= 1) {
+                if (is_visible(&items[start - 1])) shown += 1;
+            }
+
+            var row: u16 = 0;
+            for (items[start..end]) |*item| {
+                if (!is_visible(item)) continue;
+                render_fn(item, row, area);
+                row += 1;
+            }
+        }
+
         pub fn drawFiltered(
             self: *Self,
             area: Window,
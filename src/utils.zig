@@ -1,6 +1,8 @@
 const std = @import("std");
 const vaxis = @import("vaxis");
 
+const config = @import("config.zig");
+
 const Cell = vaxis.Cell;
 
 pub const colors = struct {
@@ -44,27 +46,102 @@ pub const time = struct {
 
 pub fn printHelp(progName: []const u8) void {
     std.debug.print(
-        \\Usage: {s} <server|client> [OPTIONS]
+        \\Usage: {s} <command> [OPTIONS]
         \\
         \\Options:
         \\  server [OPTIONS]                    Start the server.
         \\  client [OPTIONS] <IP> <PORT>        Start the client and connect to the specified IP and PORT.
+        \\  logcat <FILE>...                    Decode binary server log files to text.
+        \\  bench [OPTIONS]                     Load-test a headless server with each allocator backend.
+        \\  bench-compare [OPTIONS]             Run the benchmark suite and compare it with a stored baseline.
+        \\  bench-scale [--counts N,N,...]      Measure memory, accept rate and broadcast time vs. idle connections.
+        \\  bench-render [OPTIONS]              Time client and server TUI rendering offscreen with large histories.
+        \\  replay <FILE> <IP> <PORT>           Re-drive a server with traffic recorded by --capture.
+        \\  netem-proxy <LPORT> <IP> <PORT>     Proxy to a server with injected latency, stalls and resets.
+        \\  simulate [OPTIONS]                  Run the server loop against simulated clients on a virtual network.
         \\
         \\Server Options:
         \\  -p, --port <port>       Set the server port (default: 8080, 0 for any available)
-        \\  -s, --size <size>       Set max number of clients (1-4095, default: 4095)
+    ++ std.fmt.comptimePrint("\n  -s, --size <size>       Set max number of clients (1-{d}, default: {d})\n", .{ config.MAX_CONNECTIONS, config.MAX_CONNECTIONS }) ++
+        \\  --log-file <path>       Write binary logs to <path>, rotated to <path>.1 ... <path>.5
+        \\  --flight-dump <path>    Flight recorder dump file (default: zignal-flight.log, written on SIGUSR1/crash)
+        \\  --trace <path>          Write Chrome trace-event JSON to <path> on exit
+        \\  --capture <path>        Record connections and inbound frames to <path> for replay
+        \\  --vhost <name>[:<size>] Add a virtual host with its own room, joined by name (repeatable);
+        \\                          append ,slow=<ms> ,rate=<n> ,burst=<n> to override the limits below
+        \\  --history <n>           Frames each room replays to clients as they join (0-256, default: 0)
+        \\  --slow-mode <ms>        Least time between messages from one user in a room (default: off)
+        \\  --room-rate <msg/s>     Messages per second each room may relay (default: unlimited)
+        \\  --room-burst <n>        Messages a room may relay back to back (default: one second's worth)
+        \\  --mem-soft <MiB>        Refuse new connections above this (default: off)
+        \\  --mem-hard <MiB>        Evict the heaviest connections above this (default: off)
+        \\  --conn-quota <bytes>    Pause reads from a connection with more than this unrelayed,
+    ++ std.fmt.comptimePrint("\n                          below the {d}-byte reader buffer (default: off)\n", .{config.BUFFER_SIZE}) ++
+        \\  --self-test             Find the largest fan-out this host sustains on loopback, then exit
+        \\  --slo-p99 <ms>          Latency SLO for --self-test (default: 50)
         \\
         \\Client Options:
         \\  -u, --username <name>   Set username for chat messages (max 23 characters)
+        \\  --host <name>           Join this virtual host instead of the default room
+        \\  --trace <path>          Write Chrome trace-event JSON to <path> on exit
+        \\
+        \\Bench Options:
+        \\  --clients <n>           Connected clients (default: 50)
+        \\  --messages <n>          Messages sent per client (default: 200)
+        \\  --size <bytes>          Message size (default: 64)
+        \\  --rate <msg/s>          Total send rate, 0 for unthrottled (default: 0)
+        \\  --allocator <name>      all, gpa, smp or c (default: all)
+        \\
+        \\Bench-compare Options:
+        \\  --baseline <path>       Baseline results (default: bench/baseline.json)
+        \\  --threshold <pct>       Allowed regression for every benchmark, overriding the baseline file
+        \\  --runs <n>              Runs per benchmark; the median is compared (default: 3)
+        \\  --write                 Store the results as the new baseline
+        \\  --ci                    Fail when a benchmark has no baseline (default when CI is set)
+        \\
+        \\Replay Options:
+        \\  --speed <N|max>         Playback speed as a multiple of the captured timing, or max (default: 1)
+        \\
+        \\Netem-proxy Options:
+        \\  --latency <ms>          One-way delay added in each direction (default: 0)
+        \\  --jitter <ms>           Random extra delay of up to +/- this much, order preserved (default: 0)
+        \\  --bandwidth <KiB/s>     Per-direction cap for each connection (default: unlimited)
+        \\  --stall-every <ms>      Mean time between delivery stalls (default: off)
+        \\  --stall <ms>            Length of each stall (default: 500)
+        \\  --reset-after <ms>      Mean connection lifetime before an injected reset (default: off)
+        \\  --seed <n>              Random seed, for repeatable runs (default: random)
+        \\
+        \\Simulate Options:
+        \\  --clients <n>           Simulated clients (default: 1000)
+        \\  --seconds <n>           Virtual run time (default: 60)
+        \\  --seed <n>              Random seed; equal seeds give identical runs (default: 1)
+        \\  --interval <ms>         Mean time between messages per client (default: 5000)
+        \\  --reconnect <pct>       Chance per client action of reconnecting (default: 2)
+        \\  --slow <pct>            Share of clients on slow links (default: 5)
+        \\  --burst-every <ms>      Time between bursts from every client, 0 for none (default: 10000)
+        \\  --burst <n>             Messages per client per burst (default: 3)
+        \\
+        \\Environment:
+        \\  ZIGNAL_ALLOCATOR        Allocator backend: gpa, smp or c (default: set at build time)
+        \\  ZIGNAL_ALLOC_PROFILE    Print allocation counts per call site on exit when set
         \\
         \\Examples:
         \\  {s} server
         \\  {s} server -p 9000
         \\  {s} server --port 0 --size 100
+        \\  {s} server --log-file zignal.log
+        \\  {s} logcat zignal.log
+        \\  {s} bench --clients 200 --allocator smp
+        \\  {s} server --self-test --size 1000
+        \\  {s} server --capture traffic.cap
+        \\  {s} server --vhost team-a --vhost team-b:50 --history 20
+        \\  {s} server --vhost news,slow=10000,rate=5 --history 20
+        \\  {s} replay traffic.cap 127.0.0.1 8080 --speed 10
         \\  {s} client 127.0.0.1 8080
         \\  {s} client -u Alice 127.0.0.1 8080
         \\  {s} client 127.0.0.1 8080 -u Bob
         \\  {s} client --username Charlie 127.0.0.1 8080
+        \\  {s} client --host team-a -u Dana 127.0.0.1 8080
         \\
-    , .{ progName, progName, progName, progName, progName, progName, progName, progName });
+    , .{ progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName, progName });
 }
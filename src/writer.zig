@@ -1,6 +1,10 @@
 const std = @import("std");
 const posix = std.posix;
 
+const instrument = @import("instrument.zig");
+const Io = @import("io.zig").Io;
+const trace = @import("trace.zig");
+
 pub const Writer = struct {
     socket: posix.socket_t,
 
@@ -31,6 +35,11 @@ pub const Writer = struct {
     }
 
     pub fn writeToSocket(socket: posix.socket_t, message: []const u8) !void {
+        return writeToSocketIo(Io.system, socket, message);
+    }
+
+    /// Like `writeToSocket`, writing through `io`.
+    pub fn writeToSocketIo(io: Io, socket: posix.socket_t, message: []const u8) !void {
         var len_buf: [4]u8 = undefined;
         std.mem.writeInt(u32, &len_buf, @intCast(message.len), .little);
 
@@ -39,7 +48,7 @@ pub const Writer = struct {
             .{ .base = message.ptr, .len = message.len },
         };
 
-        _ = try posix.writev(socket, &vec);
+        _ = try io.writev(socket, &vec);
     }
 
     pub fn writeToSocketSafe(socket: posix.socket_t, message: []const u8) bool {
@@ -51,6 +60,15 @@ pub const Writer = struct {
     }
 
     pub fn broadcastMessage(sockets: []const posix.socket_t, message: []const u8, excludeSocket: ?posix.socket_t) void {
+        broadcastMessageIo(Io.system, sockets, message, excludeSocket);
+    }
+
+    /// Like `broadcastMessage`, writing through `io`.
+    pub fn broadcastMessageIo(io: Io, sockets: []const posix.socket_t, message: []const u8, excludeSocket: ?posix.socket_t) void {
+        instrument.observe("writer.fanout", sockets.len);
+        const span = instrument.span("writer.broadcast");
+        defer span.end();
+
         var len_buf: [4]u8 = undefined;
         std.mem.writeInt(u32, &len_buf, @intCast(message.len), .little);
 
@@ -64,10 +82,100 @@ pub const Writer = struct {
                 .{ .base = message.ptr, .len = message.len },
             };
 
-            _ = posix.writev(socket, &vec) catch |err| {
-                std.log.warn("[Writer]: Failed to broadcast to socket: {}", .{err});
+            const write_span = trace.span("write");
+            defer write_span.end();
+            instrument.count("writer.writev", 1);
+            _ = io.writev(socket, &vec) catch |err| switch (err) {
+                // A full socket is routine with slow consumers; logging
+                // each dropped frame would cost more than the write.
+                error.WouldBlock => instrument.count("writer.would_block", 1),
+                else => {
+                    instrument.count("writer.errors", 1);
+                    std.log.warn("[Writer]: Failed to broadcast to socket: {}", .{err});
+                },
+            };
+        }
+    }
+
+    /// Sends already framed bytes, such as a `Reader.Batch.wire`, to every
+    /// socket but `excludeSocket` with one write each, however many
+    /// frames they hold.
+    pub fn broadcastFramesIo(io: Io, sockets: []const posix.socket_t, frames: []const u8, excludeSocket: ?posix.socket_t) void {
+        instrument.observe("writer.fanout", sockets.len);
+        instrument.observe("writer.batch_bytes", frames.len);
+        const span = instrument.span("writer.broadcast");
+        defer span.end();
+
+        const vec = [_]posix.iovec_const{.{ .base = frames.ptr, .len = frames.len }};
+        for (sockets) |socket| {
+            if (excludeSocket) |exclude| {
+                if (socket == exclude) continue;
+            }
+
+            const write_span = trace.span("write");
+            defer write_span.end();
+            instrument.count("writer.writev", 1);
+            _ = io.writev(socket, &vec) catch |err| switch (err) {
+                error.WouldBlock => instrument.count("writer.would_block", 1),
+                else => {
+                    instrument.count("writer.errors", 1);
+                    std.log.warn("[Writer]: Failed to broadcast to socket: {}", .{err});
+                },
+            };
+        }
+    }
+
+    /// Writes all of `iov` through `io`, polling a full socket until
+    /// `deadline_ms` on `io`'s clock. Returns the bytes written, fewer than
+    /// asked if the socket failed or stayed full. Consumes `iov`.
+    pub fn writevAllIo(io: Io, socket: posix.socket_t, iov: []posix.iovec_const, deadline_ms: i64) usize {
+        var rest = iov;
+        var written: usize = 0;
+        while (rest.len > 0) {
+            const n = io.writev(socket, rest) catch |err| switch (err) {
+                error.WouldBlock => {
+                    const wait = deadline_ms - io.milliTimestamp();
+                    if (wait <= 0) return written;
+                    var pfd = [_]posix.pollfd{.{ .fd = socket, .events = posix.POLL.OUT, .revents = 0 }};
+                    _ = io.poll(&pfd, @intCast(@min(wait, std.math.maxInt(i32)))) catch return written;
+                    continue;
+                },
+                else => return written,
             };
+            written += n;
+            rest = skipBytes(rest, n);
+        }
+        return written;
+    }
+
+    /// Drops the first `n` bytes from `iov`, shortening its first run in
+    /// place.
+    pub fn skipBytes(iov: []posix.iovec_const, n: usize) []posix.iovec_const {
+        var rest = iov;
+        var left = n;
+        while (rest.len > 0 and left >= rest[0].len) {
+            left -= rest[0].len;
+            rest = rest[1..];
+        }
+        if (rest.len > 0) {
+            rest[0].base += left;
+            rest[0].len -= left;
+        }
+        return rest;
+    }
+
+    /// Cuts `iov` down to its first `n` bytes, shortening its last run in
+    /// place.
+    pub fn takeBytes(iov: []posix.iovec_const, n: usize) []posix.iovec_const {
+        var left = n;
+        for (iov, 0..) |*run, i| {
+            if (left <= run.len) {
+                run.len = left;
+                return iov[0 .. i + @intFromBool(left > 0)];
+            }
+            left -= run.len;
         }
+        return iov;
     }
 
     pub fn broadcastToAll(sockets: []const posix.socket_t, message: []const u8) void {